@@ -19,19 +19,19 @@ used by others.
 */
 
 // Compile on Linux for linux
-// gcc  -m32 avi2.c gui.c source/file64.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c jpg2raw.c -o avi2.exe -I. -I./source -lX11 -ljpeg -lasound -lm
-// gcc  -m64 avi2.c gui.c source/file64.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c jpg2raw.c -o avi2.exe -I. -I./source -lX11 -ljpeg -lasound -lm
+// gcc  -m32 avi2.c gui.c source/file64.c source/avi2_thread.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c jpg2raw.c -o avi2.exe -I. -I./source -lX11 -ljpeg -lasound -lm -lpthread
+// gcc  -m64 avi2.c gui.c source/file64.c source/avi2_thread.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c jpg2raw.c -o avi2.exe -I. -I./source -lX11 -ljpeg -lasound -lm -lpthread
 
 // Compile on linux for windows
-// i686-w64-mingw32-gcc  avi2.c gui.c source/file64.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c winjpeg.c -o avi2.exe -I. -I./source -O2 -lgdi32 -luser32 -lole32 -loleaut32 -lwinmm
-// x86_64-w64-mingw32-gcc avi2.c gui.c source/file64.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c winjpeg.c -o avi2.exe -I. -I./source -O2 -lgdi32 -luser32 -lole32 -loleaut32 -lwinmm
+// i686-w64-mingw32-gcc  avi2.c gui.c source/file64.c source/avi2_thread.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c winjpeg.c -o avi2.exe -I. -I./source -O2 -lgdi32 -luser32 -lole32 -loleaut32 -lwinmm
+// x86_64-w64-mingw32-gcc avi2.c gui.c source/file64.c source/avi2_thread.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c winjpeg.c -o avi2.exe -I. -I./source -O2 -lgdi32 -luser32 -lole32 -loleaut32 -lwinmm
 
 // Compile on windows using Borland C
-// bcc32.exe -4 -Isource avi2.c audio2.c gui.c  source/avi2_common.c source/avi2_read.c source/avi2_write.c source/file64.c jpg2raw.c jpeg6lib.lib
+// bcc32.exe -4 -Isource avi2.c audio2.c gui.c  source/avi2_common.c source/avi2_read.c source/avi2_write.c source/file64.c source/avi2_thread.c jpg2raw.c jpeg6lib.lib
 
 // Compile with Tiny C
-// tcc  -m32 -w avi2.c gui.c source/file64.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c jpg2raw.c -o avi2.exe -I. -I./source -lX11 -ljpeg -lasound -lm
-// tcc  -m64 -w avi2.c gui.c source/file64.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c jpg2raw.c -o avi2.exe -I. -I./source -lX11 -ljpeg -lasound -lm
+// tcc  -m32 -w avi2.c gui.c source/file64.c source/avi2_thread.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c jpg2raw.c -o avi2.exe -I. -I./source -lX11 -ljpeg -lasound -lm -lpthread
+// tcc  -m64 -w avi2.c gui.c source/file64.c source/avi2_thread.c audio2.c source/avi2_write.c source/avi2_Read.c source/avi2_common.c jpg2raw.c -o avi2.exe -I. -I./source -lX11 -ljpeg -lasound -lm -lpthread
 
 
 
@@ -84,6 +84,7 @@ int BufJpegSize, VidBufSize;   // in bytes
 BYTE *BufJpeg;
 
 DWORD StartAtFrame = 0;  // frame playback starts at
+DWORD AudSkip = 0;       // audio bytes to drop after a seek
 
 #define INTERVAL_MS (DWORD)(1000.0 / avi->fps)
 
@@ -105,7 +106,7 @@ int initVideo(char *fname)
     char fnameout[256];
     int err;
 
-    avi = AVI_Open(fname, FOR_READING | AUTO_INDEX, &err);   // open avi
+    avi = AVI_Open(fname, FOR_READING | AUTO_INDEX | MEMORY_MAPPED, &err);   // open avi
     if (!avi)
     {
         if (err)
@@ -193,8 +194,24 @@ void ConvertBGRtoRGB(void)
 int GetFrame(void)
 {
     int len, rt = FALSE;
+    DWORD PeekLen;
+    BYTE *FramePtr;
 
-    len = AVI_ReadVframe(avi, BufJpeg, BufJpegSize, NULL);
+    // If the file is memory mapped, decode straight from the mapping.
+    // Otherwise read a copy of the frame into our buffer.
+    FramePtr = (BYTE *) AVI_PeekVframe(avi, &PeekLen, NULL);
+    if (FramePtr)
+    {
+        len = PeekLen;
+    }
+    else
+    {
+        if (avi->AVIerr != AVIERR_NOT_SUPPORTED)
+            return(TRUE);
+
+        FramePtr = BufJpeg;
+        len = AVI_ReadVframe(avi, BufJpeg, BufJpegSize, NULL);
+    }
     if (len <= 0)
     {
         if (len < 0) printf("ReadVframe() returned error: %d\n", len);
@@ -202,7 +219,7 @@ int GetFrame(void)
     }
 
     // Write to new file
-    if (AVI_WriteVframe(aviout, BufJpeg, len, TRUE))
+    if (AVI_WriteVframe(aviout, FramePtr, len, TRUE))
     {
         printf("Failed to write frame.\n");
         return(TRUE);
@@ -212,13 +229,13 @@ int GetFrame(void)
     {
         DWORD jpegOutputSize = vWidth * vHeight * 3;
 
-        if (BufJpeg[0] != 0xFF)
+        if (FramePtr[0] != 0xFF)
         {
             printf("Not a JPEG at frame %d\n", avi->current_video_frame - 1);
         }
 
 
-        rt = DECODE_JPEG(pPixels, jpegOutputSize, BufJpeg, len);
+        rt = DECODE_JPEG(pPixels, jpegOutputSize, FramePtr, len);
         if (rt != 0)
         {
             printf("Jpg2Raw failed with error: %d\n", rt);
@@ -256,12 +273,14 @@ void FrameSeek(DWORD targetFrame, int NoAud, DWORD *pStartTime)
     double seconds;
     DWORD samples;
 
-    avi->current_video_frame = targetFrame;
-    avi->current_audio_frame = targetFrame;
-
     seconds = (double)targetFrame / avi->fps;
     samples = (DWORD)(seconds * (double)avi->Aud.nSamplesPerSec);
 
+    // The audio chunks don't have to line up with the video frames,
+    // so let the library find the audio for this time.
+    AVI_SeekTime(avi, (DWORD)(seconds * 1000.0 + 0.5), &AudSkip);
+    AVI_SetCurrentVideoFrame(avi, targetFrame);
+
     if (!NoAud)
     {
         SetAudioPos(samples);
@@ -372,6 +391,13 @@ int main(int argc, char *argv[])
                 if (BufLen > 0)
                 {
                     AVI_ReadAframe(avi, ABuf, BufLen);
+                    if (AudSkip)   // start at the seek time
+                    {
+                        if (AudSkip > BufLen) AudSkip = BufLen;
+                        BufLen -= AudSkip;
+                        memmove(ABuf, ABuf + AudSkip, BufLen);
+                        AudSkip = 0;
+                    }
                     AVI_WriteAframe(aviout, ABuf, BufLen);
                     AddChunkToWavQ(ABuf, BufLen);
                 }
@@ -143,10 +143,24 @@ ASSERT_SIZE(BYTE, 1);
 
 
 #define NEED_PAD_EVEN(x)    ((x) & 0x01)
+#define IS_FCC_CHAR(c)      (isalnum(c) || (c) == ' ')  // could be part of a FourCC
 #define MAX_AUDIO_CHANNELS  16
 #define AVI_MAX_RIFF_SIZE   0x7FFFFFF0  // Just under the 2GB limit for standard AVI
+#define DEFAULT_SEGMENT_SIZE 0x40000000 // ODML RIFF segment size unless AVI_SetSegmentSize()
+#define MIN_SEGMENT_SIZE    0x100000    // Smallest size for AVI_SetSegmentSize()
+#define MAX_CHUNK_ALIGN     0x10000     // Largest alignment for AVI_SetChunkAlign()
+#define PREALLOC_STEP       0x10000000  // Disk space reserved at a time for AVI_SetExpectedSize()
 #define INDEX_BLOCK_SIZE    512         // Number of index entries in an allocation block
 #define MAX_RIFF            128         // Max RIFF segments - must be at least 1
+#define MAX_WIDE_RIFF       8192        // Max RIFF segments written with WIDE_INDEX
+#define MAX_MEM_CHUNK_SIZE  0x00FFFFFF  // Largest chunk a MEMINDEXENTRY can hold
+#define SCAN_BLOCK_SIZE     0x400000    // Bytes read at a time by GenerateIndex()
+#define MAX_READ_GAP        0x40000     // Bytes between frames AVI_ReadVframes() reads through
+#define WRITE_BUFFER_SIZE   0x100000    // Default write buffer for FOR_WRITING files
+#define AVI_MAX_IOV         32          // Max pieces given to AVI_WriteVframev()
+#define INDEX_STAGE_ENTRIES 8192        // Index entries converted per write when writing indexes
+#define MAX_SCAN_THREADS    8           // Max threads for GenerateIndex()
+#define CIDX_ENTRIES        64          // Index entries per COMPACT_INDEX block
 #define MAX_HEIGHT          4096        // Max screen height
 #define MAX_WIDTH           8192        // max screen width
 #define MAX_FPS             120.0       // max frames/second
@@ -206,14 +220,73 @@ ASSERT_SIZE(BYTE, 1);
     // No legacy index is written.  The file cannot be
     // played on legacy players.
 
-
+// Open modifiers above 0xFFFF are options rather than modes
+#define MEMORY_MAPPED    0x00010000  // For reading only.
+    // The whole file is memory mapped so frame reads
+    // are a memcpy() from the mapping without any seek
+    // or read system calls.  If the file cannot be
+    // mapped, such as a huge file on a 32 bit compile,
+    // normal file reads are silently used instead.
+#define LAZY_INDEX       0x00020000  // For reading only.
+    // Only the ODML superindex is read when the file is
+    // opened.  The index for each RIFF segment is read
+    // the first time a chunk in that segment is needed.
+    // This makes opening huge files fast.  The max frame
+    // and chunk sizes come from the stream headers until
+    // the segments are loaded.
+#define INDEX_CACHE      0x00040000  // For reading only.
+    // The indexes are saved in a sidecar file named
+    // <filename>.a2idx the first time the file is opened.
+    // Later opens of the same unchanged file map the
+    // sidecar instead of parsing the indexes again.
+#define COMPACT_INDEX    0x00080000  // For reading only.
+    // The indexes are packed into about a third of the
+    // memory.  Finding a frame takes a little longer
+    // since up to CIDX_ENTRIES entries are unpacked.
+    // Not used with LAZY_INDEX or a mapped INDEX_CACHE.
+#define WIDE_INDEX       0x00100000  // For reading or writing.
+    // Index entries hold a 64 bit file position and a
+    // 31 bit size.  This takes 12 bytes per entry instead
+    // of 8, but lifts the 16MB chunk and MAX_RIFF segment
+    // limits.  Readers switch to it on their own when a
+    // file needs it.  Writers switch to it for a chunk
+    // over 16MB, but need it from the start to write
+    // more than MAX_RIFF segments (up to MAX_WIDE_RIFF).
+#define DIRECT_IO        0x00200000  // For writing only.
+    // The file is written with O_DIRECT so a long
+    // capture does not fill the page cache with data
+    // that will never be read again.  If the system or
+    // file system can't do it, normal buffered writes
+    // are silently used instead.
+
+
+// Only File64.c uses the members of this structure.
 typedef struct
 {
     FILE *fp;
     QWORD SeekBase;   // Base File Pointer
+    BYTE *MapPtr;     // Memory mapped file image or NULL if not mapped
+    QWORD MapSize;    // Number of bytes mapped
+    QWORD MapPos;     // Current file position when mapped
+    void *hMap;       // Windows file mapping handle
+    char *Name;       // File name as opened
+    BYTE *WBuf;       // Write buffer or NULL if writes are not buffered
+    DWORD WBufSize;   // Size of WBuf
+    DWORD WBufLen;    // Number of bytes waiting in WBuf
+    QWORD WBufPos;    // Absolute file position of WBuf[0]
+    void *Direct;     // O_DIRECT writer state or NULL
 } MFILE;
 
 
+// One piece of a frame for AVI_WriteVframev().  This must be kept
+// the same as the AVI_IOVEC in file64.c.
+typedef struct
+{
+    BYTE *Buf;        // start of a piece of data
+    DWORD Len;        // number of bytes in the piece
+} AVI_IOVEC;
+
+
 typedef struct
 {
     DWORD MicroSecPerFrame; // frame display rate (or 0)
@@ -525,7 +598,7 @@ typedef struct
 
 // To make a DWORD bitfield (assumes [parameters are all DWORD)
 #define MAKE_DWORD_CHUNK(size, base, key) \
-    (DWORD)(((size) & 0x00FFFFFF) | (((base) & 0x7F) << 24) | ((key == FALSE) << 31) )
+    (DWORD)(((size) & 0x00FFFFFF) | (((base) & 0x7F) << 24) | ((DWORD)(key == FALSE) << 31) )
 
 // To add new baseIdx bitfield to existing AVI2 index dwSize
 #define MAKE_AVI2_DWSIZE(size, base)   \
@@ -551,6 +624,60 @@ typedef struct
 } MEMINDEXENTRY;
 
 
+// Wide Memory Index Entry Struct
+// This is used instead of MEMINDEXENTRY when a chunk is bigger than
+// 16MB or there are more than MAX_RIFF segments.  The position is
+// absolute so no base index is needed, and dwSize has the same
+// layout as in STDINDEXENTRY.  GET_CHUNK_KEYFRAME() also works here.
+
+#define GET_WIDE_SIZE(size)        ((DWORD)((size) & 0x7FFFFFFF))
+#define MAKE_WIDE_DWSIZE(size, key) \
+    (DWORD)(((size) & 0x7FFFFFFF) | ((DWORD)(key == FALSE) << 31) )
+
+typedef struct
+{
+    QWORD qwOffset;   // absolute file position of the chunk payload
+    DWORD dwSize;     // chunk length, bit 31 is set if NOT a keyframe
+} WIDEINDEXENTRY;   // 12 bytes
+
+
+// One block of a writer's index.  The entries of the RIFF segment
+// being written are kept in a chain of these for each stream.  When
+// the segment is closed, the blocks go back to a pool in the AVI2
+// and are used again, so the index grows without being copied.
+
+typedef struct idx_block
+{
+    struct idx_block *Next;   // next block in the chain or pool
+    union
+    {
+        MEMINDEXENTRY  Idx[INDEX_BLOCK_SIZE];
+        WIDEINDEXENTRY WIdx[INDEX_BLOCK_SIZE];   // if the root is Wide
+    } e;
+} IDX_BLOCK;
+
+
+// A COMPACT_INDEX is made of blocks of CIDX_ENTRIES entries.  Each
+// entry is packed into 1 + SizeBits + GapBits bits starting with the
+// least significant bit.  The first bit is set if NOT a keyframe,
+// then comes the chunk size minus MinSize, then the gap minus MinGap.
+// The gap is the number of bytes from the end of the previous chunk
+// in this stream to the start of this one.  This is small and about
+// the same for every chunk, since it is just the other streams'
+// chunks and the headers.  The gap of the first entry is not used
+// because Pos is the position of the first chunk.
+
+typedef struct
+{
+    QWORD Pos;        // absolute file position of first chunk's data
+    DWORD Data;       // byte offset of the packed entries in CBits[]
+    DWORD MinSize;    // smallest chunk size in block
+    DWORD MinGap;     // smallest gap in block
+    BYTE  SizeBits;   // bits used for each size
+    BYTE  GapBits;    // bits used for each gap
+} CIDX_BLOCK;
+
+
 
 // The following structure describes a single audio track.  An AVI file
 // can have multiple audio tracks for things like different languages,
@@ -579,6 +706,17 @@ typedef struct
 } AUDIO_STREAM_BLOCK;
 
 
+// One RIFF segment of an index for LAZY_INDEX reading
+typedef struct
+{
+    QWORD qwOffset;        // file position of the 'ix##' chunk
+    DWORD First;           // Idx[] entry of the first chunk in segment
+    DWORD Count;           // number of entries in segment
+    volatile int Loaded;   // TRUE when loaded, read with FlagGet()
+    WIDEINDEXENTRY *WIdx;  // entries of a segment too big for Idx[], or NULL
+} INDEX_SEG;
+
+
 // Root of indexes
 typedef struct index_root
 {
@@ -588,9 +726,121 @@ typedef struct index_root
 //    DWORD nIndexes;        // Number of superindexes written
     char  Name[32];        // Name of stream
     MEMINDEXENTRY *Idx;    // video index
+    WIDEINDEXENTRY *WIdx;  // WIDE_INDEX entries used instead of Idx
+    DWORD NumSegs;         // number of lazy segments
+    INDEX_SEG *Seg;        // lazy segments or NULL if all loaded
+    CIDX_BLOCK *CIdx;      // COMPACT_INDEX blocks used instead of Idx
+    BYTE *CBits;           // COMPACT_INDEX packed entries
+    IDX_BLOCK *Head;       // writer index chain for this RIFF segment
+    IDX_BLOCK *Tail;       // last block of the chain
+    DWORD ChainBlocks;     // number of blocks in the chain
+    int   Wide;            // TRUE if the chain holds WIDEINDEXENTRY
 } INDEX_ROOT;
 
 
+// Header of the INDEX_CACHE sidecar file.  It is followed by
+// BaseTable[NumBases], then the video index entries, then the
+// audio index entries, all exactly as they are in memory.  The
+// entries are WIDEINDEXENTRY if EntrySize says so.  The cache
+// is only used if the size, times and file id match the AVI file.
+
+#define AVI_CACHE_MAGIC    'A2IX'
+#define AVI_CACHE_VERSION  3
+
+typedef struct
+{
+    DWORD Magic;           // AVI_CACHE_MAGIC
+    DWORD Version;         // AVI_CACHE_VERSION
+    QWORD FileSize;        // size of the AVI file
+    QWORD FileTime;        // modification time of the AVI file
+    QWORD FileCTime;       // status change time of the AVI file
+    QWORD FileId;          // inode or file index of the AVI file
+    DWORD NumBases;        // entries in BaseTable
+    DWORD VidEntries;      // video index entries
+    DWORD AudEntries;      // audio index entries
+    DWORD MaxVideo;        // max_video_frame_size
+    DWORD MaxAudio;        // max_audio_chunk_size
+    DWORD EntrySize;       // sizeof() the index entries
+} AVI_CACHE_HDR;
+
+
+// Handles made with AVI_Clone() share the indexes of the original.
+// This keeps track of how many handles use them so that only the last
+// AVI_Close() frees them.
+
+typedef struct
+{
+    int   RefCount;        // number of AVI2 handles using the indexes
+    void *Lock;            // mutex for anything shared between handles
+    void *BuildLock;       // held while building Keys or AudBytes
+    DWORD *Keys;           // video keyframe numbers in order, NULL if all are keyframes
+    DWORD NumKeys;         // entries in Keys
+    volatile int KeysReady; // TRUE when Keys has been built, read with FlagGet()
+    QWORD *AudBytes;       // audio bytes before each CIDX_ENTRIES chunks, one more than the blocks
+    volatile int AudReady; // TRUE when AudBytes has been built, read with FlagGet()
+    DWORD MaxVideo;        // largest video chunk in the LAZY_INDEX segments loaded
+    DWORD MaxAudio;        // largest audio chunk in the LAZY_INDEX segments loaded
+    volatile int MaxGen;   // changed when MaxVideo or MaxAudio grows, read with FlagGet()
+} AVI_SHARE;
+
+
+// With AVI_SetAsyncWrite(), AVI_WriteVframe() and AVI_WriteAframe()
+// copy each chunk into a queue and a writer thread does the actual
+// writing.  This is one queued chunk.
+
+typedef struct
+{
+    BYTE *Buf;             // copy of the chunk data
+    DWORD Len;             // bytes in Buf
+    int   Audio;           // TRUE for an audio chunk, else video
+    int   Key;             // keyframe flag for video
+} WRITE_JOB;
+
+
+// The queue shared by the caller and the writer thread.  Jobs are
+// taken from Head in order and a job stays counted until it has been
+// written, so Count is the real depth of the queue.
+
+typedef struct
+{
+    WRITE_JOB *Jobs;       // ring of QueueLen jobs
+    DWORD QueueLen;        // max jobs waiting
+    DWORD Head;            // next job to write
+    DWORD Count;           // jobs not written yet
+    int   Err;             // first error from the writer thread
+    int   Stop;            // TRUE tells the thread to finish the queue and quit
+    void *Lock;            // mutex for everything above
+    void *Wake;            // event signaled when a job is added or Stop is set
+    void *Thread;          // the writer thread
+} ASYNC_WRITER;
+
+
+// When an ODML RIFF segment is full, room is left in the file for its
+// indexes and the next segment is started right after it.  The indexes
+// and the sizes in the segment headers are written later, by a thread
+// if possible.  This is everything needed to do that.  The index chains
+// are moved here from the AVI2 so that the next segment gets new ones.
+
+typedef struct
+{
+    INDEX_ROOT VidRt;      // video index chain of the segment
+    INDEX_ROOT AudRt;      // audio index chain of the segment
+    MFILE *fp;             // file handle used to write it
+    QWORD Base;            // absolute position of the segment's 'RIFF'
+    DWORD movi_start;      // movi_start of the segment
+    DWORD IdxPos;          // offset of the room left for the indexes
+    DWORD MoviEnd;         // offset of the end of the movi LIST
+    DWORD End;             // offset of the end of the segment
+    DWORD BlockAlign;      // audio nBlockAlign
+    WORD  ODMLmode;        // ODML indexes are not written for STRICT_LEGACY
+    int   HasVideo;        // write the video index
+    int   HasAudio;        // write the audio index
+    int   Legacy;          // TRUE to write idx1 after the ODML indexes
+    int   Pending;         // TRUE until WaitSegment() has taken it back
+    int   Err;             // 0 or the error finishing the segment
+} SEG_JOB;
+
+
 // Main AVI structure
 // Note that long types are 64 bits with a 64 bit compiler and 32 bits on a 32 bit compiler like Borland.
 
@@ -599,6 +849,7 @@ typedef struct
     MFILE *fp;
     WORD   filemode;      // for_reading, for_writing
     WORD   ODMLmode;     // hybrid_odml, strict_legacy, strict_odml
+    DWORD  OpenFlags;    // option modifiers like MEMORY_MAPPED
     int has_video;
     int has_audio;
 //    int isODML;          // TRUE if this is an AVI2 ODML file
@@ -627,20 +878,67 @@ typedef struct
 // is an array of RIFF base addresses.  The base addresses are
 // always the address of the 'R' in 'RIFF' - one for each RIFF
 // segment.  These get added to the offset to make an absolute
-// QWORD address.
+// QWORD address.  The table grows as segments are found.
 
     DWORD NumBases;                 // number of base table entries 0=uninitialized
-    QWORD BaseTable[MAX_RIFF];      // Table of base address for RIFF segments
+    DWORD BaseAlloc;                // number of base table entries allocated
+    QWORD *BaseTable;               // Table of base address for RIFF segments
 
     // File structure info
     DWORD movi_start;           // file position of first 'movi' list record
+    DWORD first_movi_start;     // movi_start of the first RIFF, where the headers end
+    DWORD SegmentSize;          // ODML RIFF segment size or 0 for DEFAULT_SEGMENT_SIZE
+    DWORD ChunkAlign;           // file alignment of video frame data or 0 for none
+    QWORD ExpectedSize;         // file size to reserve disk space for or 0 for none
+    QWORD PreallocEnd;          // end of the disk space reserved so far
 //    DWORD header_pos;      // ADD THIS - position where header starts
     DWORD current_riff_size; // ADD THIS - size of current RIFF segment
 //    DWORD total_bytes_written;  // Track total bytes to detect 2GB threshold
 
+    AVI_SHARE *Share;        // index sharing for AVI_Clone() - reading only
+    volatile int MaxGen;     // Share->MaxGen when the max sizes were last taken, read with FlagGet()
+    MFILE *IdxCache;         // mapped INDEX_CACHE file holding Idx[] or NULL
+    int   IndexDamaged;      // TRUE if AUTO_INDEX must rebuild a bad index
+    ASYNC_WRITER *Async;     // write-behind queue or NULL - writing only
+    BYTE *PendingBuf;        // frame buffer from AVI_BeginVframe() or NULL
+    DWORD PendingMax;        // size of PendingBuf
+    BYTE *StageBuf;          // AVI_BeginVframe() buffer when the write buffer can't be used
+    DWORD StageSize;         // bytes allocated for StageBuf
+    IDX_BLOCK *IdxPool;      // free writer index blocks
+    SEG_JOB SegJob;          // RIFF segment being finished - writing only
+    void *SegThread;         // thread finishing SegJob or NULL
+    MFILE *SegFp;            // second handle SegThread writes with
+
 } AVI2;
 
 
+// GenerateIndex() scans each RIFF segment separately, possibly
+// in different threads.  This is what one segment scan finds.
+
+typedef struct
+{
+    DWORD Seg;             // BaseTable[] entry of the segment
+    INDEX_ROOT VidRt;      // video chunks found
+    INDEX_ROOT AudRt;      // audio chunks found
+    DWORD MaxVideo;        // largest video chunk
+    DWORD MaxAudio;        // largest audio chunk
+    int   Err;             // 0 or the error that stopped the scan
+} SEG_SCAN;
+
+
+// The segment scans shared by the GenerateIndex() threads.  Each
+// thread takes the next segment until there are none left.
+
+typedef struct
+{
+    AVI2     *avi;         // file being scanned
+    SEG_SCAN *Scan;        // one per RIFF segment
+    DWORD     Count;       // number of segments
+    DWORD     Next;        // next segment to scan
+    void     *Lock;        // mutex for Next
+} SCAN_JOB;
+
+
 // Error Defines
 enum errvals
 {
@@ -666,6 +964,7 @@ enum errvals
     AVIERR_FUNCTION_ORDER,
     AVIERR_OVERFLOW,
     AVIERR_TOO_MANY_SEGMENTS,
+    AVIERR_QUEUE_FULL,
     AVIERR_UNKNOWN,
     AVIERR_COUNT     // count of all enums
 };
@@ -677,9 +976,23 @@ enum errvals
 void   File64SetBase(MFILE *mfp, QWORD NewBase);
 QWORD  File64GetBase(MFILE *mfp);
 MFILE *File64Open(char *fname, char *mode);
+MFILE *File64Dup(MFILE *mfp, int Write);
+int    File64Map(MFILE *mfp);
+int    File64Stat(MFILE *mfp, QWORD *Size, QWORD *MTime, QWORD *CTime, QWORD *FileId);
+BYTE  *File64MapPtr(MFILE *mfp, QWORD AbsAddr, DWORD len);
 int    File64Close(MFILE *mfp);
+int    File64SetWriteBuffer(MFILE *mfp, DWORD Size);
+int    File64SetDirect(MFILE *mfp);
+int    File64Flush(MFILE *mfp);
 size_t File64Read(MFILE *mfp, void *buffer, int len);
 size_t File64Write(MFILE *mfp, void *buffer, int len);
+size_t File64Writev(MFILE *mfp, AVI_IOVEC *vec, int Count);
+BYTE  *File64Reserve(MFILE *mfp, DWORD len);
+int    File64Commit(MFILE *mfp, DWORD len);
+size_t File64PRead(MFILE *mfp, void *buffer, DWORD len, QWORD AbsAddr);
+size_t File64PWrite(MFILE *mfp, void *buffer, DWORD len, QWORD AbsAddr);
+int    File64Allocate(MFILE *mfp, QWORD Offset, QWORD Len);
+int    File64Truncate(MFILE *mfp, QWORD Size);
 int    File64Qseek(MFILE *mfp, QWORD AbsAddr);
 int    File64SetPos(MFILE *mfp, LONG offset, int whence);
 DWORD  File64GetPos(MFILE *mfp);
@@ -687,33 +1000,76 @@ BYTE   File64Getchar(MFILE *mfp);
 BYTE   File64Putchar(MFILE *mfp, BYTE ch);
 
 
+// Internal avi2_thread.c prototypes
+
+void  *MutexCreate(void);
+void   MutexLock(void *mutex);
+void   MutexUnlock(void *mutex);
+void   MutexDestroy(void *mutex);
+int    FlagGet(volatile int *flag);
+void   FlagSet(volatile int *flag, int val);
+void  *EventCreate(void);
+void   EventSignal(void *event);
+void   EventWait(void *event);
+void   EventDestroy(void *event);
+void  *ThreadCreate(void (*Func)(void *), void *Arg);
+void   ThreadJoin(void *thread);
+int    CpuCount(void);
+
+
 // Internal Common functions
 char  *AVI_StrError(int errnum);
 FOURCC ReadFCC(MFILE *in, int *StreamNum);
+FOURCC ParseFCC(const BYTE *src, int *StreamNum);
 int    WriteFCC(MFILE *out, FOURCC fccval, int StreamNum);
+int    AddBaseTable(AVI2 *avi, QWORD Base);
 DWORD  ReverseLiteral(DWORD val);
 int    ParseAVIFile(AVI2 *avi);
+int    LoadIndexCache(AVI2 *avi, const char *filename);
+int    SaveIndexCache(AVI2 *avi, const char *filename);
+void   CompactIndexes(AVI2 *avi);
+void   FreeIndexSegs(INDEX_ROOT *rt);
+int    BuildKeyframeTable(AVI2 *avi);
+int    BuildAudioTable(AVI2 *avi);
 int    FinalizeWrite(AVI2 *avi);
 int    AddIndexEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD len, DWORD Key);
+int    AddIndexEntryAt(AVI2 *avi, INDEX_ROOT *rt, DWORD base, DWORD offset, DWORD len, DWORD Key);
+int    WidenIndex(AVI2 *avi, INDEX_ROOT *rt);
 char  *Fcc2Str(FOURCC val);
 
 
 
 // File I/O
 AVI2 *AVI_Open(const char *filename, DWORD mode, int *err);
+AVI2 *AVI_Clone(AVI2 *avi);
 int   AVI_Close(AVI2 *avi);
 int   AVI_WriteHeader(AVI2 *avi);
 int   AVI_SeekStart(AVI2 *avi);
+int   AVI_SetWriteBuffer(AVI2 *avi, DWORD Size);
+int   AVI_SetAsyncWrite(AVI2 *avi, DWORD QueueLen);
+int   AVI_SetSegmentSize(AVI2 *avi, DWORD Size);
+int   AVI_SetChunkAlign(AVI2 *avi, DWORD Align);
+int   AVI_SetExpectedSize(AVI2 *avi, QWORD Size);
+DWORD AVI_GetWriteQueueDepth(AVI2 *avi);
 
 // Video output
 int AVI_SetVideo(AVI2 *avi, char *name, DWORD width, DWORD height, double fps, FOURCC codec);
 int AVI_WriteVframe(AVI2 *avi, BYTE *VidBuf, DWORD len, int keyframe);
+int AVI_WriteVframev(AVI2 *avi, AVI_IOVEC *iov, int iovcnt, int keyframe);
+BYTE *AVI_BeginVframe(AVI2 *avi, DWORD maxlen);
+int AVI_CommitVframe(AVI2 *avi, DWORD len, int keyframe);
 
 // Video input
 DWORD AVI_ReadVframe(AVI2 *avi, BYTE *VidBuf, DWORD VidBufSize, int *keyframe);
+const BYTE *AVI_PeekVframe(AVI2 *avi, DWORD *len, int *keyframe);
+DWORD AVI_ReadVframeAt(AVI2 *avi, DWORD frame, BYTE *VidBuf, DWORD VidBufSize, int *keyframe);
+DWORD AVI_ReadVframes(AVI2 *avi, DWORD first, DWORD count, BYTE *Buf, DWORD BufSize,
+                      BYTE **Frames, DWORD *Lens, int *Keys);
 DWORD AVI_GetVframeSize(AVI2 *avi, DWORD FrameNum);
 //DWORD AVI_GetVideoFrameFilePointer(AVI2 *avi, DWORD frame);
 DWORD AVI_SetCurrentVideoFrame(AVI2 *avi, DWORD frame);
+DWORD AVI_SeekKeyframe(AVI2 *avi, DWORD frame, int direction);
+int   AVI_SeekTime(AVI2 *avi, DWORD ms, DWORD *AudSkip);
 
 // Audio output
 int AVI_SetAudio(AVI2 *avi, char *name, int NumChannels, long SamplesPerSecond,
@@ -722,8 +1078,14 @@ int AVI_WriteAframe(AVI2 *avi, BYTE *AudBuf, DWORD len);
 
 // Audio input
 DWORD AVI_ReadAframe(AVI2 *avi, BYTE *AudioBuf, DWORD BufSize);
+const BYTE *AVI_PeekAframe(AVI2 *avi, DWORD *len);
+DWORD AVI_ReadAframeAt(AVI2 *avi, DWORD chunk, BYTE *AudioBuf, DWORD BufSize);
+DWORD AVI_ReadAudioSamples(AVI2 *avi, QWORD Start, DWORD Count, BYTE *Buf, DWORD BufSize);
 int AVI_set_audio_position(AVI2 *avi, DWORD frame);
 
+// Video and audio input
+DWORD AVI_ReadNextChunk(AVI2 *avi, BYTE *Buf, DWORD BufSize, int *Stream, int *keyframe);
+
 
 // HELPER MACROS
 
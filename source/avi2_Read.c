@@ -30,8 +30,31 @@ static int ParseStreamList(AVI2 *avi, DWORD list_size);
 static int ParseLegacyIndex(AVI2 *avi, DWORD index_size);
 static int ParseMasterIndex(AVI2 *avi, INDX_CHUNK *idxh, DWORD list_size);
 static int ParseChunkIndex(AVI2 *avi, INDX_CHUNK *idxh, DWORD list_size);
+static int FixChunkIndex(AVI2 *avi, INDX_CHUNK *idxh, INDEX_ROOT *rt, DWORD First);
+static int NeedWideIndex(AVI2 *avi, DWORD MaxSize);
+static int AllocRootIndex(INDEX_ROOT *rt, DWORD Count, int Wide);
+static STDINDEXENTRY *ChunkIndexBuf(INDEX_ROOT *rt, DWORD First, DWORD Count);
 static int GenerateIndex(AVI2 *avi);
+static void ScanSegment(AVI2 *avi, SEG_SCAN *sc, BYTE *Buf);
+static void ScanWorker(void *arg);
 static int WalkRiff(AVI2 *avi);
+static int LoadIndexSegment(AVI2 *avi, INDEX_ROOT *rt, DWORD n, INDEX_SEG **pSeg);
+static void SyncMaxSizes(AVI2 *avi);
+static int GetIndexEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD n,
+                         QWORD *AbsPos, DWORD *Size, int *Key);
+static void GetCompactEntry(INDEX_ROOT *rt, DWORD n,
+                            QWORD *AbsPos, DWORD *Size, int *Key);
+static int GetIndexBlock(AVI2 *avi, INDEX_ROOT *rt, DWORD First,
+                         DWORD *Size, int *Key);
+static int CompactIndex(AVI2 *avi, INDEX_ROOT *rt);
+static DWORD ReadChunk(AVI2 *avi, INDEX_ROOT *rt, DWORD n, BYTE *Buf,
+                       DWORD BufSize, int *Key, int *err);
+static int FindAudioChunk(AVI2 *avi, QWORD Byte, DWORD *Chunk, QWORD *Before);
+static int GetAudioPiece(AVI2 *avi, DWORD c, QWORD Before, QWORD First,
+                         QWORD End, QWORD *Pos, DWORD *Len, DWORD *Size);
+static int ReadAudioRun(AVI2 *avi, DWORD c, DWORD Last, QWORD Before,
+                        QWORD First, QWORD End, QWORD Start, DWORD Len,
+                        BYTE *Buf);
 
 
 // This function is for debugging only
@@ -53,11 +76,19 @@ int ParseAVIFile(AVI2 *avi)
     FOURCC fcc, ListType;
     DWORD  RiffSize, ChunkSize;
     DWORD  filepos;
-    int    ret;
+    int    ret, Cached;
+
+    // With the indexes from the INDEX_CACHE sidecar, only the headers
+    // in front of the movi list are needed.
+    Cached = (avi->VidRt.Idx || avi->VidRt.WIdx);
 
     // walk the RIFF file and collect the start of each RIFF segment
-    ret = WalkRiff(avi);
-    if (ret) return(ret);
+    // unless the BaseTable already came from the index cache.
+    if (avi->NumBases == 0)
+    {
+        ret = WalkRiff(avi);
+        if (ret) return(ret);
+    }
 
     // Read RIFF header
     File64SetPos(avi->fp, 0, SEEK_SET);
@@ -109,6 +140,7 @@ int ParseAVIFile(AVI2 *avi)
         // read 12 bytes.  So filepos is
         filepos = File64GetPos(avi->fp);  // Get current file position.
         if (filepos >= RiffSize + 8) break;  // First RIFF segment only
+        if (Cached && avi->movi_start) break;  // the rest is only indexes
 
         fcc = ReadFCC(avi->fp, NULL);     // Read next FourCC
 AVI_DBG_1s("Read Fcc: %.4s\n", FCC2STR(fcc));
@@ -202,8 +234,9 @@ AVI_DBG_1s("Unknown RIFF Chunk: '%.4s'\n", FCC2STR(fcc));
     if (avi->has_audio && avi->Aud.nBlockAlign == 0)
         return(avi->AVIerr = AVIERR_FILE_CORRUPTED);
 
-    // If requested, generate an index if there is none.
-    if (!avi->VidRt.Idx)
+    // If requested, generate an index if there is none or if
+    // the one in the file is damaged.
+    if ((!avi->VidRt.Idx && !avi->VidRt.WIdx) || avi->IndexDamaged)
     {
         if (avi->ODMLmode == AUTO_INDEX)
         {
@@ -451,12 +484,18 @@ AVI_DBG_1s("Stream List: '%.4s'\n", FCC2STR(fcc));
                     avi->has_video = TRUE;
                     avi->VideoCodec = FIX_LIT(strh.fccHandler);
                     avi->num_video_frames = strh.Length;
+                    // Until a LAZY_INDEX is read, go by the header.  An
+                    // index from the index cache already has the exact size.
+                    if ((avi->OpenFlags & LAZY_INDEX) && !avi->VidRt.Idx && !avi->VidRt.WIdx)
+                        avi->max_video_frame_size = strh.SuggestedBufferSize;
                 }
                 else if (fccType == 'auds')   // Audio stream
                 {
                     StreamType = AUDIO_STREAM;  // Indicate that this is an audio stream
                     avi->has_audio = TRUE;
                     avi->num_audio_frames = strh.Length;
+                    if ((avi->OpenFlags & LAZY_INDEX) && !avi->AudRt.Idx && !avi->AudRt.WIdx)
+                        avi->max_audio_chunk_size = strh.SuggestedBufferSize;
                 }
                 // There can be other stream types, but we ignore them.
                 break;
@@ -502,6 +541,11 @@ AVI_DBG_1d("ODML index Stream#: %d\n", StreamType);
                 if (StreamType == UNKNOWN_STREAM)  // we only process known streams
                     break;
 
+                // Skip it if this stream's index came from the index cache
+                if ((StreamType == VIDEO_STREAM && (avi->VidRt.Idx || avi->VidRt.WIdx)) ||
+                    (StreamType == AUDIO_STREAM && (avi->AudRt.Idx || avi->AudRt.WIdx)))
+                    break;
+
                 // Read the index chunk
                 if (File64Read(avi->fp, &idxh, sizeof(INDX_CHUNK)) != sizeof(INDX_CHUNK))
                     goto corrupted;
@@ -526,10 +570,12 @@ AVI_DBG("Superindex size mismatch.\n");
 
                     ret = ParseMasterIndex(avi, &idxh, size - 4);
 CheckAutoIndex:
-                    if (ret == AVIERR_NO_INDEX && avi->ODMLmode == AUTO_INDEX)
+                    if ((ret == AVIERR_NO_INDEX || ret == AVIERR_FILE_CORRUPTED) &&
+                        avi->ODMLmode == AUTO_INDEX)
                     {
                         // Error is killed here because index will be auto generated later
                         avi->AVIerr = AVIERR_NO_ERROR;
+                        avi->IndexDamaged = TRUE;
                     }
                     else if (ret)    // all other errors
                     {
@@ -593,16 +639,16 @@ static int ParseLegacyIndex(AVI2 *avi, DWORD index_size)
     DWORD num_entries = index_size / sizeof(AVIINDEXENTRY);
     DWORD num_video_entries;
     DWORD num_audio_entries;
-    DWORD i, ac, vc, sz, tmpFcc, ofs, keyf;
+    DWORD i, ac, vc, sz, tmpFcc, ofs, keyf, MaxSize, EntrySize;
     AVIINDEXENTRY *LegacyIdx;
-    MEMINDEXENTRY *TmpVidIdx = NULL, *TmpAudIdx = NULL;
-    MEMINDEXENTRY *ptr;
+    BYTE *TmpVidIdx = NULL, *TmpAudIdx = NULL;
+    BYTE *ptr;
     FOURCC fcc_fixed;
-    int IdxRelMovi, ret = -1;
+    int IdxRelMovi, Wide, ret = -1;
     char tmpChar;
 
     // Skip if index already allocated
-    if (avi->VidRt.Idx)
+    if (avi->VidRt.Idx || avi->VidRt.WIdx)
         return(0); // No error, but another index has already been loaded
 
     avi->VidRt.index_entries = 0;
@@ -644,13 +690,16 @@ err_corrupted:
     // However, some older AVI libraries that incorrectly
     // used the absolute frame address rather than the offset.  An
     // AVI File parser must be able to handle both versions.
+    // The first chunk may also follow a 'JUNK' chunk (for example
+    // when chunks are aligned), so any offset that lies before the
+    // movi data must be relative.  The FourCC check below catches
+    // an index that is really corrupted.
 
     // Now determine which kind we have.
     IdxRelMovi = FALSE;
     i = LegacyIdx[0].dwChunkOffset;
-    if (i == 4) IdxRelMovi = TRUE;  // relative to 'movi'
-    else if (i < avi->movi_start)   // problem - index is corrupted
-        goto err_corrupted;
+    if (i < 4) goto err_corrupted;  // problem - index is corrupted
+    if (i < avi->movi_start) IdxRelMovi = TRUE;  // relative to 'movi'
 
     // Although the file spec says that dwChunkOffset is relative to
     // the start of the movi chunk, we change it here to absolute
@@ -659,6 +708,7 @@ err_corrupted:
 
     ofs = avi->movi_start - 4;
     num_video_entries = num_audio_entries = 0;
+    MaxSize = 0;
     for (i = 0; i < num_entries; i++)
     {
         // change to absolute address if necessary
@@ -668,6 +718,9 @@ err_corrupted:
         tmpChar = ((char *)(&LegacyIdx[i].ckid))[2];
         if (tmpChar == 'w') num_audio_entries++;
         if (tmpChar == 'd') num_video_entries++;
+
+        if (LegacyIdx[i].dwChunkLength > MaxSize)
+            MaxSize = LegacyIdx[i].dwChunkLength;
     }
 
     if (num_video_entries == 0)   // no video
@@ -700,15 +753,18 @@ err_corrupted:
 //    avi->NumBases = 1;
 
     // Now we build two index arrays using our internal memory index.
-    // One is for audio and the other is for video.
+    // One is for audio and the other is for video.  Wide entries
+    // are only used if a chunk is too big for a MEMINDEXENTRY.
+    Wide = NeedWideIndex(avi, MaxSize);
+    EntrySize = Wide ? sizeof(WIDEINDEXENTRY) : sizeof(MEMINDEXENTRY);
 
     // allocate temporary indexes
-    TmpVidIdx = malloc(num_video_entries * sizeof(MEMINDEXENTRY));
+    TmpVidIdx = malloc(num_video_entries * EntrySize);
     if (!TmpVidIdx) goto err_malloc;
 
     if (num_audio_entries)   // not zero
     {
-        TmpAudIdx = malloc(num_audio_entries * sizeof(MEMINDEXENTRY));
+        TmpAudIdx = malloc(num_audio_entries * EntrySize);
         if (!TmpAudIdx) goto err_malloc;
     }
 
@@ -729,13 +785,13 @@ err_corrupted:
         switch(tmpChar)
         {
             case 'w':   // audio
-                ptr = &TmpAudIdx[ac++];   // pointer to new index
+                ptr = TmpAudIdx + EntrySize * ac++;   // pointer to new index
                 if (sz > avi->max_audio_chunk_size) // track max audio size
                     avi->max_audio_chunk_size = sz;
                 break;
 
             case 'd':    // video
-                ptr = &TmpVidIdx[vc++];
+                ptr = TmpVidIdx + EntrySize * vc++;
                 if (sz > avi->max_video_frame_size) // track max video size
                     avi->max_video_frame_size = sz;
                 break;
@@ -748,15 +804,31 @@ err_corrupted:
         if (ptr)  // only audio and video
         {
             // gather parts
-            keyf = !(AVIIF_KEYFRAME & LegacyIdx[i].dwFlags) & 0x1;
-            ptr->dwSize = MAKE_DWORD_CHUNK(sz, 0, keyf);
-            ptr->dwOffset = LegacyIdx[i].dwChunkOffset + 8;  // header not included in odml index
+            keyf = (AVIIF_KEYFRAME & LegacyIdx[i].dwFlags) ? TRUE : FALSE;
+            if (Wide)
+            {
+                ((WIDEINDEXENTRY *) ptr)->dwSize = MAKE_WIDE_DWSIZE(sz, keyf);
+                ((WIDEINDEXENTRY *) ptr)->qwOffset = LegacyIdx[i].dwChunkOffset + 8;
+            }
+            else
+            {
+                ((MEMINDEXENTRY *) ptr)->dwSize = MAKE_DWORD_CHUNK(sz, 0, keyf);
+                ((MEMINDEXENTRY *) ptr)->dwOffset = LegacyIdx[i].dwChunkOffset + 8;  // header not included in odml index
+            }
         }
     }
 
     // save indexes
-    avi->AudRt.Idx = TmpAudIdx;
-    avi->VidRt.Idx = TmpVidIdx;
+    if (Wide)
+    {
+        avi->AudRt.WIdx = (WIDEINDEXENTRY *) TmpAudIdx;
+        avi->VidRt.WIdx = (WIDEINDEXENTRY *) TmpVidIdx;
+    }
+    else
+    {
+        avi->AudRt.Idx = (MEMINDEXENTRY *) TmpAudIdx;
+        avi->VidRt.Idx = (MEMINDEXENTRY *) TmpVidIdx;
+    }
     if (LegacyIdx) free(LegacyIdx);
     ret = 0;
 err_general:
@@ -786,17 +858,109 @@ int AVI_SeekStart(AVI2 *avi)
 
 
 
-// Read current video frame
-// Return bytes read.  If VidBuf == NULL, return frame chunk size
-// without doing anything else.  Return 0 if ERROR, else bytes read.
-// Check AVIerr to make sure returned size is correct if return is zero.
-// If both return code and AVIerr are zero on return, the avi parameter is NULL.
-//
-DWORD AVI_ReadVframe(AVI2 *avi, BYTE *VidBuf, DWORD VidBufSize, int *keyframe)
+// Set the current video frame that AVI_ReadVframe() reads next.
+// frame may be one past the last frame, which is the end of the video.
+// Returns 0 if OK, else error code.
+
+DWORD AVI_SetCurrentVideoFrame(AVI2 *avi, DWORD frame)
 {
-    MEMINDEXENTRY *entry;
-    DWORD ckSize, baseIdx, key;
-    DWORD bytes_read;
+    if (!avi)
+        return(AVIERR_AVI_STRUCT_BAD);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_READING)
+        return(avi->AVIerr = AVIERR_WRONG_FILE_MODE);
+
+    if (!avi->has_video)
+        return(avi->AVIerr = AVIERR_MISSING_VIDEO);
+
+    if (frame > avi->VidRt.index_entries)
+        return(avi->AVIerr = AVIERR_FRAME_NOT_EXIST);
+
+    avi->current_video_frame = frame;
+    return(0);
+}
+
+
+// Build the table of video keyframe numbers used by AVI_SeekKeyframe()
+// the first time it is needed.  It is kept with the shared indexes so
+// AVI_Clone() handles use it too.  If every frame is a keyframe, no
+// table is needed and Keys stays NULL.  It is built under BuildLock,
+// not Lock, because loading a LAZY_INDEX segment takes Lock.  Once
+// KeysReady is set, Keys and NumKeys don't change.
+// Returns 0 if OK, else error code.
+
+int BuildKeyframeTable(AVI2 *avi)
+{
+    AVI_SHARE *share = avi->Share;
+    INDEX_ROOT *rt = &avi->VidRt;
+    DWORD *keys, i, b, n = 0;
+    int key[CIDX_ENTRIES], ret = 0;
+
+    if (!share)
+        return(AVIERR_NO_INDEX);
+
+    if (FlagGet(&share->KeysReady))
+        return(0);
+
+    MutexLock(share->BuildLock);
+    if (FlagGet(&share->KeysReady))   // another thread built it meanwhile
+    {
+        MutexUnlock(share->BuildLock);
+        return(0);
+    }
+
+    keys = (DWORD *) malloc((rt->index_entries + 1) * sizeof(DWORD));
+    if (!keys)
+        ret = AVIERR_MALLOC;
+
+    // Go a block of entries at a time so a COMPACT_INDEX block is
+    // only unpacked once.
+    for (b = 0; b < rt->index_entries && !ret; b += CIDX_ENTRIES)
+    {
+        ret = GetIndexBlock(avi, rt, b, NULL, key);
+        if (ret)
+            break;
+        for (i = 0; i < CIDX_ENTRIES && b + i < rt->index_entries; i++)
+        {
+            if (key[i])
+                keys[n++] = b + i;
+        }
+    }
+
+    if (!ret)
+    {
+        if (n == rt->index_entries)   // all keyframes, nothing to search
+        {
+            free(keys);
+            keys = NULL;
+        }
+        share->Keys = keys;
+        share->NumKeys = n;
+        FlagSet(&share->KeysReady, TRUE);
+    }
+    else if (keys)
+        free(keys);
+    MutexUnlock(share->BuildLock);
+
+    return(ret);
+}
+
+
+// Find the keyframe nearest to frame and make it the current video
+// frame.  If direction is negative, the keyframe at or before frame is
+// found, if positive, the one at or after frame, and if zero, whichever
+// is closer.  The keyframe table is searched so this takes the same
+// time for any length of file.
+// Returns the keyframe number.  Returns 0 on error, so check AVIerr
+// if the return is zero.
+
+DWORD AVI_SeekKeyframe(AVI2 *avi, DWORD frame, int direction)
+{
+    DWORD *Keys;
+    DWORD lo, hi, mid, k;
+    int ret, prev, next;
 
     if (!avi)
         return 0;
@@ -809,51 +973,296 @@ DWORD AVI_ReadVframe(AVI2 *avi, BYTE *VidBuf, DWORD VidBufSize, int *keyframe)
         return 0;
     }
 
-    if (!avi->VidRt.Idx)
+    if (!avi->has_video)
     {
-        avi->AVIerr = AVIERR_NO_INDEX;  // No index found
+        avi->AVIerr = AVIERR_MISSING_VIDEO;
         return 0;
     }
 
-    if (avi->current_video_frame >= avi->VidRt.index_entries)
+    if (frame >= avi->VidRt.index_entries)
     {
-        avi->AVIerr = AVIERR_EOF;  // No more frames
+        avi->AVIerr = AVIERR_FRAME_NOT_EXIST;
         return 0;
     }
 
-    // get entry from index
-    entry = &avi->VidRt.Idx[avi->current_video_frame];
-    key = GET_CHUNK_KEYFRAME(entry->dwSize);
-    ckSize = GET_CHUNK_SIZE(entry->dwSize);
-    baseIdx = GET_CHUNK_BASEINDEX(entry->dwSize);
-    if (!VidBuf)   // just return size
+    ret = BuildKeyframeTable(avi);   // only does something the first time
+    if (ret)
     {
-        return(ckSize);
+        avi->AVIerr = ret;
+        return 0;
+    }
+
+    Keys = avi->Share->Keys;
+    if (!Keys)   // every frame is a keyframe
+        k = frame;
+    else
+    {
+        // Count the keyframes at or before frame
+        lo = 0;
+        hi = avi->Share->NumKeys;
+        while (lo < hi)
+        {
+            mid = (lo + hi) / 2;
+            if (Keys[mid] <= frame)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        // Keys[lo - 1] is at or before frame and Keys[lo] is after it
+        prev = (lo > 0);
+        next = (lo < avi->Share->NumKeys);
+        if (prev && (Keys[lo - 1] == frame || direction < 0 ||
+            (direction == 0 && (!next || frame - Keys[lo - 1] <= Keys[lo] - frame))))
+        {
+            k = Keys[lo - 1];
+        }
+        else if (next && direction >= 0)
+            k = Keys[lo];
+        else
+        {
+            avi->AVIerr = AVIERR_FRAME_NOT_EXIST;   // no keyframe that way
+            return 0;
+        }
+    }
+
+    avi->current_video_frame = k;
+    return(k);
+}
+
+
+// Build the table of how many audio bytes come before each block of
+// CIDX_ENTRIES audio chunks, used by AVI_SeekTime() and
+// AVI_ReadAudioSamples().  The last entry is the total.  Keeping one
+// entry per block instead of per chunk keeps it small next to a
+// COMPACT_INDEX.  Like the keyframe table, it is built the first time
+// it is needed, under BuildLock, and kept with the shared indexes.
+// Returns 0 if OK, else error code.
+
+int BuildAudioTable(AVI2 *avi)
+{
+    AVI_SHARE *share = avi->Share;
+    INDEX_ROOT *rt = &avi->AudRt;
+    QWORD *bytes;
+    DWORD size[CIDX_ENTRIES], i, b, NumBlocks;
+    int ret = 0;
+
+    if (!share)
+        return(AVIERR_NO_INDEX);
+
+    if (FlagGet(&share->AudReady))
+        return(0);
+
+    MutexLock(share->BuildLock);
+    if (FlagGet(&share->AudReady))   // another thread built it meanwhile
+    {
+        MutexUnlock(share->BuildLock);
+        return(0);
+    }
+
+    NumBlocks = (rt->index_entries + CIDX_ENTRIES - 1) / CIDX_ENTRIES;
+    bytes = (QWORD *) malloc((NumBlocks + 1) * sizeof(QWORD));
+    if (!bytes)
+        ret = AVIERR_MALLOC;
+    else
+        bytes[0] = 0;
+
+    for (b = 0; b < NumBlocks && !ret; b++)
+    {
+        ret = GetIndexBlock(avi, rt, b * CIDX_ENTRIES, size, NULL);
+        if (ret)
+            break;
+        bytes[b + 1] = bytes[b];
+        for (i = 0; i < CIDX_ENTRIES && b * CIDX_ENTRIES + i < rt->index_entries; i++)
+            bytes[b + 1] += size[i];
+    }
+
+    if (!ret)
+    {
+        share->AudBytes = bytes;
+        FlagSet(&share->AudReady, TRUE);
+    }
+    else if (bytes)
+        free(bytes);
+    MutexUnlock(share->BuildLock);
+
+    return(ret);
+}
+
+
+// Find the audio chunk that holds byte Byte of the audio stream and
+// put the number of audio bytes before it in Before.  The audio byte
+// table gives the block of chunks, and the sizes of the chunks in the
+// block are added up from there.  Byte must be less than the total.
+// BuildAudioTable() must have been called.
+// Returns 0 if OK, else error code.  AVIerr is not changed.
+
+static int FindAudioChunk(AVI2 *avi, QWORD Byte, DWORD *Chunk, QWORD *Before)
+{
+    QWORD *Bytes = avi->Share->AudBytes;
+    DWORD size[CIDX_ENTRIES], lo, hi, mid, i, count;
+    int ret;
+
+    // Find the last block that starts at or before it
+    lo = 0;
+    hi = (avi->AudRt.index_entries + CIDX_ENTRIES - 1) / CIDX_ENTRIES;
+    while (hi - lo > 1)
+    {
+        mid = (lo + hi) / 2;
+        if (Bytes[mid] <= Byte)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    ret = GetIndexBlock(avi, &avi->AudRt, lo * CIDX_ENTRIES, size, NULL);
+    if (ret)
+        return(ret);
+
+    // Then the last chunk in it that starts at or before it
+    count = avi->AudRt.index_entries - lo * CIDX_ENTRIES;
+    if (count > CIDX_ENTRIES) count = CIDX_ENTRIES;
+    *Before = Bytes[lo];
+    for (i = 0; i + 1 < count && *Before + size[i] <= Byte; i++)
+        *Before += size[i];
+
+    *Chunk = lo * CIDX_ENTRIES + i;
+    return(0);
+}
+
+
+// Seek both streams to a time in milliseconds from the start.  The
+// current video frame is set to the frame showing at that time.  The
+// current audio chunk is set to the one holding the audio for that
+// time, found with the audio byte table.  For PCM
+// audio the exact sample is found, so AudSkip is set to the bytes at
+// the start of that chunk which come before it.  Other audio formats
+// go by the average byte rate.  AudSkip may be NULL.  A time past the
+// end leaves a stream at its end, so the next read returns EOF.
+// Returns 0 if OK, else error code.
+
+int AVI_SeekTime(AVI2 *avi, DWORD ms, DWORD *AudSkip)
+{
+    QWORD *Bytes, target, before;
+    DWORD frame, n, c;
+    int ret;
+
+    if (!avi)
+        return(AVIERR_AVI_STRUCT_BAD);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+    if (AudSkip) *AudSkip = 0;
+
+    if (avi->filemode != FOR_READING)
+        return(avi->AVIerr = AVIERR_WRONG_FILE_MODE);
+
+    if (avi->has_video)
+    {
+        frame = (DWORD)((double) ms * avi->fps / 1000.0);
+        if (frame > avi->VidRt.index_entries)
+            frame = avi->VidRt.index_entries;
+        avi->current_video_frame = frame;
+    }
+
+    if (avi->has_audio)
+    {
+        ret = BuildAudioTable(avi);   // only does something the first time
+        if (ret)
+            return(avi->AVIerr = ret);
+
+        // Find the byte of audio that plays at time ms
+        if (avi->Aud.wFormatTag == 1)   // PCM
+            target = (QWORD) ms * avi->Aud.nSamplesPerSec / 1000 * avi->Aud.nBlockAlign;
+        else
+            target = (QWORD) ms * avi->Aud.nAvgBytesPerSec / 1000;
+
+        // Find the last chunk that starts at or before it
+        Bytes = avi->Share->AudBytes;
+        n = avi->AudRt.index_entries;
+        if (target >= Bytes[(n + CIDX_ENTRIES - 1) / CIDX_ENTRIES])   // past the end
+        {
+            avi->current_audio_frame = n;
+            return(0);
+        }
+
+        ret = FindAudioChunk(avi, target, &c, &before);
+        if (ret)
+            return(avi->AVIerr = ret);
+
+        avi->current_audio_frame = c;
+        if (AudSkip) *AudSkip = (DWORD)(target - before);
     }
 
+    return(0);
+}
+
+
+// Read chunk n of an index root into Buf.  This does not use or
+// change the current frame counters or the file position so it is
+// safe to call from several threads on the same AVI2 at once.
+// If Buf is NULL, return the chunk size without reading anything.
+// Returns bytes read and *err is 0, or returns 0 and *err holds
+// the error code.  A chunk cut short by the end of the file is not
+// an error.  The bytes that are there are returned.
+
+static DWORD ReadChunk(AVI2 *avi, INDEX_ROOT *rt, DWORD n, BYTE *Buf,
+                       DWORD BufSize, int *Key, int *err)
+{
+    QWORD pos;
+    DWORD ckSize;
+
+    *err = GetIndexEntry(avi, rt, n, &pos, &ckSize, Key);
+    if (*err)
+        return 0;
+
+    if (!Buf)   // just return size
+        return(ckSize);
+
     // Check buffer size
-    if (VidBufSize < ckSize)
+    if (BufSize < ckSize)
     {
-        avi->AVIerr = AVIERR_BUFFER_SIZE;  // Buffer too small
+        *err = AVIERR_BUFFER_SIZE;  // Buffer too small
         return 0;
     }
 
-    // Seek to movi chunk position
-    File64SetBase(avi->fp, avi->BaseTable[baseIdx]);
-    File64SetPos(avi->fp, entry->dwOffset, SEEK_SET);
+    return(File64PRead(avi->fp, Buf, ckSize, pos));
+}
+
+
+// Read current video frame
+// Return bytes read.  If VidBuf == NULL, return frame chunk size
+// without doing anything else.  Return 0 if ERROR, else bytes read.
+// Check AVIerr to make sure returned size is correct if return is zero.
+// If both return code and AVIerr are zero on return, the avi parameter is NULL.
+//
+DWORD AVI_ReadVframe(AVI2 *avi, BYTE *VidBuf, DWORD VidBufSize, int *keyframe)
+{
+    DWORD bytes_read;
+    int err;
+
+    if (!avi)
+        return 0;
 
-    // Read frame data
-    bytes_read = File64Read(avi->fp, VidBuf, ckSize);
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_READING)
+    {
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;  // Function incompatible with mode
+        return 0;
+    }
 
-    // Set keyframe flag if requested
-    if (keyframe)
+    bytes_read = ReadChunk(avi, &avi->VidRt, avi->current_video_frame,
+                           VidBuf, VidBufSize, keyframe, &err);
+    if (err)
     {
-        // Bit 4 (0x10) of dwFlags indicates keyframe
-        *keyframe = (key) ? FALSE : TRUE;
+        // Running off the end is EOF for video
+        avi->AVIerr = (err == AVIERR_FRAME_NOT_EXIST) ? AVIERR_EOF : err;
+        return 0;
     }
 
     // Advance to next frame
-    avi->current_video_frame++;
+    if (VidBuf)
+        avi->current_video_frame++;
 
     return bytes_read;
 }
@@ -867,9 +1276,8 @@ DWORD AVI_ReadVframe(AVI2 *avi, BYTE *VidBuf, DWORD VidBufSize, int *keyframe)
 
 DWORD AVI_ReadAframe(AVI2 *avi, BYTE *AudioBuf, DWORD BufSize)
 {
-    MEMINDEXENTRY *entry;
     DWORD bytes_read;
-    DWORD ckSize, BaseIdx;
+    int err;
 
     if (!avi)
     {
@@ -884,83 +1292,915 @@ DWORD AVI_ReadAframe(AVI2 *avi, BYTE *AudioBuf, DWORD BufSize)
         return 0;
     }
 
-    if (!avi->AudRt.Idx)
+    bytes_read = ReadChunk(avi, &avi->AudRt, avi->current_audio_frame,
+                           AudioBuf, BufSize, NULL, &err);
+    if (err)
     {
-        avi->AVIerr = AVIERR_NO_INDEX;  // No index found
+        avi->AVIerr = err;
         return 0;
     }
 
-    if (avi->current_audio_frame >= avi->AudRt.index_entries)
+    if (!AudioBuf && bytes_read == 0)
     {
-        avi->AVIerr = AVIERR_FRAME_NOT_EXIST;  // No more frames
-        return 0;
+AVI_DBG_1d("Returning size=0, frm=%d\n", avi->current_audio_frame);
     }
 
-    entry = &avi->AudRt.Idx[avi->current_audio_frame];
-    ckSize = GET_CHUNK_SIZE(entry->dwSize);
-    BaseIdx = GET_CHUNK_BASEINDEX(entry->dwSize);
+    // Advance to next chunk
+    if (AudioBuf)
+        avi->current_audio_frame++;
 
-    if (!AudioBuf)   // just return size
-    {
-        if (ckSize == 0)
-        {
-AVI_DBG_1d("Returning size=0, frm=%d\n", avi->current_audio_frame);
-        }
-        return(ckSize);
-    }
+    return bytes_read;
+}
 
-    // Check buffer size
-    if (BufSize < ckSize)
+
+// Read any video frame by number without using the current video
+// frame.  Nothing shared in the AVI2 structure is changed unless
+// there is an error, so worker threads can all read from the same
+// open file without locking.  Otherwise the same as AVI_ReadVframe().
+// AVIerr is only set on error and may be overwritten by another thread.
+
+DWORD AVI_ReadVframeAt(AVI2 *avi, DWORD frame, BYTE *VidBuf, DWORD VidBufSize, int *keyframe)
+{
+    DWORD bytes_read;
+    int err;
+
+    if (!avi)
+        return 0;
+
+    if (avi->filemode != FOR_READING)
     {
-        avi->AVIerr = AVIERR_BUFFER_SIZE;  // Buffer too small
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;  // Function incompatible with mode
         return 0;
     }
 
-    // Seek to chunk position
-    File64SetBase(avi->fp, avi->BaseTable[BaseIdx]);
-    File64SetPos(avi->fp, entry->dwOffset, SEEK_SET);
-
-    // Read audio data
-    bytes_read = File64Read(avi->fp, AudioBuf, ckSize);
-
-    // Advance to next chunk
-    avi->current_audio_frame++;
+    bytes_read = ReadChunk(avi, &avi->VidRt, frame, VidBuf, VidBufSize, keyframe, &err);
+    if (err)
+        avi->AVIerr = err;
 
-    return bytes_read;
+    return(bytes_read);
 }
 
 
-// Return the index of the basetable[] that the qwOffset belongs in
-
+// Read up to count video frames starting with frame first into Buf
+// using as few reads as possible.  Frames that are close together in
+// the file are read with one read, along with the chunk headers and
+// anything else between them, so Buf also holds bytes that are not
+// frame data.  Frames[i] and Lens[i] are set to where frame first+i is
+// in Buf and its length.  Keys may be NULL.  Fewer frames are read if
+// Buf fills up or the video ends.  Like AVI_ReadVframeAt(), the current
+// video frame is not used or changed.
+// Returns the number of frames read, or 0 on error.
 
-static int GetBaseTableIdx(AVI2 *avi, QWORD qwOffset)
+DWORD AVI_ReadVframes(AVI2 *avi, DWORD first, DWORD count, BYTE *Buf, DWORD BufSize,
+                      BYTE **Frames, DWORD *Lens, int *Keys)
 {
-    DWORD i;
+    QWORD pos, RunStart = 0, RunEnd = 0;
+    DWORD n, size, len, RunOff = 0;
+    int err, key;
 
-    for (i = 1; i < avi->NumBases; i++)
+    if (!avi)
+        return 0;
+
+    if (avi->filemode != FOR_READING)
     {
-        if (qwOffset < avi->BaseTable[i])
-            break;
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;  // Function incompatible with mode
+        return 0;
     }
-    return(i - 1);
-}
 
+    if (!Buf || !Frames || !Lens)
+    {
+        avi->AVIerr = AVIERR_BAD_PARAMETER;
+        return 0;
+    }
 
+    for (n = 0; n < count; n++)
+    {
+        err = GetIndexEntry(avi, &avi->VidRt, first + n, &pos, &size, &key);
+        if (err == AVIERR_FRAME_NOT_EXIST && n > 0)
+            break;   // end of the video
+        if (err)
+        {
+            avi->AVIerr = err;
+            return 0;
+        }
 
+        // Add the frame to the read being planned if it is a little
+        // way after it and still fits.  Otherwise do that read and
+        // start a new one.
+        if (n == 0 || pos < RunEnd || pos - RunEnd > MAX_READ_GAP ||
+            pos + size - RunStart > BufSize - RunOff)
+        {
+            if (n > 0)
+            {
+                len = (DWORD)(RunEnd - RunStart);
+                if (File64PRead(avi->fp, Buf + RunOff, len, RunStart) != len)
+                {
+                    avi->AVIerr = AVIERR_FILE_CORRUPTED;   // runs past end of file
+                    return 0;
+                }
+                RunOff += len;
+            }
 
+            if (size > BufSize - RunOff)   // Buf is full
+            {
+                if (n == 0)
+                {
+                    avi->AVIerr = AVIERR_BUFFER_SIZE;  // Buffer too small
+                    return 0;
+                }
+                return(n);
+            }
+            RunStart = pos;
+        }
+        RunEnd = pos + size;
 
+        Frames[n] = Buf + RunOff + (DWORD)(pos - RunStart);
+        Lens[n] = size;
+        if (Keys) Keys[n] = key;
+    }
 
+    // Do the last read
+    len = (DWORD)(RunEnd - RunStart);
+    if (n > 0 && File64PRead(avi->fp, Buf + RunOff, len, RunStart) != len)
+    {
+        avi->AVIerr = AVIERR_FILE_CORRUPTED;
+        return 0;
+    }
 
+    return(n);
+}
 
 
-/*
+// Read any audio chunk by number without using the current audio
+// chunk.  Same as AVI_ReadVframeAt() except for audio.
 
-// Get current location and add it to the BaseTable[].
-// This gets called for every new RIFF.
-// Returns 0 if OK or error code.
+DWORD AVI_ReadAframeAt(AVI2 *avi, DWORD chunk, BYTE *AudioBuf, DWORD BufSize)
+{
+    DWORD bytes_read;
+    int err;
 
-static int SetBaseTable(AVI2 *avi)
-{
+    if (!avi)
+        return 0;
+
+    if (avi->filemode != FOR_READING)
+    {
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;  // Function incompatible with mode
+        return 0;
+    }
+
+    bytes_read = ReadChunk(avi, &avi->AudRt, chunk, AudioBuf, BufSize, NULL, &err);
+    if (err)
+        avi->AVIerr = err;
+
+    return(bytes_read);
+}
+
+
+// Read the next chunk of either stream in the order the chunks are in
+// the file.  The video and audio indexes are merged by file position
+// using the current video frame and current audio chunk, so reading a
+// whole file this way is one forward pass with no seeking back and
+// forth.  Stream is set to 0 for video or 1 for audio.  If Buf is NULL,
+// return the chunk size and stream without doing anything else.
+// Return 0 if ERROR, else bytes read.  AVIERR_EOF is set when both
+// streams are done.
+
+DWORD AVI_ReadNextChunk(AVI2 *avi, BYTE *Buf, DWORD BufSize, int *Stream, int *keyframe)
+{
+    QWORD VidPos, AudPos;
+    DWORD bytes_read;
+    int err, VidErr, AudErr, Audio;
+
+    if (!avi)
+        return 0;
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_READING)
+    {
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;  // Function incompatible with mode
+        return 0;
+    }
+
+    // Find where the next chunk of each stream is
+    VidErr = AVIERR_FRAME_NOT_EXIST;
+    AudErr = AVIERR_FRAME_NOT_EXIST;
+    if (avi->has_video)
+        VidErr = GetIndexEntry(avi, &avi->VidRt, avi->current_video_frame, &VidPos, NULL, NULL);
+    if (avi->has_audio)
+        AudErr = GetIndexEntry(avi, &avi->AudRt, avi->current_audio_frame, &AudPos, NULL, NULL);
+
+    // Running off the end of one stream is not an error
+    if (VidErr && VidErr != AVIERR_FRAME_NOT_EXIST)
+    {
+        avi->AVIerr = VidErr;
+        return 0;
+    }
+    if (AudErr && AudErr != AVIERR_FRAME_NOT_EXIST)
+    {
+        avi->AVIerr = AudErr;
+        return 0;
+    }
+    if (VidErr && AudErr)
+    {
+        avi->AVIerr = AVIERR_EOF;
+        return 0;
+    }
+
+    // Take whichever comes first in the file
+    Audio = VidErr || (!AudErr && AudPos < VidPos);
+    if (Stream) *Stream = Audio;
+
+    if (Audio)
+    {
+        if (keyframe) *keyframe = TRUE;   // audio chunks are always keyframes
+        bytes_read = ReadChunk(avi, &avi->AudRt, avi->current_audio_frame,
+                               Buf, BufSize, NULL, &err);
+    }
+    else
+        bytes_read = ReadChunk(avi, &avi->VidRt, avi->current_video_frame,
+                               Buf, BufSize, keyframe, &err);
+
+    if (err)
+    {
+        avi->AVIerr = err;
+        return 0;
+    }
+
+    // Advance past the chunk read
+    if (Buf)
+    {
+        if (Audio)
+            avi->current_audio_frame++;
+        else
+            avi->current_video_frame++;
+    }
+
+    return bytes_read;
+}
+
+
+// Get the file position and length of the part of audio chunk c that
+// is between audio bytes First and End of the stream.  Before is the
+// number of audio bytes before the chunk.  The whole chunk size is put
+// in Size so the caller can keep count for the next one.
+// Returns 0 if OK, else error code.
+
+static int GetAudioPiece(AVI2 *avi, DWORD c, QWORD Before, QWORD First,
+                         QWORD End, QWORD *Pos, DWORD *Len, DWORD *Size)
+{
+    QWORD from, to;
+    int ret;
+
+    ret = GetIndexEntry(avi, &avi->AudRt, c, Pos, Size, NULL);
+    if (ret)
+        return(ret);
+
+    from = (Before > First) ? Before : First;
+    to = (Before + *Size < End) ? Before + *Size : End;
+    *Pos += from - Before;
+    *Len = (DWORD)(to - from);
+    return(0);
+}
+
+
+// Read the audio between bytes First and End of the stream from chunks
+// c to Last - 1 with one read into Buf.  Before is the number of audio
+// bytes before chunk c.  The read is Len bytes from file position
+// Start, which is where the audio wanted from chunk c starts.  The
+// chunks must follow each other in the file with only their headers
+// between them, and Buf must have room for the headers too.  They are
+// squeezed out after the read.
+// Returns 0 if OK, else error code.
+
+static int ReadAudioRun(AVI2 *avi, DWORD c, DWORD Last, QWORD Before,
+                        QWORD First, QWORD End, QWORD Start, DWORD Len,
+                        BYTE *Buf)
+{
+    QWORD pos;
+    DWORD len, size, out = 0;
+    int ret;
+
+    if (File64PRead(avi->fp, Buf, Len, Start) != Len)
+        return(AVIERR_FILE_CORRUPTED);   // runs past end of file
+
+    // Move each chunk down over the header in front of it
+    for (; c < Last; c++)
+    {
+        ret = GetAudioPiece(avi, c, Before, First, End, &pos, &len, &size);
+        if (ret) return(ret);
+        memmove(Buf + out, Buf + (DWORD)(pos - Start), len);
+        out += len;
+        Before += size;
+    }
+
+    return(0);
+}
+
+
+// Read Count audio samples starting with sample Start into Buf, no
+// matter how the audio is split into chunks.  A sample is one block of
+// nBlockAlign bytes, which for PCM is one sample of every channel.  The
+// audio byte table finds the first chunk, and chunks that follow each
+// other in the file are read with one read.  Fewer samples are read if
+// Buf is too small or the audio ends.  Like AVI_ReadAframeAt(), the
+// current audio chunk is not used or changed.
+// Returns the number of samples read, or 0 on error.
+
+DWORD AVI_ReadAudioSamples(AVI2 *avi, QWORD Start, DWORD Count, BYTE *Buf, DWORD BufSize)
+{
+    QWORD first, end, pos, total, before, RunStart, RunEnd, RunBefore;
+    DWORD align, c, n, len, size, RunFirst, RunLen, RunOut;
+    int ret;
+
+    if (!avi)
+        return 0;
+
+    if (avi->filemode != FOR_READING)
+    {
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;  // Function incompatible with mode
+        return 0;
+    }
+
+    if (!Buf)
+    {
+        avi->AVIerr = AVIERR_BAD_PARAMETER;
+        return 0;
+    }
+
+    ret = BuildAudioTable(avi);   // only does something the first time
+    if (ret)
+    {
+        avi->AVIerr = ret;
+        return 0;
+    }
+
+    n = avi->AudRt.index_entries;
+    total = avi->Share->AudBytes[(n + CIDX_ENTRIES - 1) / CIDX_ENTRIES];
+    align = avi->Aud.nBlockAlign;
+    if (n == 0 || Start >= total / (align ? align : 1))
+    {
+        avi->AVIerr = AVIERR_EOF;
+        return 0;
+    }
+
+    if (align == 0)
+    {
+        avi->AVIerr = AVIERR_NOT_SUPPORTED;   // no fixed sample size
+        return 0;
+    }
+
+    // Only whole samples that fit in Buf and are in the stream
+    if (Count > BufSize / align)
+        Count = BufSize / align;
+    if (Count == 0)
+    {
+        avi->AVIerr = AVIERR_BUFFER_SIZE;  // Buffer too small
+        return 0;
+    }
+    first = Start * align;
+    if (Count > (total - first) / align)
+        Count = (DWORD)((total - first) / align);
+    end = first + (QWORD) Count * align;
+
+    // Find the chunk holding the first sample
+    ret = FindAudioChunk(avi, first, &c, &before);
+    if (!ret)
+        ret = GetAudioPiece(avi, c, before, first, end, &RunStart, &RunLen, &size);
+    if (ret)
+    {
+        avi->AVIerr = ret;
+        return 0;
+    }
+
+    RunEnd = RunStart + RunLen;
+    RunFirst = c;
+    RunBefore = before;
+    RunOut = 0;
+    before += size;
+
+    for (c++; c < n && before < end && !ret; c++)
+    {
+        ret = GetAudioPiece(avi, c, before, first, end, &pos, &len, &size);
+        if (ret) break;
+
+        // Add the chunk to the read if only its header and pad byte
+        // are in front of it and it still fits.  Otherwise do that
+        // read and start a new one.
+        if (pos < RunEnd || pos - RunEnd > 8 + 1 ||
+            pos + len - RunStart > BufSize - RunOut)
+        {
+            ret = ReadAudioRun(avi, RunFirst, c, RunBefore, first, end,
+                               RunStart, (DWORD)(RunEnd - RunStart), Buf + RunOut);
+            RunOut += RunLen;
+            RunFirst = c;
+            RunBefore = before;
+            RunStart = pos;
+            RunLen = 0;
+        }
+        RunEnd = pos + len;
+        RunLen += len;
+        before += size;
+    }
+
+    // Do the last read
+    if (!ret)
+        ret = ReadAudioRun(avi, RunFirst, c, RunBefore, first, end,
+                           RunStart, (DWORD)(RunEnd - RunStart), Buf + RunOut);
+    if (ret)
+    {
+        avi->AVIerr = ret;
+        return 0;
+    }
+
+    return(Count);
+}
+
+
+// Get index entry n from an index root as an absolute file position
+// of the chunk payload, its size, and TRUE in Key if it is a keyframe.
+// Any of the return pointers may be NULL.
+// Returns 0 if OK, else error code.  AVIerr is not changed.
+
+static int GetIndexEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD n,
+                         QWORD *AbsPos, DWORD *Size, int *Key)
+{
+    MEMINDEXENTRY *entry;
+    WIDEINDEXENTRY *wentry;
+
+    if (!rt->Idx && !rt->WIdx && !rt->CIdx)
+        return(AVIERR_NO_INDEX);
+
+    if (n >= rt->index_entries)
+        return(AVIERR_FRAME_NOT_EXIST);
+
+    if (rt->CIdx)   // COMPACT_INDEX
+    {
+        QWORD pos;
+        DWORD sz;
+        int k;
+
+        GetCompactEntry(rt, n, &pos, &sz, &k);
+        if (AbsPos) *AbsPos = pos;
+        if (Size) *Size = sz;
+        if (Key) *Key = k;
+        return(0);
+    }
+
+    wentry = NULL;
+    if (rt->Seg)   // LAZY_INDEX - make sure the segment is in memory
+    {
+        INDEX_SEG *seg;
+        int ret = LoadIndexSegment(avi, rt, n, &seg);
+        if (ret) return(ret);
+        if (seg->WIdx)   // segment has wide entries of its own
+            wentry = &seg->WIdx[n - seg->First];
+    }
+
+    if (rt->WIdx)   // WIDE_INDEX
+        wentry = &rt->WIdx[n];
+
+    if (wentry)
+    {
+        if (AbsPos)
+            *AbsPos = wentry->qwOffset;
+        if (Size)
+            *Size = GET_WIDE_SIZE(wentry->dwSize);
+        if (Key)
+            *Key = GET_CHUNK_KEYFRAME(wentry->dwSize) ? FALSE : TRUE;
+        return(0);
+    }
+
+    entry = &rt->Idx[n];
+    if (AbsPos)
+        *AbsPos = avi->BaseTable[GET_CHUNK_BASEINDEX(entry->dwSize)] + entry->dwOffset;
+    if (Size)
+        *Size = GET_CHUNK_SIZE(entry->dwSize);
+    if (Key)
+        *Key = GET_CHUNK_KEYFRAME(entry->dwSize) ? FALSE : TRUE;
+
+    return(0);
+}
+
+
+// Get n bits (up to 58) starting at bit number BitPos of Buf.
+// Bits are numbered from the least significant bit of Buf[0].
+
+static QWORD GetBits(const BYTE *Buf, QWORD BitPos, int n)
+{
+    QWORD val;
+    int got, shift = (int)(BitPos & 7);
+
+    Buf += BitPos >> 3;
+    val = *Buf++ >> shift;
+    got = 8 - shift;
+
+    while (got < n)
+    {
+        val |= (QWORD) *Buf++ << got;
+        got += 8;
+    }
+
+    return(val & (((QWORD) 1 << n) - 1));
+}
+
+
+// Put the low n bits of val at bit number BitPos of Buf.  The bits
+// in Buf must already be zero.
+
+static void PutBits(BYTE *Buf, QWORD BitPos, QWORD val, int n)
+{
+    int shift = (int)(BitPos & 7);
+
+    Buf += BitPos >> 3;
+    *Buf++ |= (BYTE)(val << shift);
+    val >>= 8 - shift;
+    n -= 8 - shift;
+
+    while (n > 0)
+    {
+        *Buf++ |= (BYTE) val;
+        val >>= 8;
+        n -= 8;
+    }
+}
+
+
+// Return the number of bits needed to hold val
+
+static int BitsNeeded(DWORD val)
+{
+    int n = 0;
+
+    while (val)
+    {
+        n++;
+        val >>= 1;
+    }
+    return(n);
+}
+
+
+// Unpack entry n of a COMPACT_INDEX.  The position is found by adding
+// up the sizes and gaps from the start of its block.
+
+static void GetCompactEntry(INDEX_ROOT *rt, DWORD n,
+                            QWORD *AbsPos, DWORD *Size, int *Key)
+{
+    CIDX_BLOCK *blk = &rt->CIdx[n / CIDX_ENTRIES];
+    const BYTE *Buf = rt->CBits + blk->Data;
+    DWORD i, last = n % CIDX_ENTRIES;
+    DWORD size = 0, prev_size = 0, SizeMask;
+    QWORD pos = blk->Pos, val = 0;
+    int bits = 1 + blk->SizeBits + blk->GapBits;
+
+    SizeMask = (DWORD)(((QWORD) 1 << blk->SizeBits) - 1);
+
+    for (i = 0; i <= last; i++)
+    {
+        val = GetBits(Buf, (QWORD) i * bits, bits);
+        size = blk->MinSize + ((DWORD)(val >> 1) & SizeMask);
+        if (i)
+            pos += prev_size + blk->MinGap + (val >> (1 + blk->SizeBits));
+        prev_size = size;
+    }
+
+    *AbsPos = pos;
+    *Size = size;
+    *Key = (val & 1) ? FALSE : TRUE;
+}
+
+
+// Get the sizes and keyframe flags of the CIDX_ENTRIES index entries
+// starting with entry First, which is a multiple of CIDX_ENTRIES.  At
+// the end of the index there may be fewer.  Unlike GetCompactEntry(),
+// a COMPACT_INDEX block is unpacked in one pass, since sizes and
+// keyframe bits don't need the gaps added up.  Size or Key may be NULL.
+// Returns 0 if OK, else error code.  AVIerr is not changed.
+
+static int GetIndexBlock(AVI2 *avi, INDEX_ROOT *rt, DWORD First,
+                         DWORD *Size, int *Key)
+{
+    CIDX_BLOCK *blk;
+    const BYTE *Buf;
+    DWORD i, count, SizeMask;
+    QWORD val;
+    int ret, bits;
+
+    if (First >= rt->index_entries)
+        return(AVIERR_FRAME_NOT_EXIST);
+
+    count = rt->index_entries - First;
+    if (count > CIDX_ENTRIES) count = CIDX_ENTRIES;
+
+    if (!rt->CIdx)   // one at a time from the normal index
+    {
+        for (i = 0; i < count; i++)
+        {
+            ret = GetIndexEntry(avi, rt, First + i, NULL,
+                                Size ? &Size[i] : NULL, Key ? &Key[i] : NULL);
+            if (ret)
+                return(ret);
+        }
+        return(0);
+    }
+
+    blk = &rt->CIdx[First / CIDX_ENTRIES];
+    Buf = rt->CBits + blk->Data;
+    bits = 1 + blk->SizeBits + blk->GapBits;
+    SizeMask = (DWORD)(((QWORD) 1 << blk->SizeBits) - 1);
+
+    for (i = 0; i < count; i++)
+    {
+        val = GetBits(Buf, (QWORD) i * bits, bits);
+        if (Size) Size[i] = blk->MinSize + ((DWORD)(val >> 1) & SizeMask);
+        if (Key) Key[i] = (val & 1) ? FALSE : TRUE;
+    }
+
+    return(0);
+}
+
+
+// Pack the index of one stream into a COMPACT_INDEX.  The normal
+// index is left alone.  Returns 0 if OK, else error code.  It fails
+// with AVIERR_NOT_SUPPORTED if the chunks are not in file order.
+
+static int CompactIndex(AVI2 *avi, INDEX_ROOT *rt)
+{
+    CIDX_BLOCK *CIdx, *blk;
+    BYTE *CBits;
+    DWORD NumBlocks, b, i, first, count, size, MaxSize, MaxGap;
+    DWORD DataLen = 0;
+    QWORD pos, prev_end, gap, BitPos;
+    int bits, key;
+
+    // Note that CIDX_BLOCK is byte packed, so its Pos is not passed to
+    // GetIndexEntry().  It may not be aligned for a QWORD store.
+    NumBlocks = (rt->index_entries + CIDX_ENTRIES - 1) / CIDX_ENTRIES;
+    CIdx = (CIDX_BLOCK *) malloc(NumBlocks * sizeof(CIDX_BLOCK));
+    if (!CIdx)
+        return(AVIERR_MALLOC);
+
+    // First pass: find how many bits each block needs
+    for (b = 0; b < NumBlocks; b++)
+    {
+        blk = &CIdx[b];
+        first = b * CIDX_ENTRIES;
+        count = rt->index_entries - first;
+        if (count > CIDX_ENTRIES) count = CIDX_ENTRIES;
+
+        GetIndexEntry(avi, rt, first, &pos, &size, &key);
+        blk->Pos = pos;
+        blk->MinSize = MaxSize = size;
+        blk->MinGap = DWORD_MAX;
+        MaxGap = 0;
+        prev_end = pos + size;
+
+        for (i = 1; i < count; i++)
+        {
+            GetIndexEntry(avi, rt, first + i, &pos, &size, &key);
+            if (pos < prev_end || pos - prev_end > DWORD_MAX)
+            {
+                free(CIdx);
+                return(AVIERR_NOT_SUPPORTED);   // out of order
+            }
+            gap = pos - prev_end;
+            prev_end = pos + size;
+
+            if (size < blk->MinSize) blk->MinSize = size;
+            if (size > MaxSize) MaxSize = size;
+            if (gap < blk->MinGap) blk->MinGap = (DWORD) gap;
+            if (gap > MaxGap) MaxGap = (DWORD) gap;
+        }
+        if (count == 1) blk->MinGap = 0;
+
+        blk->SizeBits = (BYTE) BitsNeeded(MaxSize - blk->MinSize);
+        blk->GapBits = (BYTE) BitsNeeded(MaxGap - blk->MinGap);
+        blk->Data = DataLen;
+
+        bits = 1 + blk->SizeBits + blk->GapBits;
+        if (bits > 57)   // more than GetBits() can get
+        {
+            free(CIdx);
+            return(AVIERR_NOT_SUPPORTED);
+        }
+        if ((QWORD) DataLen + ((QWORD) count * bits + 7) / 8 > DWORD_MAX)
+        {
+            free(CIdx);
+            return(AVIERR_OVERFLOW);
+        }
+        DataLen += (count * bits + 7) / 8;
+    }
+
+    CBits = (BYTE *) calloc(DataLen, 1);
+    if (!CBits)
+    {
+        free(CIdx);
+        return(AVIERR_MALLOC);
+    }
+
+    // Second pass: pack the entries
+    for (b = 0; b < NumBlocks; b++)
+    {
+        blk = &CIdx[b];
+        first = b * CIDX_ENTRIES;
+        count = rt->index_entries - first;
+        if (count > CIDX_ENTRIES) count = CIDX_ENTRIES;
+        bits = 1 + blk->SizeBits + blk->GapBits;
+        BitPos = (QWORD) blk->Data * 8;
+        prev_end = blk->Pos;
+
+        for (i = 0; i < count; i++)
+        {
+            GetIndexEntry(avi, rt, first + i, &pos, &size, &key);
+            gap = i ? pos - prev_end - blk->MinGap : 0;
+            prev_end = pos + size;
+
+            PutBits(CBits, BitPos, (key ? 0 : 1) |
+                    ((QWORD)(size - blk->MinSize) << 1) |
+                    (gap << (1 + blk->SizeBits)), bits);
+            BitPos += bits;
+        }
+    }
+
+    rt->CIdx = CIdx;
+    rt->CBits = CBits;
+
+    return(0);
+}
+
+
+// Replace the normal indexes with COMPACT_INDEX ones.  This is done
+// after the whole file has been parsed, so while the file is being
+// opened the normal indexes are all in memory.  Only the memory used
+// after AVI_Open() returns is reduced.  A stream that can't be
+// packed keeps its normal index.  Indexes that are loaded a piece at
+// a time with LAZY_INDEX or live in a mapped INDEX_CACHE are left as
+// they are.
+
+void CompactIndexes(AVI2 *avi)
+{
+    INDEX_ROOT *rt[2];
+    int i;
+
+    if (avi->IdxCache || avi->VidRt.Seg || avi->AudRt.Seg)
+        return;
+
+    rt[0] = &avi->VidRt;
+    rt[1] = &avi->AudRt;
+
+    for (i = 0; i < 2; i++)
+    {
+        if ((!rt[i]->Idx && !rt[i]->WIdx) || rt[i]->index_entries == 0)
+            continue;
+
+        if (CompactIndex(avi, rt[i]) == 0)
+        {
+            if (rt[i]->Idx) free(rt[i]->Idx);
+            if (rt[i]->WIdx) free(rt[i]->WIdx);
+            rt[i]->Idx = NULL;
+            rt[i]->WIdx = NULL;
+        }
+    }
+}
+
+
+// Peek at the current video frame without copying it.
+// This only works when the file was opened with MEMORY_MAPPED.
+// Returns a pointer to the frame data inside the file mapping and
+// the frame length in len.  The pointer is good until AVI_Close().
+// If keyframe is not NULL, it is set TRUE for a keyframe.  The
+// current video frame is advanced the same as AVI_ReadVframe().
+// Returns NULL on error and AVIerr holds the error code.
+
+const BYTE *AVI_PeekVframe(AVI2 *avi, DWORD *len, int *keyframe)
+{
+    QWORD pos;
+    DWORD ckSize;
+    BYTE *ptr;
+    int ret;
+
+    if (!avi)
+        return(NULL);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_READING)
+    {
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;  // Function incompatible with mode
+        return(NULL);
+    }
+
+    if (!(avi->OpenFlags & MEMORY_MAPPED))
+    {
+        avi->AVIerr = AVIERR_NOT_SUPPORTED;   // only for mapped files
+        return(NULL);
+    }
+
+    ret = GetIndexEntry(avi, &avi->VidRt, avi->current_video_frame, &pos, &ckSize, keyframe);
+    if (ret)
+    {
+        avi->AVIerr = (ret == AVIERR_FRAME_NOT_EXIST) ? AVIERR_EOF : ret;
+        return(NULL);
+    }
+
+    ptr = File64MapPtr(avi->fp, pos, ckSize);
+    if (!ptr)  // index points outside of the file
+    {
+        avi->AVIerr = AVIERR_FILE_CORRUPTED;
+        return(NULL);
+    }
+
+    if (len) *len = ckSize;
+
+    // Advance to next frame
+    avi->current_video_frame++;
+
+    return(ptr);
+}
+
+
+// Peek at the current audio chunk without copying it.
+// Same as AVI_PeekVframe() except for audio.
+
+const BYTE *AVI_PeekAframe(AVI2 *avi, DWORD *len)
+{
+    QWORD pos;
+    DWORD ckSize;
+    BYTE *ptr;
+    int ret;
+
+    if (!avi)
+        return(NULL);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_READING)
+    {
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;  // Function incompatible with mode
+        return(NULL);
+    }
+
+    if (!(avi->OpenFlags & MEMORY_MAPPED))
+    {
+        avi->AVIerr = AVIERR_NOT_SUPPORTED;   // only for mapped files
+        return(NULL);
+    }
+
+    ret = GetIndexEntry(avi, &avi->AudRt, avi->current_audio_frame, &pos, &ckSize, NULL);
+    if (ret)
+    {
+        avi->AVIerr = ret;
+        return(NULL);
+    }
+
+    ptr = File64MapPtr(avi->fp, pos, ckSize);
+    if (!ptr)  // index points outside of the file
+    {
+        avi->AVIerr = AVIERR_FILE_CORRUPTED;
+        return(NULL);
+    }
+
+    if (len) *len = ckSize;
+
+    // Advance to next chunk
+    avi->current_audio_frame++;
+
+    return(ptr);
+}
+
+
+// Return the index of the basetable[] that the qwOffset belongs in
+
+
+static int GetBaseTableIdx(AVI2 *avi, QWORD qwOffset)
+{
+    DWORD i;
+
+    for (i = 1; i < avi->NumBases; i++)
+    {
+        if (qwOffset < avi->BaseTable[i])
+            break;
+    }
+    return(i - 1);
+}
+
+
+
+
+
+
+
+
+
+/*
+
+// Get current location and add it to the BaseTable[].
+// This gets called for every new RIFF.
+// Returns 0 if OK or error code.
+
+static int SetBaseTable(AVI2 *avi)
+{
     QWORD Absolute;
 
     // Check to make sure there is room for another RIFF segment
@@ -980,34 +2220,79 @@ static int SetBaseTable(AVI2 *avi)
 */
 
 
+// Return TRUE if an index with chunks up to MaxSize must be made of
+// WIDE_INDEX entries.  This is the case if asked for, or if a chunk
+// size or base index won't fit in a MEMINDEXENTRY.
+
+static int NeedWideIndex(AVI2 *avi, DWORD MaxSize)
+{
+    return((avi->OpenFlags & WIDE_INDEX) || avi->NumBases > MAX_RIFF ||
+           MaxSize > MAX_MEM_CHUNK_SIZE);
+}
+
+
+// Allocate the index of an index root for Count entries.  The
+// entries are WIDEINDEXENTRY if Wide is TRUE.
+// Returns 0 if OK, else error code.  AVIerr is not changed.
+
+static int AllocRootIndex(INDEX_ROOT *rt, DWORD Count, int Wide)
+{
+    DWORD EntrySize = Wide ? sizeof(WIDEINDEXENTRY) : sizeof(MEMINDEXENTRY);
+
+    // Make sure we don't overflow our 32 bit integer in malloc
+    if (Count > DWORD_MAX / EntrySize)
+        return(AVIERR_OVERFLOW);
+
+    if (Wide)
+        rt->WIdx = (WIDEINDEXENTRY *) malloc(Count * EntrySize);
+    else
+        rt->Idx = (MEMINDEXENTRY *) malloc(Count * EntrySize);
+
+    if (!rt->Idx && !rt->WIdx)
+        return(AVIERR_MALLOC);
+
+    return(0);
+}
+
+
+// Return where Count standard index entries that will become index
+// entries First on of rt must be read.  FixChunkIndex() converts
+// them right where they are.  A MEMINDEXENTRY is the same size as a
+// STDINDEXENTRY, but a WIDEINDEXENTRY is bigger, so in that case
+// they are read into the end of the space for the wide entries.
+// Each wide entry then only overwrites standard entries that have
+// already been converted.
+
+static STDINDEXENTRY *ChunkIndexBuf(INDEX_ROOT *rt, DWORD First, DWORD Count)
+{
+    if (rt->WIdx)
+        return((STDINDEXENTRY *)(rt->WIdx + First + Count) - Count);
+
+    return((STDINDEXENTRY *)(rt->Idx + First));
+}
+
+
 // Helper function to process a standard chunk index
-// This reads the index entries and updates the dwSize field with base index.
-// On entry, fp is already pointing to the INDX_CHUNK header.
-// The idx_ptr is already allocated.
+// This reads the index entries and converts them into index entries
+// First on of rt.  On entry, fp is already pointing to the INDX_CHUNK
+// header.  The index of rt is already allocated.
 //
-// Returns the max chunk size, or negative error code
+// Returns the max chunk size, or negative error code.  The error is
+// AVIERR_OVERFLOW if a chunk is too big for a MEMINDEXENTRY.
 
 static int
-ChunkIndexHelper(AVI2 *avi, MEMINDEXENTRY *idx_ptr, DWORD len)
+ChunkIndexHelper(AVI2 *avi, INDEX_ROOT *rt, DWORD First, DWORD len)
 {
-    DWORD i, num_entries, chunk_size, max_chunk_size = 0;
+    DWORD num_entries;
     DWORD entries_size;
-    int base_idx;
+    int max_chunk_size;
     INDX_CHUNK idxh;
-    QWORD AbsOffset, AbsRiffBase, NewOffset;
 
 
     // Get the INDX+CHUNK header
     if (File64Read(avi->fp, &idxh, sizeof(INDX_CHUNK)) != sizeof(INDX_CHUNK))
         return(-(avi->AVIerr = AVIERR_FILE_CORRUPTED));
 
-    // Get index to BaseTable[] with proper RIFF base address
-    base_idx = GetBaseTableIdx(avi, idxh.qwBaseOffset);
-    if (base_idx < 0)
-        return(base_idx);    // error already negative
-
-    AbsRiffBase = avi->BaseTable[base_idx];
-
     num_entries = idxh.nEntriesInUse;
     if (num_entries == 0)
         return 0;   // zero is unusual, but not an error.
@@ -1016,18 +2301,77 @@ ChunkIndexHelper(AVI2 *avi, MEMINDEXENTRY *idx_ptr, DWORD len)
         return(-(avi->AVIerr = AVIERR_FILE_CORRUPTED));
 
 
-    // Read all index entries directly into the memory index
-    // Note: MEMINDEXENTRY and STDINDEXENTRY have identical layout
-    entries_size = num_entries * sizeof(MEMINDEXENTRY);
-    if (File64Read(avi->fp, idx_ptr, entries_size) != entries_size)
-        return(-(avi->AVIerr = AVIERR_FILE_CORRUPTED));
+    // Read all index entries directly into the memory index
+    entries_size = num_entries * sizeof(STDINDEXENTRY);
+    if (File64Read(avi->fp, ChunkIndexBuf(rt, First, num_entries),
+                   entries_size) != entries_size)
+        return(-(avi->AVIerr = AVIERR_FILE_CORRUPTED));
+
+    max_chunk_size = FixChunkIndex(avi, &idxh, rt, First);
+    if (max_chunk_size < 0)
+        avi->AVIerr = -max_chunk_size;
+
+    return(max_chunk_size);
+}
+
+
+// Convert the standard index entries that were read into
+// ChunkIndexBuf() into index entries First on of rt.  idxh is the
+// header they came from.  This does not change AVIerr so it can be
+// used for lazy loading.
+//
+// Returns the max chunk size, or negative error code.  The error is
+// AVIERR_OVERFLOW if a chunk is too big for a MEMINDEXENTRY.
+
+static int FixChunkIndex(AVI2 *avi, INDX_CHUNK *idxh, INDEX_ROOT *rt, DWORD First)
+{
+    DWORD i, num_entries, chunk_size, max_chunk_size = 0;
+    int base_idx;
+    QWORD AbsOffset, AbsRiffBase, NewOffset;
+    STDINDEXENTRY *src;
+    MEMINDEXENTRY *idx_ptr;
+    WIDEINDEXENTRY *wide_ptr;
+
+    num_entries = idxh->nEntriesInUse;
+
+    if (rt->WIdx)
+    {
+        // Wide entries hold the absolute position so no base is needed.
+        // Each standard entry is copied before its slot is overwritten.
+        src = ChunkIndexBuf(rt, First, num_entries);
+        wide_ptr = rt->WIdx + First;
+        for (i = 0; i < num_entries; i++)
+        {
+            AbsOffset = idxh->qwBaseOffset + (QWORD) src[i].dwOffset;
+            chunk_size = src[i].dwSize;   // keyframe bit and size
+
+            if (GET_WIDE_SIZE(chunk_size) > max_chunk_size)
+                max_chunk_size = GET_WIDE_SIZE(chunk_size);
+
+            wide_ptr[i].qwOffset = AbsOffset;
+            wide_ptr[i].dwSize = chunk_size;
+        }
+        return(max_chunk_size);
+    }
+
+    // Get index to BaseTable[] with proper RIFF base address
+    base_idx = GetBaseTableIdx(avi, idxh->qwBaseOffset);
+    if (base_idx < 0)
+        return(base_idx);    // error already negative
+    if (base_idx >= MAX_RIFF)
+        return(-AVIERR_OVERFLOW);   // needs WIDE_INDEX
+
+    AbsRiffBase = avi->BaseTable[base_idx];
+    idx_ptr = rt->Idx + First;
 
     // Update dwSize fields in place to add base index
     for (i = 0; i < num_entries; i++)
     {
+        // The base index goes where the top of a big size would be
+        if (idx_ptr[i].dwSize & 0x7F000000)
+            return(-AVIERR_OVERFLOW);   // needs WIDE_INDEX
+
         chunk_size = GET_CHUNK_SIZE(idx_ptr[i].dwSize);
-        if (chunk_size > 0x1000000)
-            return(-(avi->AVIerr = AVIERR_FILE_CORRUPTED));
 
         // Update max chunk size if needed
         if (chunk_size > max_chunk_size)
@@ -1039,11 +2383,11 @@ ChunkIndexHelper(AVI2 *avi, MEMINDEXENTRY *idx_ptr, DWORD len)
 
         // Make offset be offset to RIFF base.
         // First get absolute pointer
-        AbsOffset = idxh.qwBaseOffset + (QWORD) idx_ptr[i].dwOffset;
+        AbsOffset = idxh->qwBaseOffset + (QWORD) idx_ptr[i].dwOffset;
         // Make relative to RIFF base
         NewOffset = AbsOffset - AbsRiffBase;
         if (NewOffset > AVI_MAX_RIFF_SIZE)
-            return(-(avi->AVIerr = AVIERR_FILE_CORRUPTED));
+            return(-AVIERR_FILE_CORRUPTED);
 
         idx_ptr[i].dwOffset = (DWORD) NewOffset;  // Save corrected offset
     }
@@ -1052,18 +2396,31 @@ ChunkIndexHelper(AVI2 *avi, MEMINDEXENTRY *idx_ptr, DWORD len)
     return(max_chunk_size);
 }
 
+
+// Free whichever index an index root has.
+
+static void FreeRootIndex(INDEX_ROOT *rt)
+{
+    if (rt->Idx) free(rt->Idx);
+    if (rt->WIdx) free(rt->WIdx);
+    rt->Idx = NULL;
+    rt->WIdx = NULL;
+}
+
 // Parse a standard chunk index (non-master index)
 // This is used when ODML files skip the master index and put a
 // standard index directly in the hdrl section.  The index is
 // allocated here since there was no master index to do it.  The
 // file pointer is expected to be pointing to the first index entry.
+// If a chunk turns out to be too big for a MEMINDEXENTRY, the index
+// is read again with WIDE_INDEX entries.
 
 
 static int ParseChunkIndex(AVI2 *avi, INDX_CHUNK *idxh, DWORD list_size)
 {
-    MEMINDEXENTRY *idx_array;
+    INDEX_ROOT *rt;
     DWORD num_entries, shouldBeEntries;
-    DWORD max_chunk_size;
+    int max_chunk_size, ret, Wide;
     char chunk_type;
     DWORD save_pos;
 
@@ -1091,38 +2448,39 @@ static int ParseChunkIndex(AVI2 *avi, INDX_CHUNK *idxh, DWORD list_size)
         // Since it has to be 'auds' or 'vids' this is a fatal error if here.
         return(avi->AVIerr = AVIERR_FILE_CORRUPTED);
     }
+    rt = (chunk_type == 'd') ? &avi->VidRt : &avi->AudRt;
 
     // Allocate memory for index array
     // Note: This is only done for indexes under stream list in place
     // of the superindex
     // Note: Only one index in hdrl allowed.
-    idx_array = (MEMINDEXENTRY *)malloc(num_entries * sizeof(MEMINDEXENTRY));
-    if (!idx_array)
-        return(avi->AVIerr = AVIERR_MALLOC);
-
-
-    // Go back to the start of the INDEX_CHUNK header
-    // This is necessary because of how ChunkIndexHelper() works.
-    File64SetPos(avi->fp, -(long) sizeof(INDX_CHUNK), SEEK_CUR);
-
-    // Process the chunk index
-    max_chunk_size = ChunkIndexHelper(avi, idx_array, num_entries);
-    if (max_chunk_size < 0)
-        return(-avi->AVIerr);
+    for (Wide = NeedWideIndex(avi, 0); ; Wide = TRUE)
+    {
+        ret = AllocRootIndex(rt, num_entries, Wide);
+        if (ret)
+            return(avi->AVIerr = ret);
+
+        // Go back to the start of the INDEX_CHUNK header
+        // This is necessary because of how ChunkIndexHelper() works.
+        File64SetPos(avi->fp, save_pos - sizeof(INDX_CHUNK), SEEK_SET);
+
+        // Process the chunk index
+        max_chunk_size = ChunkIndexHelper(avi, rt, 0, num_entries);
+        if (max_chunk_size >= 0)
+            break;
+
+        FreeRootIndex(rt);
+        if (max_chunk_size != -AVIERR_OVERFLOW || Wide)
+            return(avi->AVIerr);
+    }
 
-    // Save index array and metadata to appropriate stream
+    // Save metadata to appropriate stream
+    avi->AVIerr = AVIERR_NO_ERROR;
+    rt->index_entries = num_entries;
     if (chunk_type == 'd')  // Video stream
-    {
-        avi->VidRt.Idx = idx_array;
-        avi->VidRt.index_entries = num_entries;
         avi->max_video_frame_size = max_chunk_size;
-    }
     else  // Audio stream ('w')
-    {
-        avi->AudRt.Idx = idx_array;
-        avi->AudRt.index_entries = num_entries;
         avi->max_audio_chunk_size = max_chunk_size;
-    }
 
     // Position file pointer to end of chunk for parser continuation
     File64SetPos(avi->fp, save_pos + list_size - sizeof(INDX_CHUNK), SEEK_SET);
@@ -1135,20 +2493,24 @@ static int ParseChunkIndex(AVI2 *avi, INDX_CHUNK *idxh, DWORD list_size)
 // This is the normal situation and all other indexes of the same
 // stream number hang off this master index.  This functon reads
 // all the super index entries and then processes each lower index.
-// It will allocate all memory for the lower indexes.
+// It will allocate all memory for the lower indexes.  If a chunk
+// turns out to be too big for a MEMINDEXENTRY, the lower indexes are
+// read again with WIDE_INDEX entries.
 // Return 0 if OK, else error code.
 
 static int ParseMasterIndex(AVI2 *avi, INDX_CHUNK *idxh, DWORD list_size)
 {
-    SUPERINDEXENTRY superIdx[MAX_RIFF];
-    DWORD IndexLen[MAX_RIFF];
-    MEMINDEXENTRY *idx_array, *idx_ptr;
+    SUPERINDEXENTRY *superIdx;
+    DWORD *IndexLen;
+    INDEX_SEG *segs;
+    INDEX_ROOT *rt;
+    QWORD FileSize;
     DWORD i, x, num_master_entries, total_entries;
-    DWORD master_size;
-    DWORD max_chunk_size = 0;
+    DWORD master_size, First;
+    DWORD max_chunk_size;
     DWORD save_pos;
     char chunk_type;
-    int result;
+    int result, Wide;
 
     // Save position after master index header
     save_pos = File64GetPos(avi->fp);
@@ -1159,10 +2521,6 @@ static int ParseMasterIndex(AVI2 *avi, INDX_CHUNK *idxh, DWORD list_size)
     if (num_master_entries == 0)
         return(avi->AVIerr = AVIERR_NO_INDEX);
 
-    // Make sure we don't overflow
-    if (num_master_entries > MAX_RIFF)
-        return(avi->AVIerr = AVIERR_OVERFLOW);
-
     // Determine stream type from chunk ID (look at 3rd character)
     chunk_type = ((char *)&idxh->dwChunkId)[2];
 
@@ -1172,52 +2530,122 @@ static int ParseMasterIndex(AVI2 *avi, INDX_CHUNK *idxh, DWORD list_size)
         // is to have a preceeding 'auds' or 'vids'
         return(avi->AVIerr = AVIERR_FILE_CORRUPTED);
     }
+    rt = (chunk_type == 'd') ? &avi->VidRt : &avi->AudRt;
 
+    // The caller has checked that the entries fit in the chunk
     master_size = num_master_entries * sizeof(SUPERINDEXENTRY);
-    if (master_size > sizeof(superIdx))
-        return(avi->AVIerr = AVIERR_FILE_CORRUPTED);
+    superIdx = (SUPERINDEXENTRY *) malloc(master_size);
+    IndexLen = (DWORD *) malloc(num_master_entries * sizeof(DWORD));
+    if (!superIdx || !IndexLen)
+    {
+        result = AVIERR_MALLOC;
+        goto done;
+    }
 
     // Read all master index entries
     if (File64Read(avi->fp, superIdx, master_size) != master_size)
-        return(avi->AVIerr = AVIERR_FILE_CORRUPTED);
+    {
+        result = AVIERR_FILE_CORRUPTED;
+        goto done;
+    }
+
+    // The chunk indexes must be inside the file.  This catches
+    // garbage sizes before they are used to allocate memory.
+    if (File64Stat(avi->fp, &FileSize, NULL, NULL, NULL) != 0)
+        FileSize = (QWORD) -1;   // can't check
 
     // First pass: count total index entries across all chunk indexes
     total_entries = 0;
     for (i = 0; i < num_master_entries; i++)
     {
+        IndexLen[i] = 0;
         if (superIdx[i].qwOffset == 0)  // unused entry (should never happen)
             continue;
 
+        if (superIdx[i].dwSize < sizeof(INDX_CHUNK) + 8 ||
+            superIdx[i].qwOffset > FileSize ||
+            superIdx[i].dwSize > FileSize - superIdx[i].qwOffset)
+        {
+            result = AVIERR_FILE_CORRUPTED;
+            goto done;
+        }
+
         // subtract out the IDX_CHUNK header from the total chunk size
         // and also the 'id##' header and size.
         x = superIdx[i].dwSize - sizeof(INDX_CHUNK) - 8;
         IndexLen[i] = x / sizeof(STDINDEXENTRY);   // #entries
-        if (IndexLen[i] > 1000000)
-            return(avi->AVIerr = AVIERR_FILE_CORRUPTED);
+        if (IndexLen[i] > DWORD_MAX - total_entries)
+        {
+            result = AVIERR_OVERFLOW;
+            goto done;
+        }
         total_entries += IndexLen[i];
     }
 
 
     // must have at least one index entry
     if (total_entries == 0)
-        return(avi->AVIerr = AVIERR_NO_INDEX);
+    {
+        result = AVIERR_NO_INDEX;
+        goto done;
+    }
 
-    // Make sure we don't overflow our 32 bit integer in malloc
-    if (total_entries > (DWORD_MAX / sizeof(MEMINDEXENTRY)))
-        return(avi->AVIerr = AVIERR_OVERFLOW);
+    // Lazy indexes are not read yet, so the max size from the stream
+    // header decides if they are wide.  If it is wrong, a segment
+    // with a chunk that is too big gets wide entries of its own.
+    Wide = NeedWideIndex(avi, (avi->OpenFlags & LAZY_INDEX) ?
+                (chunk_type == 'd' ? avi->max_video_frame_size :
+                                     avi->max_audio_chunk_size) : 0);
 
+read_again:
     // Now we allocate a buffer big enough for all index entries
     // for this stream.
-    idx_array = (MEMINDEXENTRY *)
-        malloc(total_entries * sizeof(MEMINDEXENTRY));
-
     // This may be a design flaw, but in order to seek properly, we
     // need the entire index for the entire file in memory.
-    if (!idx_array)
-        return(avi->AVIerr = AVIERR_MALLOC);
+    result = AllocRootIndex(rt, total_entries, Wide);
+    if (result)
+        goto done;
+
+    if (avi->OpenFlags & LAZY_INDEX)
+    {
+        // Just remember where each chunk index is.  They get
+        // read by LoadIndexSegment() when they are needed.
+        // The max sizes are left as set from the stream header.
+        segs = (INDEX_SEG *) malloc(num_master_entries * sizeof(INDEX_SEG));
+        if (!segs)
+        {
+            FreeRootIndex(rt);
+            result = AVIERR_MALLOC;
+            goto done;
+        }
+
+        x = 0;   // number of segments
+        total_entries = 0;
+        for (i = 0; i < num_master_entries; i++)
+        {
+            if (superIdx[i].qwOffset == 0)  // unused entry (should never happen)
+                continue;
+
+            segs[x].qwOffset = superIdx[i].qwOffset;
+            segs[x].First = total_entries;
+            segs[x].Count = IndexLen[i];
+            segs[x].Loaded = FALSE;
+            segs[x].WIdx = NULL;
+            total_entries += IndexLen[i];
+            x++;
+        }
+
+        rt->index_entries = total_entries;
+        rt->Seg = segs;
+        rt->NumSegs = x;
+
+        File64SetPos(avi->fp, save_pos + list_size - sizeof(INDX_CHUNK), SEEK_SET);
+        goto done;
+    }
 
     // Second pass: read and process each chunk index
-    idx_ptr = idx_array;  // start at begining
+    First = 0;  // start at begining
+    max_chunk_size = 0;
 
     for (i = 0; i < num_master_entries; i++)
     {
@@ -1230,112 +2658,737 @@ static int ParseMasterIndex(AVI2 *avi, INDX_CHUNK *idxh, DWORD list_size)
 
         // Process this chunk index into our array
         // returns max chunk size or negative error code.
-        result = ChunkIndexHelper(avi, idx_ptr, IndexLen[i]);
+        result = ChunkIndexHelper(avi, rt, First, IndexLen[i]);
         if (result < 0)
         {
-            free(idx_array);  // Didn't work, free our index
-            return(-result);  // invert error code
+            FreeRootIndex(rt);  // Didn't work, free our index
+
+            // Start over with wide entries if a chunk was too big
+            if (result == -AVIERR_OVERFLOW && !Wide)
+            {
+                avi->AVIerr = AVIERR_NO_ERROR;
+                Wide = TRUE;
+                goto read_again;
+            }
+            result = -result;  // invert error code
+            goto done;
         }
 
         // update max chunk size
         if ((DWORD) result > max_chunk_size) max_chunk_size = result;
 
-        idx_ptr += IndexLen[i];
+        First += IndexLen[i];
     }
+    result = 0;
 
-    // Save index array and metadata to appropriate stream
+    // Save metadata to appropriate stream
+    rt->index_entries = total_entries;
     if (chunk_type == 'd')  // Video stream
-    {
-        avi->VidRt.Idx = idx_array;
-        avi->VidRt.index_entries = total_entries;
         avi->max_video_frame_size = max_chunk_size;
-    }
     else  // Audio stream ('w')
-    {
-        avi->AudRt.Idx = idx_array;
-        avi->AudRt.index_entries = total_entries;
         avi->max_audio_chunk_size = max_chunk_size;
-    }
 
     // Position file pointer to end of master index chunk for parser continuation
     File64SetPos(avi->fp, save_pos + list_size - sizeof(INDX_CHUNK), SEEK_SET);
 
-    return 0;
+done:
+    if (superIdx) free(superIdx);
+    if (IndexLen) free(IndexLen);
+    if (result)
+        avi->AVIerr = result;
+
+    return(result);
+}
+
+
+// Read the chunk index of a LAZY_INDEX segment into the index
+// entries of rt that belong to it.  If rt is not wide and a chunk
+// is too big for a MEMINDEXENTRY, the segment is read again into
+// wide entries of its own in seg->WIdx.
+// Returns the max chunk size, or negative error code.
+
+static int ReadIndexSegment(AVI2 *avi, INDEX_ROOT *rt, INDEX_SEG *seg)
+{
+    INDEX_ROOT WideRt;
+    INDX_CHUNK idxh;
+    DWORD len;
+    int result;
+
+    if (File64PRead(avi->fp, &idxh, sizeof(INDX_CHUNK), seg->qwOffset + 8)
+            != sizeof(INDX_CHUNK) ||
+        idxh.bIndexType != AVI_INDEX_OF_CHUNKS ||
+        idxh.nEntriesInUse != seg->Count)
+        return(-AVIERR_FILE_CORRUPTED);
+
+    len = seg->Count * sizeof(STDINDEXENTRY);
+    if (File64PRead(avi->fp, ChunkIndexBuf(rt, seg->First, seg->Count), len,
+            seg->qwOffset + 8 + sizeof(INDX_CHUNK)) != len)
+        return(-AVIERR_FILE_CORRUPTED);
+
+    result = FixChunkIndex(avi, &idxh, rt, seg->First);
+    if (result != -AVIERR_OVERFLOW || rt->WIdx)
+        return(result);
+
+    // Start this segment over with wide entries
+    memset(&WideRt, 0, sizeof(INDEX_ROOT));
+    result = AllocRootIndex(&WideRt, seg->Count, TRUE);
+    if (result)
+        return(-result);
+
+    if (File64PRead(avi->fp, ChunkIndexBuf(&WideRt, 0, seg->Count), len,
+            seg->qwOffset + 8 + sizeof(INDX_CHUNK)) != len)
+        result = -AVIERR_FILE_CORRUPTED;
+    else
+        result = FixChunkIndex(avi, &idxh, &WideRt, 0);
+
+    if (result < 0)
+        free(WideRt.WIdx);
+    else
+        seg->WIdx = WideRt.WIdx;
+
+    return(result);
+}
+
+
+// Make sure that the LAZY_INDEX segment holding index entry n has
+// been read and set *pSeg to it.  The segment is found with a binary
+// search of the first entry numbers.  The chunk index is read with
+// positional reads so it is safe to call from several threads, and
+// the loading is done under the shared lock so clones and threads
+// only load each segment once.  The Loaded flag is set last with
+// FlagSet(), so a thread that sees it with FlagGet() can use the
+// entries without the lock.  The largest chunk sizes are kept with
+// the shared indexes, and every handle picks them up here.
+// Returns 0 if OK, else error code.  AVIerr is not changed.
+
+static int LoadIndexSegment(AVI2 *avi, INDEX_ROOT *rt, DWORD n, INDEX_SEG **pSeg)
+{
+    INDEX_SEG *seg;
+    DWORD lo, hi, mid;
+    int result, ret = 0;
+
+    // Find the last segment that starts at or before entry n
+    lo = 0;
+    hi = rt->NumSegs;
+    while (hi - lo > 1)
+    {
+        mid = (lo + hi) / 2;
+        if (rt->Seg[mid].First <= n)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    seg = &rt->Seg[lo];
+    *pSeg = seg;
+
+    if (FlagGet(&seg->Loaded))   // the usual case
+    {
+        SyncMaxSizes(avi);
+        return 0;
+    }
+
+    if (avi->Share) MutexLock(avi->Share->Lock);
+
+    if (!seg->Loaded)  // someone else may have just loaded it
+    {
+        result = ReadIndexSegment(avi, rt, seg);
+        if (result < 0)
+            ret = -result;
+        else
+        {
+            // The stream header size might have been wrong
+            if (!avi->Share)
+            {
+                if (rt == &avi->VidRt && (DWORD) result > avi->max_video_frame_size)
+                    avi->max_video_frame_size = result;
+                if (rt == &avi->AudRt && (DWORD) result > avi->max_audio_chunk_size)
+                    avi->max_audio_chunk_size = result;
+            }
+            else if (rt == &avi->VidRt && (DWORD) result > avi->Share->MaxVideo)
+            {
+                avi->Share->MaxVideo = result;
+                FlagSet(&avi->Share->MaxGen, avi->Share->MaxGen + 1);
+            }
+            else if (rt == &avi->AudRt && (DWORD) result > avi->Share->MaxAudio)
+            {
+                avi->Share->MaxAudio = result;
+                FlagSet(&avi->Share->MaxGen, avi->Share->MaxGen + 1);
+            }
+
+            FlagSet(&seg->Loaded, TRUE);
+        }
+    }
+
+    if (avi->Share) MutexUnlock(avi->Share->Lock);
+
+    SyncMaxSizes(avi);
+    return(ret);
+}
+
+
+// Raise the max_video_frame_size and max_audio_chunk_size of a handle
+// to the largest chunk sizes that any handle sharing its indexes has
+// found in the LAZY_INDEX segments.  The lock is only taken when they
+// have changed since the last time.
+
+static void SyncMaxSizes(AVI2 *avi)
+{
+    AVI_SHARE *share = avi->Share;
+
+    if (!share || FlagGet(&share->MaxGen) == FlagGet(&avi->MaxGen))
+        return;
+
+    MutexLock(share->Lock);
+    if (share->MaxVideo > avi->max_video_frame_size)
+        avi->max_video_frame_size = share->MaxVideo;
+    if (share->MaxAudio > avi->max_audio_chunk_size)
+        avi->max_audio_chunk_size = share->MaxAudio;
+    FlagSet(&avi->MaxGen, share->MaxGen);
+    MutexUnlock(share->Lock);
+}
+
+
+// Free the LAZY_INDEX segments of an index root.
+
+void FreeIndexSegs(INDEX_ROOT *rt)
+{
+    DWORD i;
+
+    if (!rt->Seg)
+        return;
+
+    for (i = 0; i < rt->NumSegs; i++)
+        if (rt->Seg[i].WIdx) free(rt->Seg[i].WIdx);
+
+    free(rt->Seg);
+    rt->Seg = NULL;
+    rt->NumSegs = 0;
 }
 
 
-// The caller has requested that a temporary index
-// be made if there is none in the AVI file.  Also,
-// if the file has an index, but it is malformed,
-// this will attempt to build a new one.  Note that
-// this only works on legacy files because odml files
-// are required to have an index.
+// Load the indexes from the INDEX_CACHE sidecar file, which is the
+// AVI file name with ".a2idx" added.  The sidecar is memory mapped
+// and the indexes are used right where they are in the mapping.  If
+// it can't be mapped, the indexes are read into memory instead.
+// The sidecar is only used if it was made from this exact file.
+// Returns 0 if the indexes were loaded, else non-zero and nothing is
+// changed.  AVIerr is not changed.
 
-static int GenerateIndex(AVI2 *avi)
+int LoadIndexCache(AVI2 *avi, const char *filename)
 {
-    FOURCC fcc;
-    DWORD  size, filePos, endPos, len;
-    DWORD  ChunkSize;
-    int    stream, ret;
+    AVI_CACHE_HDR hdr;
+    MFILE *cfp;
+    QWORD FileSize, FileTime, FileCTime, FileId, CacheSize;
+    QWORD ofs;
+    DWORD VidLen, AudLen;
+    BYTE *map, *VidIdx = NULL, *AudIdx = NULL;
+    char *name;
+    int ret;
 
-    if (avi->movi_start < 50)  // invalid
+    if (File64Stat(avi->fp, &FileSize, &FileTime, &FileCTime, &FileId) != 0)
+        return(-1);
+
+    name = (char *) malloc(strlen(filename) + 7);
+    if (!name)
+        return(-1);
+    sprintf(name, "%s.a2idx", filename);
+    cfp = File64Open(name, "rb");
+    free(name);
+    if (!cfp)
+        return(-1);   // no cache yet
+
+    // Check that this cache belongs to this version of the file
+    if (File64Stat(cfp, &CacheSize, NULL, NULL, NULL) != 0 ||
+        File64PRead(cfp, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.Magic != AVI_CACHE_MAGIC || hdr.Version != AVI_CACHE_VERSION ||
+        hdr.FileSize != FileSize || hdr.FileTime != FileTime ||
+        hdr.FileCTime != FileCTime || hdr.FileId != FileId ||
+        hdr.NumBases == 0 || hdr.NumBases > CacheSize / sizeof(QWORD) ||
+        hdr.VidEntries == 0 || (hdr.EntrySize != sizeof(MEMINDEXENTRY) &&
+                                hdr.EntrySize != sizeof(WIDEINDEXENTRY)))
     {
-corrupted:
-        return(avi->AVIerr = AVIERR_FILE_CORRUPTED);
+bad_cache:
+        File64Close(cfp);
+        avi->NumBases = 0;
+        return(-1);
+    }
+
+    VidLen = hdr.VidEntries * hdr.EntrySize;
+    AudLen = hdr.AudEntries * hdr.EntrySize;
+    ofs = sizeof(hdr) + hdr.NumBases * sizeof(QWORD);
+    if (hdr.VidEntries > DWORD_MAX / hdr.EntrySize ||
+        hdr.AudEntries > DWORD_MAX / hdr.EntrySize ||
+        CacheSize != ofs + VidLen + AudLen)
+        goto bad_cache;
+
+    // Make room in the BaseTable[] and read it in
+    avi->NumBases = 0;
+    while (avi->BaseAlloc < hdr.NumBases)
+    {
+        ret = AddBaseTable(avi, 0);
+        if (ret) goto bad_cache;
     }
+    if (File64PRead(cfp, avi->BaseTable, hdr.NumBases * sizeof(QWORD),
+                    sizeof(hdr)) != hdr.NumBases * sizeof(QWORD))
+        goto bad_cache;
 
-    // movi_start points to the first movi record.
-    // we need to go back and get the movi list size.
-    File64SetPos(avi->fp, avi->movi_start - 8, SEEK_SET);
-    File64Read(avi->fp, &size, 4);
-    endPos = avi->movi_start + size - 4;   // Take off 4 for 'movi'
-    File64Read(avi->fp, &size, 4);  // jump over 'movi' to get back to first chunk
+    if (File64Map(cfp) == 0)
+    {
+        // Point the indexes right into the mapping
+        map = File64MapPtr(cfp, 0, 0);
+        if (!map) goto bad_cache;
 
-    // Set correct base table entry
-    avi->BaseTable[0] = 0;
-    avi->NumBases = 1;
-    avi->max_audio_chunk_size = avi->max_video_frame_size = 0;
-    avi->VidRt.index_entries = avi->AudRt.index_entries = 0;
+        VidIdx = map + ofs;
+        AudIdx = hdr.AudEntries ? map + ofs + VidLen : NULL;
+        avi->IdxCache = cfp;
+    }
+    else
+    {
+        // Can't map, so read them in
+        VidIdx = (BYTE *) malloc(VidLen);
+        AudIdx = AudLen ? (BYTE *) malloc(AudLen) : NULL;
+        if (!VidIdx || (AudLen && !AudIdx) ||
+            File64PRead(cfp, VidIdx, VidLen, ofs) != VidLen ||
+            File64PRead(cfp, AudIdx, AudLen, ofs + VidLen) != AudLen)
+        {
+            if (VidIdx) free(VidIdx);
+            if (AudIdx) free(AudIdx);
+            goto bad_cache;
+        }
+        File64Close(cfp);
+    }
+
+    if (hdr.EntrySize == sizeof(WIDEINDEXENTRY))
+    {
+        avi->VidRt.WIdx = (WIDEINDEXENTRY *) VidIdx;
+        avi->AudRt.WIdx = (WIDEINDEXENTRY *) AudIdx;
+    }
+    else
+    {
+        avi->VidRt.Idx = (MEMINDEXENTRY *) VidIdx;
+        avi->AudRt.Idx = (MEMINDEXENTRY *) AudIdx;
+    }
+
+    avi->NumBases = hdr.NumBases;
+    avi->VidRt.index_entries = hdr.VidEntries;
+    avi->AudRt.index_entries = hdr.AudEntries;
+    avi->max_video_frame_size = hdr.MaxVideo;
+    avi->max_audio_chunk_size = hdr.MaxAudio;
+
+    return(0);
+}
+
+
+// Save the indexes to the INDEX_CACHE sidecar file.  The file is
+// written under a temporary name and then renamed, so another
+// process that has the old sidecar open never sees a partial file.
+// Indexes that are not all loaded (LAZY_INDEX) are not saved.
+// Returns 0 if saved, else non-zero.  AVIerr is not changed.
+
+int SaveIndexCache(AVI2 *avi, const char *filename)
+{
+    AVI_CACHE_HDR hdr;
+    MFILE *cfp;
+    DWORD len;
+    char *name, *tmpname;
+    void *VidIdx, *AudIdx;
+    int ok;
+
+    if (avi->VidRt.Seg || avi->AudRt.Seg || (!avi->VidRt.Idx && !avi->VidRt.WIdx))
+        return(-1);   // index not completely in memory
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    // Both streams must use the same kind of entries
+    if (avi->VidRt.WIdx || avi->AudRt.WIdx)
+    {
+        if ((avi->VidRt.Idx && WidenIndex(avi, &avi->VidRt) != 0) ||
+            (avi->AudRt.Idx && WidenIndex(avi, &avi->AudRt) != 0))
+            return(-1);
+        hdr.EntrySize = sizeof(WIDEINDEXENTRY);
+        VidIdx = avi->VidRt.WIdx;
+        AudIdx = avi->AudRt.WIdx;
+    }
+    else
+    {
+        hdr.EntrySize = sizeof(MEMINDEXENTRY);
+        VidIdx = avi->VidRt.Idx;
+        AudIdx = avi->AudRt.Idx;
+    }
+
+    if (File64Stat(avi->fp, &hdr.FileSize, &hdr.FileTime,
+                   &hdr.FileCTime, &hdr.FileId) != 0)
+        return(-1);
+
+    hdr.Magic = AVI_CACHE_MAGIC;
+    hdr.Version = AVI_CACHE_VERSION;
+    hdr.NumBases = avi->NumBases;
+    hdr.VidEntries = avi->VidRt.index_entries;
+    hdr.AudEntries = AudIdx ? avi->AudRt.index_entries : 0;
+    hdr.MaxVideo = avi->max_video_frame_size;
+    hdr.MaxAudio = avi->max_audio_chunk_size;
+
+    name = (char *) malloc(2 * strlen(filename) + 20);
+    if (!name)
+        return(-1);
+    tmpname = name + strlen(filename) + 7;
+    sprintf(name, "%s.a2idx", filename);
+    sprintf(tmpname, "%s.a2idx.tmp", filename);
+
+    cfp = File64Open(tmpname, "wb");
+    if (!cfp)
+    {
+        free(name);
+        return(-1);   // probably a read only directory
+    }
+
+    ok = (File64Write(cfp, &hdr, sizeof(hdr)) == sizeof(hdr));
+
+    len = hdr.NumBases * sizeof(QWORD);
+    if (ok) ok = (File64Write(cfp, avi->BaseTable, len) == len);
+
+    len = hdr.VidEntries * hdr.EntrySize;
+    if (ok) ok = (File64Write(cfp, VidIdx, len) == len);
+
+    len = hdr.AudEntries * hdr.EntrySize;
+    if (ok && len) ok = (File64Write(cfp, AudIdx, len) == len);
+
+    if (File64Close(cfp) != 0)
+        ok = FALSE;
+
+    if (ok && rename(tmpname, name) != 0)
+    {
+        // Windows won't rename over an existing file
+        remove(name);
+        ok = (rename(tmpname, name) == 0);
+    }
+    if (!ok)
+        remove(tmpname);
+
+    free(name);
+
+    return(ok ? 0 : -1);
+}
+
+
+// Scan the movi list of one RIFF segment and index the audio and
+// video chunks in it.  Only positional reads are used, so different
+// threads can scan different segments of the same file.  The movi
+// list is read in big blocks of SCAN_BLOCK_SIZE into Buf and the
+// chunk headers are picked out of the buffer.  A new block is only
+// read when the next header is not in the buffer.  If the scan runs
+// into damage, sc->Err is set and the chunks found before it are
+// kept.
+
+static void ScanSegment(AVI2 *avi, SEG_SCAN *sc, BYTE *Buf)
+{
+    QWORD Base = avi->BaseTable[sc->Seg];
+    QWORD SegEnd, pos, end, BufStart = 0;
+    QWORD FileSize;
+    DWORD BufLen = 0, ChunkSize, hdr[3];
+    FOURCC fcc;
+    BYTE *p;
+    int stream, ret = 0;
+
+    // The segment ends where the next one starts, or at the end
+    // of the file.  This is used instead of the RIFF size because
+    // the size is wrong if the file was never closed.
+    if (sc->Seg + 1 < avi->NumBases)
+        SegEnd = avi->BaseTable[sc->Seg + 1];
+    else if (File64Stat(avi->fp, &FileSize, NULL, NULL, NULL) == 0)
+        SegEnd = FileSize;
+    else
+        SegEnd = Base + AVI_MAX_RIFF_SIZE;
+
+    // Offsets from the RIFF base must fit in the index
+    if (SegEnd > Base + AVI_MAX_RIFF_SIZE)
+        SegEnd = Base + AVI_MAX_RIFF_SIZE;
+
+    // Find the movi list.  For the first segment it is already known.
+    if (sc->Seg == 0)
+        pos = Base + avi->movi_start - 12;   // back up to 'LIST'
+    else
+        pos = Base + 12;   // skip 'RIFF' <size> 'AVIX'
+
+    while (1)
+    {
+        if (pos + 12 > SegEnd ||
+            File64PRead(avi->fp, hdr, 12, pos) != 12)
+        {
+            sc->Err = AVIERR_FILE_CORRUPTED;  // no movi list
+            return;
+        }
+
+        if (FIX_LIT(hdr[0]) == 'LIST' && FIX_LIT(hdr[2]) == 'movi')
+            break;
+
+        pos += 8 + (QWORD) hdr[1];
+        if (NEED_PAD_EVEN(hdr[1])) pos++;
+    }
+
+    end = pos + 8 + (QWORD) hdr[1];
+    if (hdr[1] < 4 || end > SegEnd)   // list size is not right
+        end = SegEnd;
 
     // Search every record in movi list
-    while ((filePos = File64GetPos(avi->fp)) < endPos)
+    pos += 12;
+    while (pos + 8 <= end)
     {
-        fcc = ReadFCC(avi->fp, &stream);
-        len = File64Read(avi->fp, &ChunkSize, 4);
-        if (fcc == (DWORD) -1 || len != 4)
-            goto corrupted;
+        // Get another block if the header is not all in the buffer
+        if (pos < BufStart || pos + 8 > BufStart + BufLen)
+        {
+            BufStart = pos;
+            BufLen = File64PRead(avi->fp, Buf, SCAN_BLOCK_SIZE, BufStart);
+            if (BufLen < 8)
+            {
+                ret = AVIERR_FILE_CORRUPTED;
+                break;
+            }
+        }
+
+        p = Buf + (DWORD)(pos - BufStart);
+        memcpy(&ChunkSize, p + 4, 4);   // chunks are only WORD aligned
+
+        fcc = ParseFCC(p, &stream);
+        if (fcc == (FOURCC) -1)   // no stream number
+        {
+            fcc = ParseFCC(p, NULL);
+            if (fcc == 'LIST')    // like 'rec ' - look inside it
+            {
+                pos += 12;
+                continue;
+            }
+
+            // Others, like 'JUNK', are skipped, but if it isn't a
+            // FourCC at all, then we are lost.
+            if (!IS_FCC_CHAR(p[0]) || !IS_FCC_CHAR(p[1]) ||
+                !IS_FCC_CHAR(p[2]) || !IS_FCC_CHAR(p[3]))
+            {
+                ret = AVIERR_FILE_CORRUPTED;
+                break;
+            }
+        }
+
+        // A chunk that runs off the end was cut off
+        if (pos + 8 + (QWORD) ChunkSize > end)
+        {
+            ret = AVIERR_FILE_CORRUPTED;
+            break;
+        }
 
-        ret = 0;
         if (fcc == '##db' || fcc == '##dc') // video
         {
             // We assume this is a keyframe.  We don't really know.
             // This might cause a problem later.
-            ret = AddIndexEntry(avi, &avi->VidRt, ChunkSize, TRUE);
-            if (ChunkSize > avi->max_video_frame_size)
-                avi->max_video_frame_size = ChunkSize;
-//            avi->VidRt.index_entries++;
+            ret = AddIndexEntryAt(avi, &sc->VidRt, sc->Seg, (DWORD)(pos + 8 - Base),
+                                  ChunkSize, TRUE);
+            if (ChunkSize > sc->MaxVideo)
+                sc->MaxVideo = ChunkSize;
         }
         else if (fcc == '##wb')   // audio
         {
-            ret = AddIndexEntry(avi, &avi->AudRt, ChunkSize, TRUE);
-            if (ChunkSize > avi->max_audio_chunk_size)
-                avi->max_audio_chunk_size = ChunkSize;
-//            avi->VidRt.index_entries++;
-        }
-        else if (fcc == 'ix##')    // odml index
-        {
-            break;   // no movi records after odml index starts
+            ret = AddIndexEntryAt(avi, &sc->AudRt, sc->Seg, (DWORD)(pos + 8 - Base),
+                                  ChunkSize, TRUE);
+            if (ChunkSize > sc->MaxAudio)
+                sc->MaxAudio = ChunkSize;
         }
-        // else ignore
+        // else ignore, including 'ix##' odml indexes
 
         if (ret)
-            return(ret);
+            break;
 
         // jump to next movi entry
-        if (NEED_PAD_EVEN(ChunkSize)) ChunkSize++;
-        File64SetPos(avi->fp, filePos + 8 + ChunkSize, SEEK_SET);
+        pos += 8 + (QWORD) ChunkSize;
+        if (NEED_PAD_EVEN(ChunkSize)) pos++;
     }
 
+    sc->Err = ret;
+}
+
+
+// GenerateIndex() thread.  Keep scanning the next segment that
+// nobody has taken until they are all done.
+
+static void ScanWorker(void *arg)
+{
+    SCAN_JOB *job = (SCAN_JOB *) arg;
+    BYTE *Buf;
+    DWORD i;
+
+    Buf = (BYTE *) malloc(SCAN_BLOCK_SIZE);
+
+    while (1)
+    {
+        MutexLock(job->Lock);
+        i = job->Next++;
+        MutexUnlock(job->Lock);
+
+        if (i >= job->Count)
+            break;
+
+        if (Buf)
+            ScanSegment(job->avi, &job->Scan[i], Buf);
+        else
+            job->Scan[i].Err = AVIERR_MALLOC;
+    }
+
+    if (Buf) free(Buf);
+}
+
+
+// The caller has requested that a temporary index
+// be made if there is none in the AVI file.  Also,
+// if the file has an index, but it is malformed,
+// this will attempt to build a new one.
+//
+// Every RIFF segment that WalkRiff() found is scanned, so this
+// also works on ODML files with missing or damaged indexes.  The
+// segments are scanned at the same time by up to MAX_SCAN_THREADS
+// threads and the results are joined together in file order.  If
+// a segment is damaged, such as the last one in a file that was
+// never closed, the chunks before the damage are still indexed.
+// Only failing to find any video at all is an error.
+
+static int GenerateIndex(AVI2 *avi)
+{
+    SCAN_JOB job;
+    SEG_SCAN *sc;
+    void *thread[MAX_SCAN_THREADS];
+    BYTE *VidIdx = NULL, *AudIdx = NULL;
+    DWORD i, nThreads, VidTotal = 0, AudTotal = 0, EntrySize;
+    int ret = 0, Wide = FALSE;
+
+    if (avi->movi_start < 50)  // invalid
+        return(avi->AVIerr = AVIERR_FILE_CORRUPTED);
+
+    // Throw away what is left of any old index
+    FreeRootIndex(&avi->VidRt);
+    FreeRootIndex(&avi->AudRt);
+    FreeIndexSegs(&avi->VidRt);
+    FreeIndexSegs(&avi->AudRt);
+    memset(&avi->VidRt, 0, sizeof(INDEX_ROOT));
+    memset(&avi->AudRt, 0, sizeof(INDEX_ROOT));
+    avi->max_audio_chunk_size = avi->max_video_frame_size = 0;
+
+    job.avi = avi;
+    job.Count = avi->NumBases;
+    job.Next = 0;
+    job.Scan = (SEG_SCAN *) calloc(job.Count, sizeof(SEG_SCAN));
+    job.Lock = MutexCreate();
+    if (!job.Scan || !job.Lock)
+    {
+        if (job.Scan) free(job.Scan);
+        MutexDestroy(job.Lock);
+        return(avi->AVIerr = AVIERR_MALLOC);
+    }
+
+    for (i = 0; i < job.Count; i++)
+        job.Scan[i].Seg = i;
+
+    // Use at least two threads so one can read while the other
+    // works, even with one CPU.  This thread does its share too,
+    // so if no threads can be started, it all still gets done.
+    nThreads = CpuCount();
+    if (nThreads < 2) nThreads = 2;
+    if (nThreads > MAX_SCAN_THREADS) nThreads = MAX_SCAN_THREADS;
+    if (nThreads > job.Count) nThreads = job.Count;
+
+    for (i = 1; i < nThreads; i++)
+        thread[i] = ThreadCreate(ScanWorker, &job);
+    ScanWorker(&job);
+    for (i = 1; i < nThreads; i++)
+        ThreadJoin(thread[i]);
+
+    MutexDestroy(job.Lock);
+
+    // Add up the segments
+    for (i = 0; i < job.Count; i++)
+    {
+        sc = &job.Scan[i];
+        if (sc->Err && sc->Err != AVIERR_FILE_CORRUPTED)
+            ret = sc->Err;   // out of memory is not just damage
+
+        // If any segment needed wide entries, they all get them
+        if (sc->VidRt.WIdx || sc->AudRt.WIdx)
+            Wide = TRUE;
+
+        if (sc->VidRt.index_entries > DWORD_MAX / sizeof(WIDEINDEXENTRY) - VidTotal ||
+            sc->AudRt.index_entries > DWORD_MAX / sizeof(WIDEINDEXENTRY) - AudTotal)
+            ret = AVIERR_OVERFLOW;
+        else
+        {
+            VidTotal += sc->VidRt.index_entries;
+            AudTotal += sc->AudRt.index_entries;
+        }
+
+        if (sc->MaxVideo > avi->max_video_frame_size)
+            avi->max_video_frame_size = sc->MaxVideo;
+        if (sc->MaxAudio > avi->max_audio_chunk_size)
+            avi->max_audio_chunk_size = sc->MaxAudio;
+    }
+
+    if (!ret && VidTotal == 0)
+        ret = job.Scan[0].Err ? job.Scan[0].Err : AVIERR_NO_INDEX;
+
+    EntrySize = Wide ? sizeof(WIDEINDEXENTRY) : sizeof(MEMINDEXENTRY);
+    if (!ret)
+    {
+        VidIdx = (BYTE *) malloc(VidTotal * EntrySize);
+        if (AudTotal)
+            AudIdx = (BYTE *) malloc(AudTotal * EntrySize);
+        if (!VidIdx || (AudTotal && !AudIdx))
+            ret = AVIERR_MALLOC;
+    }
+
+    // Join the segments together in file order
+    VidTotal = AudTotal = 0;
+    for (i = 0; i < job.Count; i++)
+    {
+        sc = &job.Scan[i];
+        if (!ret && Wide)
+        {
+            if (WidenIndex(avi, &sc->VidRt) || WidenIndex(avi, &sc->AudRt))
+                ret = AVIERR_MALLOC;
+        }
+        if (!ret)
+        {
+            if (sc->VidRt.index_entries)
+                memcpy(VidIdx + VidTotal * EntrySize,
+                       Wide ? (void *) sc->VidRt.WIdx : (void *) sc->VidRt.Idx,
+                       sc->VidRt.index_entries * EntrySize);
+            if (sc->AudRt.index_entries)
+                memcpy(AudIdx + AudTotal * EntrySize,
+                       Wide ? (void *) sc->AudRt.WIdx : (void *) sc->AudRt.Idx,
+                       sc->AudRt.index_entries * EntrySize);
+            VidTotal += sc->VidRt.index_entries;
+            AudTotal += sc->AudRt.index_entries;
+        }
+        FreeRootIndex(&sc->VidRt);
+        FreeRootIndex(&sc->AudRt);
+    }
+    free(job.Scan);
+
+    if (ret)
+    {
+        if (VidIdx) free(VidIdx);
+        if (AudIdx) free(AudIdx);
+        return(avi->AVIerr = ret);
+    }
+
+    if (Wide)
+    {
+        avi->VidRt.WIdx = (WIDEINDEXENTRY *) VidIdx;
+        avi->AudRt.WIdx = (WIDEINDEXENTRY *) AudIdx;
+    }
+    else
+    {
+        avi->VidRt.Idx = (MEMINDEXENTRY *) VidIdx;
+        avi->AudRt.Idx = (MEMINDEXENTRY *) AudIdx;
+    }
+    avi->VidRt.index_entries = VidTotal;
+    avi->AudRt.index_entries = AudTotal;
+    avi->IndexDamaged = FALSE;
+
     return(AVIERR_NO_ERROR);
 }
 
@@ -1348,6 +3401,7 @@ static int WalkRiff(AVI2 *avi)
     FOURCC fcc;
     DWORD size;
     QWORD qpos;
+    int ret;
 
     File64Qseek(avi->fp, 0);
     avi->NumBases = 0;
@@ -1359,10 +3413,9 @@ static int WalkRiff(AVI2 *avi)
         if (fcc == 'RIFF')
         {
             // add it to table
-            if (avi->NumBases >= MAX_RIFF)   //  check if over limit
-                return(avi->AVIerr = AVIERR_NOT_SUPPORTED);
-
-            avi->BaseTable[avi->NumBases++] = qpos;
+            ret = AddBaseTable(avi, qpos);
+            if (ret)
+                return(avi->AVIerr = ret);
 
             // If we had a RIFF, then we must have a length
             if (File64Read(avi->fp, &size, 4) != 4)
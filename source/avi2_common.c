@@ -23,6 +23,9 @@ used by others.
 
 #include "avi2.h"
 
+static void ReleaseIndexes(AVI2 *avi);
+static void FreeIndexBlocks(IDX_BLOCK *blk);
+
 
 
 // Open an AVI file for reading and parse its structure
@@ -38,13 +41,17 @@ used by others.
 // If opening for reading, OpenMode can be OR'ed with AUTO_INDEX
 // which will cause a temporary index to be generated on the fly
 // if the AVI file didn't actually have one.  If not supplied, and
-// no index is in the file, an error will be generated.
+// no index is in the file, an error will be generated.  Reading
+// can also be OR'ed with the options MEMORY_MAPPED, LAZY_INDEX
+// and INDEX_CACHE.  Writing can be OR'ed with DIRECT_IO.
 
 AVI2 *AVI_Open(const char *filename, DWORD OpenMode, int *err)
 {
     AVI2 *avi;
     MFILE *fp;
     WORD OdmlMode = (WORD)(OpenMode & 0xFF00);
+    DWORD Options = OpenMode & 0xFFFF0000;
+    int Cached;
 
     OpenMode &= 0x00FF;
 
@@ -60,6 +67,16 @@ AVI2 *AVI_Open(const char *filename, DWORD OpenMode, int *err)
             return NULL;
         }
 
+        // Map the file if asked.  If it fails, just use normal reads.
+        if (Options & MEMORY_MAPPED)
+        {
+            if (File64Map(fp) != 0)
+            {
+AVI_DBG("Memory map failed, using file reads");
+                Options &= ~MEMORY_MAPPED;
+            }
+        }
+
         // Allocate and initialize AVI2 structure
         avi = (AVI2 *)malloc(sizeof(AVI2));
         if (!avi)
@@ -73,6 +90,13 @@ AVI2 *AVI_Open(const char *filename, DWORD OpenMode, int *err)
         avi->fp = fp;
         avi->filemode = FOR_READING;
         avi->ODMLmode = OdmlMode;
+        avi->OpenFlags = Options;
+
+        // Try to get the indexes from the sidecar cache file.  If they
+        // are there, parsing only reads the headers.
+        Cached = FALSE;
+        if (Options & INDEX_CACHE)
+            Cached = (LoadIndexCache(avi, filename) == 0);
 
         // Parse the file
         if (ParseAVIFile(avi) != 0)
@@ -81,12 +105,51 @@ AVI2 *AVI_Open(const char *filename, DWORD OpenMode, int *err)
             // Close everything down and free memory
             // Don't alter AVIerr here.  Let error pass through.
             if (err) *err = avi->AVIerr;
-            if (avi->VidRt.Idx)   free(avi->VidRt.Idx);
-            if (avi->AudRt.Idx)   free(avi->AudRt.Idx);
+            ReleaseIndexes(avi);
+            free(avi);
+            File64Close(fp);
+            return NULL;
+        }
+
+        // Save the indexes for next time.  Errors are ignored since
+        // the file is still good without the cache.
+        if ((Options & INDEX_CACHE) && !Cached)
+            SaveIndexCache(avi, filename);
+
+        // Pack the indexes if asked.  Nothing changes if it can't.
+        if (Options & COMPACT_INDEX)
+            CompactIndexes(avi);
+
+        // Set up for sharing the indexes with AVI_Clone()
+        avi->Share = (AVI_SHARE *)malloc(sizeof(AVI_SHARE));
+        if (avi->Share)
+        {
+            avi->Share->RefCount = 1;
+            avi->Share->Lock = MutexCreate();
+            avi->Share->BuildLock = MutexCreate();
+        }
+        if (!avi->Share || !avi->Share->Lock || !avi->Share->BuildLock)
+        {
+            if (err) *err = AVIERR_MALLOC;  // Out of memory
+            if (avi->Share)
+            {
+                MutexDestroy(avi->Share->Lock);
+                MutexDestroy(avi->Share->BuildLock);
+                free(avi->Share);
+            }
+            avi->Share = NULL;
+            ReleaseIndexes(avi);
             free(avi);
             File64Close(fp);
             return NULL;
         }
+        avi->Share->Keys = NULL;
+        avi->Share->NumKeys = 0;
+        avi->Share->KeysReady = FALSE;
+        avi->Share->AudBytes = NULL;
+        avi->Share->AudReady = FALSE;
+        avi->Share->MaxVideo = avi->Share->MaxAudio = 0;
+        avi->Share->MaxGen = 0;
 
         // Everything looks good at this point.
     }
@@ -115,6 +178,20 @@ AVI2 *AVI_Open(const char *filename, DWORD OpenMode, int *err)
         avi->fp = fp;
         avi->filemode = FOR_WRITING;
         avi->ODMLmode = OdmlMode;
+        avi->OpenFlags = Options;
+
+        // Buffer the writes.  Without a buffer it still works.
+        File64SetWriteBuffer(fp, WRITE_BUFFER_SIZE);
+
+        // Bypass the page cache if asked.  If it can't, write normally.
+        if (Options & DIRECT_IO)
+        {
+            if (File64SetDirect(fp) != 0)
+            {
+AVI_DBG("Direct I/O failed, using normal writes");
+                avi->OpenFlags &= ~DIRECT_IO;
+            }
+        }
 
         // Write the first 2K of zeros to reserve for basic headers
         memset(filler, 0, sizeof(filler));
@@ -140,8 +217,7 @@ int AVI_Close(AVI2 *avi)
         // and do final file cleanup.
         if (avi->filemode == FOR_WRITING)
             err = FinalizeWrite(avi);
-        if (avi->AudRt.Idx) free(avi->AudRt.Idx);
-        if (avi->VidRt.Idx) free(avi->VidRt.Idx);
+        ReleaseIndexes(avi);
         err2 = File64Close(avi->fp);
         free(avi);
         if (err == AVIERR_NO_ERROR) err = err2;
@@ -152,6 +228,165 @@ int AVI_Close(AVI2 *avi)
 }
 
 
+// Make another handle to a file that is already open for reading.
+// The clone shares the indexes of the original, so it takes no time
+// to make and uses no memory for indexes.  It has its own file handle
+// and its own current frame counters.  Handles and clones can be
+// used in different threads.  Every handle must be closed with
+// AVI_Close() and the indexes are freed when the last one is closed.
+// Returns NULL on error and avi->AVIerr holds the error code.
+
+AVI2 *AVI_Clone(AVI2 *avi)
+{
+    AVI2 *clone;
+    MFILE *fp;
+
+    if (!avi)
+        return(NULL);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_READING || !avi->Share)
+    {
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;
+        return(NULL);
+    }
+
+    // Open our own file handle
+    fp = File64Dup(avi->fp, FALSE);
+    if (!fp)
+    {
+        avi->AVIerr = AVIERR_FILE_NOT_EXIST;
+        return(NULL);
+    }
+
+    clone = (AVI2 *)malloc(sizeof(AVI2));
+    if (!clone)
+    {
+        File64Close(fp);
+        avi->AVIerr = AVIERR_MALLOC;  // Out of memory
+        return(NULL);
+    }
+
+    // Copy everything.  The index pointers now point to the same memory.
+    memcpy(clone, avi, sizeof(AVI2));
+    clone->fp = fp;
+    clone->current_video_frame = 0;
+    clone->current_audio_frame = 0;
+
+    // The mapping is skipped if it failed for the new handle.
+    if (!File64MapPtr(fp, 0, 0))
+        clone->OpenFlags &= ~MEMORY_MAPPED;
+
+    MutexLock(avi->Share->Lock);
+    avi->Share->RefCount++;
+    MutexUnlock(avi->Share->Lock);
+
+    return(clone);
+}
+
+
+// Free a list of writer index blocks.
+
+static void FreeIndexBlocks(IDX_BLOCK *blk)
+{
+    IDX_BLOCK *next;
+
+    for (; blk; blk = next)
+    {
+        next = blk->Next;
+        free(blk);
+    }
+}
+
+
+// Free the index memory for a handle that is closing.  If the indexes
+// are shared by AVI_Clone() handles, only the last one frees them.
+
+static void ReleaseIndexes(AVI2 *avi)
+{
+    AVI_SHARE *share = avi->Share;
+    int users = 0;
+
+    if (share)
+    {
+        MutexLock(share->Lock);
+        users = --share->RefCount;
+        MutexUnlock(share->Lock);
+
+        if (users > 0)   // still being used
+            return;
+
+        MutexDestroy(share->Lock);
+        MutexDestroy(share->BuildLock);
+        if (share->Keys) free(share->Keys);
+        if (share->AudBytes) free(share->AudBytes);
+        free(share);
+        avi->Share = NULL;
+    }
+
+    if (avi->IdxCache)   // indexes are inside the cache file mapping
+    {
+        File64Close(avi->IdxCache);
+        avi->IdxCache = NULL;
+        avi->AudRt.Idx = avi->VidRt.Idx = NULL;
+        avi->AudRt.WIdx = avi->VidRt.WIdx = NULL;
+    }
+
+    if (avi->AudRt.Idx) free(avi->AudRt.Idx);
+    if (avi->VidRt.Idx) free(avi->VidRt.Idx);
+    if (avi->AudRt.WIdx) free(avi->AudRt.WIdx);
+    if (avi->VidRt.WIdx) free(avi->VidRt.WIdx);
+    FreeIndexSegs(&avi->AudRt);
+    FreeIndexSegs(&avi->VidRt);
+    if (avi->AudRt.CIdx) free(avi->AudRt.CIdx);
+    if (avi->VidRt.CIdx) free(avi->VidRt.CIdx);
+    if (avi->AudRt.CBits) free(avi->AudRt.CBits);
+    if (avi->VidRt.CBits) free(avi->VidRt.CBits);
+    if (avi->BaseTable) free(avi->BaseTable);
+    FreeIndexBlocks(avi->VidRt.Head);   // writer index chains
+    FreeIndexBlocks(avi->AudRt.Head);
+    FreeIndexBlocks(avi->IdxPool);
+    avi->AudRt.Head = avi->VidRt.Head = NULL;
+    avi->AudRt.Tail = avi->VidRt.Tail = NULL;
+    avi->IdxPool = NULL;
+    avi->AudRt.Idx = avi->VidRt.Idx = NULL;
+    avi->AudRt.WIdx = avi->VidRt.WIdx = NULL;
+    avi->AudRt.CIdx = avi->VidRt.CIdx = NULL;
+    avi->AudRt.CBits = avi->VidRt.CBits = NULL;
+    avi->BaseTable = NULL;
+    avi->NumBases = avi->BaseAlloc = 0;
+}
+
+
+// Add the base address of another RIFF segment to the end of the
+// BaseTable[].  The table is grown MAX_RIFF entries at a time.
+// Returns 0 if OK, else error code.  AVIerr is not changed.
+
+int AddBaseTable(AVI2 *avi, QWORD Base)
+{
+    QWORD *NewTable;
+
+    if (avi->NumBases >= avi->BaseAlloc)
+    {
+        if (avi->BaseAlloc > DWORD_MAX / sizeof(QWORD) - MAX_RIFF)
+            return(AVIERR_OVERFLOW);
+
+        NewTable = (QWORD *) realloc(avi->BaseTable,
+                            (avi->BaseAlloc + MAX_RIFF) * sizeof(QWORD));
+        if (!NewTable)
+            return(AVIERR_MALLOC);
+
+        avi->BaseTable = NewTable;
+        avi->BaseAlloc += MAX_RIFF;
+    }
+
+    avi->BaseTable[avi->NumBases++] = Base;
+
+    return(0);
+}
+
+
 // Return AVIerr as a pointer to a static string
 char *AVI_StrError(int errnum)
 {
@@ -179,6 +414,7 @@ char *AVI_StrError(int errnum)
         "avi2 - Function called out of order",
         "svi2 - Overflow",
         "avi2 - File too large",
+        "avi2 - Write queue is full",
         "avi2 - Unknown Error"
     };
 
@@ -204,18 +440,33 @@ char *AVI_StrError(int errnum)
 
 FOURCC ReadFCC(MFILE *in, int *StreamNum)
 {
-    char Buf[15];
-    FOURCC val;
+    BYTE Buf[4];
     int  ret;
 
-    memset(Buf, 0, sizeof(Buf));
     if (!in)return(-1);  // no file to read
     if (StreamNum) *StreamNum = -1;
 
     ret = File64Read(in, Buf, 4);
     if (ret != 4) return(-1);    // EOF
 
-    val = *((FOURCC *)Buf);  // val is LE when CPU is LE
+    return(ParseFCC(Buf, StreamNum));
+}
+
+
+// Same as ReadFCC() except that the four bytes come from memory at
+// src instead of from the file.  Returns -1 if StreamNum is not NULL
+// and no stream number was found.
+
+FOURCC ParseFCC(const BYTE *src, int *StreamNum)
+{
+    char Buf[15];
+    FOURCC val;
+
+    memset(Buf, 0, sizeof(Buf));
+    memcpy(Buf, src, 4);
+    if (StreamNum) *StreamNum = -1;
+
+    memcpy(&val, Buf, 4);  // val is LE when CPU is LE
 
 
     // Note that both '##ix' and 'ix##' can exist
@@ -241,7 +492,7 @@ FOURCC ReadFCC(MFILE *in, int *StreamNum)
         }
 
         if (*StreamNum == -1) return(-1);
-        val = *((FOURCC *)Buf);
+        memcpy(&val, Buf, 4);
     }
 
     val = FIX_LIT(val);      // FOURCC should now be in correct endian order
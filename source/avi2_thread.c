@@ -0,0 +1,392 @@
+/*
+Avi2 - Copyright (c) 2025 by Dennis Hawkins. All rights reserved.
+
+BSD License
+
+Redistribution and use in source and binary forms are permitted provided
+that the above copyright notice and this paragraph are duplicated in all
+such forms and that any documentation, advertising materials, and other
+materials related to such distribution and use acknowledge that the
+software was developed by the copyright holder. The name of the copyright
+holder may not be used to endorse or promote products derived from this
+software without specific prior written permission.  THIS SOFTWARE IS
+PROVIDED `'AS IS? AND WITHOUT ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS FOR A PARTICULAR PURPOSE.
+
+Although not required, attribution is requested for any source code
+used by others.
+*/
+
+// avi2_thread.c
+// Wrappers for the operating system thread functions so the rest of
+// the library does not care which one is in use.  Like file64.c, this
+// file does not include avi2.h because windows.h clashes with some of
+// the structures defined there.  Everything is passed around as an
+// opaque void pointer.
+//
+// Define AVI_NO_THREADS on the compiler command line for compilers
+// that have no thread support.  The mutex and event functions then do
+// nothing and ThreadCreate() just runs the function before it returns.
+
+#include <stdlib.h>
+
+#if defined(AVI_NO_THREADS)
+    // No threading at all
+
+#elif defined(_WIN32) || defined(__WIN32__)
+    #include <windows.h>
+    #define USE_WINDOWS_THREADS
+
+#else
+    // Linux/Unix - use POSIX threads
+    #include <pthread.h>
+    #include <unistd.h>
+
+    // Compilers without the GCC atomic builtins use a mutex for flags
+    #if !defined(__GNUC__) || defined(__TINYC__)
+        static pthread_mutex_t FlagLock = PTHREAD_MUTEX_INITIALIZER;
+    #endif
+#endif
+
+
+// What a thread handle points to
+typedef struct
+{
+    void (*Func)(void *);   // function to run
+    void *Arg;              // argument for Func
+#if defined(USE_WINDOWS_THREADS)
+    HANDLE hThread;
+#elif !defined(AVI_NO_THREADS)
+    pthread_t Thread;
+#endif
+} THREAD_INFO;
+
+
+// What an event handle points to.  Windows has auto reset events, so
+// only POSIX needs this.
+#if !defined(USE_WINDOWS_THREADS) && !defined(AVI_NO_THREADS)
+typedef struct
+{
+    pthread_mutex_t Mutex;
+    pthread_cond_t  Cond;
+    int             Set;    // TRUE if signaled and not yet waited for
+} EVENT_INFO;
+#endif
+
+
+// Exported functions
+void *MutexCreate(void);
+void  MutexLock(void *mutex);
+void  MutexUnlock(void *mutex);
+void  MutexDestroy(void *mutex);
+int   FlagGet(volatile int *flag);
+void  FlagSet(volatile int *flag, int val);
+void *EventCreate(void);
+void  EventSignal(void *event);
+void  EventWait(void *event);
+void  EventDestroy(void *event);
+void *ThreadCreate(void (*Func)(void *), void *Arg);
+void  ThreadJoin(void *thread);
+int   CpuCount(void);
+
+
+
+// Create a mutex.  Returns NULL on failure.
+
+void *MutexCreate(void)
+{
+#if defined(AVI_NO_THREADS)
+    return(malloc(1));    // dummy so that NULL still means failure
+
+#elif defined(USE_WINDOWS_THREADS)
+    CRITICAL_SECTION *cs = malloc(sizeof(CRITICAL_SECTION));
+
+    if (cs) InitializeCriticalSection(cs);
+    return(cs);
+
+#else
+    pthread_mutex_t *mtx = malloc(sizeof(pthread_mutex_t));
+
+    if (mtx && pthread_mutex_init(mtx, NULL) != 0)
+    {
+        free(mtx);
+        mtx = NULL;
+    }
+    return(mtx);
+#endif
+}
+
+
+// Wait for and take ownership of a mutex.
+
+void MutexLock(void *mutex)
+{
+#if defined(USE_WINDOWS_THREADS)
+    EnterCriticalSection((CRITICAL_SECTION *) mutex);
+#elif !defined(AVI_NO_THREADS)
+    pthread_mutex_lock((pthread_mutex_t *) mutex);
+#endif
+}
+
+
+// Release a mutex taken with MutexLock().
+
+void MutexUnlock(void *mutex)
+{
+#if defined(USE_WINDOWS_THREADS)
+    LeaveCriticalSection((CRITICAL_SECTION *) mutex);
+#elif !defined(AVI_NO_THREADS)
+    pthread_mutex_unlock((pthread_mutex_t *) mutex);
+#endif
+}
+
+
+// Free a mutex made by MutexCreate().  NULL is ignored.
+
+void MutexDestroy(void *mutex)
+{
+    if (!mutex) return;
+
+#if defined(USE_WINDOWS_THREADS)
+    DeleteCriticalSection((CRITICAL_SECTION *) mutex);
+#elif !defined(AVI_NO_THREADS)
+    pthread_mutex_destroy((pthread_mutex_t *) mutex);
+#endif
+    free(mutex);
+}
+
+
+// Read a flag that another thread sets with FlagSet().  Anything the
+// other thread wrote before it set the flag can be seen once the flag
+// is seen to be set.  This lets a table be built once under a mutex
+// and then be used without taking the mutex every time.
+
+int FlagGet(volatile int *flag)
+{
+#if defined(AVI_NO_THREADS)
+    return(*flag);
+
+#elif defined(USE_WINDOWS_THREADS)
+    return((int) InterlockedExchangeAdd((LONG *) flag, 0));
+
+#elif defined(__GNUC__) && !defined(__TINYC__)
+    return(__atomic_load_n(flag, __ATOMIC_ACQUIRE));
+
+#else
+    int val;
+
+    pthread_mutex_lock(&FlagLock);
+    val = *flag;
+    pthread_mutex_unlock(&FlagLock);
+    return(val);
+#endif
+}
+
+
+// Set a flag read with FlagGet().  Everything written before this is
+// seen by a thread that sees the new value.
+
+void FlagSet(volatile int *flag, int val)
+{
+#if defined(AVI_NO_THREADS)
+    *flag = val;
+
+#elif defined(USE_WINDOWS_THREADS)
+    InterlockedExchange((LONG *) flag, (LONG) val);
+
+#elif defined(__GNUC__) && !defined(__TINYC__)
+    __atomic_store_n(flag, val, __ATOMIC_RELEASE);
+
+#else
+    pthread_mutex_lock(&FlagLock);
+    *flag = val;
+    pthread_mutex_unlock(&FlagLock);
+#endif
+}
+
+
+// Create an auto reset event.  One EventWait() returns for each
+// EventSignal(), and a signal made while nobody is waiting is kept
+// until the next wait.  Several signals before a wait count as one.
+// Returns NULL on failure.
+
+void *EventCreate(void)
+{
+#if defined(AVI_NO_THREADS)
+    return(malloc(1));    // dummy so that NULL still means failure
+
+#elif defined(USE_WINDOWS_THREADS)
+    return((void *) CreateEvent(NULL, FALSE, FALSE, NULL));
+
+#else
+    EVENT_INFO *ev = malloc(sizeof(EVENT_INFO));
+
+    if (!ev) return(NULL);
+    ev->Set = 0;
+    if (pthread_mutex_init(&ev->Mutex, NULL) != 0)
+    {
+        free(ev);
+        return(NULL);
+    }
+    if (pthread_cond_init(&ev->Cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&ev->Mutex);
+        free(ev);
+        return(NULL);
+    }
+    return(ev);
+#endif
+}
+
+
+// Signal an event made by EventCreate().
+
+void EventSignal(void *event)
+{
+#if defined(USE_WINDOWS_THREADS)
+    SetEvent((HANDLE) event);
+#elif !defined(AVI_NO_THREADS)
+    EVENT_INFO *ev = (EVENT_INFO *) event;
+
+    pthread_mutex_lock(&ev->Mutex);
+    ev->Set = 1;
+    pthread_cond_signal(&ev->Cond);
+    pthread_mutex_unlock(&ev->Mutex);
+#endif
+}
+
+
+// Wait until an event is signaled and reset it.
+
+void EventWait(void *event)
+{
+#if defined(USE_WINDOWS_THREADS)
+    WaitForSingleObject((HANDLE) event, INFINITE);
+#elif !defined(AVI_NO_THREADS)
+    EVENT_INFO *ev = (EVENT_INFO *) event;
+
+    pthread_mutex_lock(&ev->Mutex);
+    while (!ev->Set)
+        pthread_cond_wait(&ev->Cond, &ev->Mutex);
+    ev->Set = 0;
+    pthread_mutex_unlock(&ev->Mutex);
+#endif
+}
+
+
+// Free an event made by EventCreate().  NULL is ignored.
+
+void EventDestroy(void *event)
+{
+    if (!event) return;
+
+#if defined(AVI_NO_THREADS)
+    free(event);
+#elif defined(USE_WINDOWS_THREADS)
+    CloseHandle((HANDLE) event);
+#else
+    pthread_cond_destroy(&((EVENT_INFO *) event)->Cond);
+    pthread_mutex_destroy(&((EVENT_INFO *) event)->Mutex);
+    free(event);
+#endif
+}
+
+
+// Start of every thread.  This calls the real function in the
+// form the operating system wants.
+
+#if defined(USE_WINDOWS_THREADS)
+static DWORD WINAPI ThreadStart(LPVOID arg)
+{
+    THREAD_INFO *ti = (THREAD_INFO *) arg;
+
+    ti->Func(ti->Arg);
+    return(0);
+}
+#elif !defined(AVI_NO_THREADS)
+static void *ThreadStart(void *arg)
+{
+    THREAD_INFO *ti = (THREAD_INFO *) arg;
+
+    ti->Func(ti->Arg);
+    return(NULL);
+}
+#endif
+
+
+// Start a thread running Func(Arg).  Returns a handle that must be
+// given to ThreadJoin(), or NULL if the thread could not be started.
+
+void *ThreadCreate(void (*Func)(void *), void *Arg)
+{
+    THREAD_INFO *ti = malloc(sizeof(THREAD_INFO));
+
+    if (!ti) return(NULL);
+    ti->Func = Func;
+    ti->Arg = Arg;
+
+#if defined(AVI_NO_THREADS)
+    Func(Arg);   // just do it now
+
+#elif defined(USE_WINDOWS_THREADS)
+    ti->hThread = CreateThread(NULL, 0, ThreadStart, ti, 0, NULL);
+    if (!ti->hThread)
+    {
+        free(ti);
+        ti = NULL;
+    }
+
+#else
+    if (pthread_create(&ti->Thread, NULL, ThreadStart, ti) != 0)
+    {
+        free(ti);
+        ti = NULL;
+    }
+#endif
+
+    return(ti);
+}
+
+
+// Wait for a thread from ThreadCreate() to finish and free its
+// handle.  NULL is ignored.
+
+void ThreadJoin(void *thread)
+{
+    THREAD_INFO *ti = (THREAD_INFO *) thread;
+
+    if (!ti) return;
+
+#if defined(USE_WINDOWS_THREADS)
+    WaitForSingleObject(ti->hThread, INFINITE);
+    CloseHandle(ti->hThread);
+#elif !defined(AVI_NO_THREADS)
+    pthread_join(ti->Thread, NULL);
+#endif
+    free(ti);
+}
+
+
+// Return the number of processors, or 1 if it isn't known.
+
+int CpuCount(void)
+{
+#if defined(AVI_NO_THREADS)
+    return(1);
+
+#elif defined(USE_WINDOWS_THREADS)
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    return(si.dwNumberOfProcessors > 0 ? (int) si.dwNumberOfProcessors : 1);
+
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return(n > 0 ? (int) n : 1);
+
+#else
+    return(1);
+#endif
+}
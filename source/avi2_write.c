@@ -31,13 +31,22 @@ typedef struct
     int den;
 } FRACTION;
 
+// Walks the index chain of a stream in order
+typedef struct
+{
+    IDX_BLOCK *Blk;   // block holding the next entry
+    DWORD Pos;        // next entry in Blk
+    DWORD Left;       // entries not walked yet
+} IDX_CURSOR;
+
 // Helper function prototypes
 static int  AllocateIndex(INDEX_ROOT *rt);
 static int  CheckFileLimit(AVI2 *avi, long payload_size);
-static int  CloseCurrentRIFFSegment(AVI2 *avi);
+static int  CloseCurrentRIFFSegment(AVI2 *avi, int Background);
 static int  StartNewRIFFSegment(AVI2 *avi);
-static int  WriteSegmentIndexes(AVI2 *avi);
-static int  WriteLegacyIndex(AVI2 *avi);
+static void FinishSegment(void *arg);
+static int  WaitSegment(AVI2 *avi);
+static int  WriteLegacyIndex(SEG_JOB *job, DWORD *Pos);
 static int  WriteHeaders(AVI2 *avi);
 static void WriteAVIMainHeader(AVI2 *avi);
 static void WriteVideoStreamHeaders(AVI2 *avi,int);
@@ -45,6 +54,14 @@ static void WriteAudioStreamHeaders(AVI2 *avi);
 static void WriteODMLHeader(AVI2 *avi);
 static void WriteINFOList(MFILE *fp);
 static void WriteVideoPropHeader(AVI2 *avi);
+static int  WriteVframeNow(AVI2 *avi, AVI_IOVEC *iov, int iovcnt, DWORD len, int keyframe);
+static int  WriteAframeNow(AVI2 *avi, BYTE *AudBuf, DWORD len);
+static int  StopAsyncWrite(AVI2 *avi);
+static int  WriteAlignJunk(AVI2 *avi);
+static int  ReserveChainEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD len);
+static int  AddChainEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD offset, DWORD len, DWORD Key);
+static void ReleaseIndexChain(AVI2 *avi, INDEX_ROOT *rt);
+static int  Preallocate(AVI2 *avi, DWORD len);
 static int  find_gcd(int a, int b);
 static FRACTION    get_fps_strict(double fps);
 
@@ -114,9 +131,10 @@ static FRACTION get_fps_strict(double fps)
 
 static int AllocateIndex(INDEX_ROOT *rt)
 {
-    MEMINDEXENTRY *newIdx;
+    void *newIdx;
     DWORD newSize;                                // bytes
     DWORD allocated = rt->idx_blocks * INDEX_BLOCK_SIZE;  // entries
+    DWORD entrySize = rt->WIdx ? sizeof(WIDEINDEXENTRY) : sizeof(MEMINDEXENTRY);
 
     if (allocated >= rt->index_entries + 1)
         return(AVIERR_NO_ERROR);  // Already have enough space
@@ -125,10 +143,23 @@ static int AllocateIndex(INDEX_ROOT *rt)
     rt->idx_blocks++;
 
     // Check Buffer Overflow
-    if (rt->idx_blocks > (DWORD_MAX / INDEX_BLOCK_SIZE / sizeof(MEMINDEXENTRY)) )
+    if (rt->idx_blocks > (DWORD_MAX / INDEX_BLOCK_SIZE / entrySize) )
         return(AVIERR_OVERFLOW);
 
-    newSize = rt->idx_blocks * INDEX_BLOCK_SIZE * sizeof(MEMINDEXENTRY); // bytes
+    newSize = rt->idx_blocks * INDEX_BLOCK_SIZE * entrySize; // bytes
+    if (rt->WIdx)
+    {
+        newIdx = realloc(rt->WIdx, newSize);
+        if (!newIdx)  // failed
+        {
+            free(rt->WIdx);
+            rt->WIdx = NULL;
+            return(AVIERR_MALLOC);
+        }
+        rt->WIdx = (WIDEINDEXENTRY *) newIdx;
+        return(AVIERR_NO_ERROR);
+    }
+
     newIdx = realloc(rt->Idx, newSize);
     if (!newIdx)  // failed
     {   // The previous memory block is still allocated and must be freed
@@ -136,12 +167,263 @@ static int AllocateIndex(INDEX_ROOT *rt)
         rt->Idx = NULL;
         return(AVIERR_MALLOC);
     }
-    rt->Idx = newIdx;
+    rt->Idx = (MEMINDEXENTRY *) newIdx;
+
+    return(AVIERR_NO_ERROR);
+}
+
+
+// Switch an index root over to WIDE_INDEX entries.  The entries
+// already in Idx[] are converted and the same number of blocks stay
+// allocated.  This is done when the first chunk that won't fit in a
+// MEMINDEXENTRY comes along.  Returns 0 if OK, else error code.
+// AVIerr is not changed.
+
+int WidenIndex(AVI2 *avi, INDEX_ROOT *rt)
+{
+    WIDEINDEXENTRY *WIdx;
+    MEMINDEXENTRY *entry;
+    DWORD i;
+
+    if (rt->WIdx)
+        return(AVIERR_NO_ERROR);   // already wide
+
+    // Make sure all the entries fit and there is room for one more
+    if (rt->idx_blocks * INDEX_BLOCK_SIZE < rt->index_entries + 1)
+        rt->idx_blocks = rt->index_entries / INDEX_BLOCK_SIZE + 1;
+
+    if (rt->idx_blocks > (DWORD_MAX / INDEX_BLOCK_SIZE / sizeof(WIDEINDEXENTRY)) )
+        return(AVIERR_OVERFLOW);
+
+    WIdx = (WIDEINDEXENTRY *)
+        malloc(rt->idx_blocks * INDEX_BLOCK_SIZE * sizeof(WIDEINDEXENTRY));
+    if (!WIdx)
+        return(AVIERR_MALLOC);
+
+    for (i = 0; i < rt->index_entries; i++)
+    {
+        entry = &rt->Idx[i];
+        WIdx[i].qwOffset = avi->BaseTable[GET_CHUNK_BASEINDEX(entry->dwSize)] +
+                           entry->dwOffset;
+        WIdx[i].dwSize = (entry->dwSize & 0x80000000) | GET_CHUNK_SIZE(entry->dwSize);
+    }
+
+    if (rt->Idx) free(rt->Idx);
+    rt->Idx = NULL;
+    rt->WIdx = WIdx;
+
+    return(AVIERR_NO_ERROR);
+}
+
+
+// Make room for one more entry at the end of a writer index chain.
+// When the last block is full, a block is taken from the pool, or
+// allocated if the pool is empty.  Nothing is copied, and if this
+// fails the entries already in the chain are kept.  Calling it again
+// before the entry is added does nothing.
+// Returns 0 if OK, else error code.  AVIerr is not changed.
+
+static int AllocateChainEntry(AVI2 *avi, INDEX_ROOT *rt)
+{
+    IDX_BLOCK *blk;
+
+    if (rt->index_entries < rt->ChainBlocks * INDEX_BLOCK_SIZE)
+        return(AVIERR_NO_ERROR);   // room in the last block
+
+    if (rt->index_entries > DWORD_MAX - INDEX_BLOCK_SIZE)
+        return(AVIERR_OVERFLOW);
+
+    blk = avi->IdxPool;
+    if (blk)
+        avi->IdxPool = blk->Next;
+    else
+    {
+        blk = (IDX_BLOCK *) malloc(sizeof(IDX_BLOCK));
+        if (!blk)
+            return(AVIERR_MALLOC);
+    }
+
+    blk->Next = NULL;
+    if (rt->Tail)
+        rt->Tail->Next = blk;
+    else
+        rt->Head = blk;
+    rt->Tail = blk;
+    rt->ChainBlocks++;
 
     return(AVIERR_NO_ERROR);
 }
 
 
+// Switch a writer index chain over to WIDE_INDEX entries.  A block
+// holds INDEX_BLOCK_SIZE entries of either kind, so the entries are
+// converted in place.  This is done when the first chunk that won't
+// fit in a MEMINDEXENTRY comes along.
+
+static void WidenIndexChain(AVI2 *avi, INDEX_ROOT *rt)
+{
+    IDX_BLOCK *blk;
+    MEMINDEXENTRY entry;
+    DWORD i, n, left = rt->index_entries;
+
+    for (blk = rt->Head; blk; blk = blk->Next)
+    {
+        n = (left < INDEX_BLOCK_SIZE) ? left : INDEX_BLOCK_SIZE;
+        left -= n;
+
+        // Last to first, since a wide entry is bigger than the one
+        // it replaces and would land on the ones after it.
+        for (i = n; i-- > 0; )
+        {
+            entry = blk->e.Idx[i];
+            blk->e.WIdx[i].qwOffset = avi->BaseTable[GET_CHUNK_BASEINDEX(entry.dwSize)] +
+                                      entry.dwOffset;
+            blk->e.WIdx[i].dwSize = (entry.dwSize & 0x80000000) | GET_CHUNK_SIZE(entry.dwSize);
+        }
+    }
+
+    rt->Wide = TRUE;
+}
+
+
+// Get the writer index chain of a stream ready for an entry for a
+// chunk of len bytes, so that AddChainEntry() can't fail for it.  This
+// is done before a frame goes to the file so it is never there without
+// an index entry.  The chain is switched to WIDE_INDEX entries if this
+// chunk won't fit in a MEMINDEXENTRY.
+// Returns 0 if OK, else error code.
+
+static int ReserveChainEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD len)
+{
+    DWORD base = avi->NumBases - 1;
+
+    if (len > 0x7FFFFFFF)   // too big for any index
+        return(AVIERR_OVERFLOW);
+
+    if (!rt->Wide && (base >= MAX_RIFF || len > MAX_MEM_CHUNK_SIZE ||
+                      (avi->OpenFlags & WIDE_INDEX)))
+        WidenIndexChain(avi, rt);
+
+    return(AllocateChainEntry(avi, rt));
+}
+
+
+// Add an entry to the end of the writer index chain of a stream for
+// a chunk in the RIFF segment being written.  offset is from the start
+// of the RIFF to the chunk data.
+// Returns 0 if OK, else error code.
+
+static int AddChainEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD offset, DWORD len, DWORD Key)
+{
+    DWORD base = avi->NumBases - 1;
+    DWORD k;
+    int ret;
+
+    ret = ReserveChainEntry(avi, rt, len);
+    if (ret)
+        return ret;
+
+    k = rt->index_entries % INDEX_BLOCK_SIZE;
+    if (rt->Wide)
+    {
+        rt->Tail->e.WIdx[k].qwOffset = avi->BaseTable[base] + offset;
+        rt->Tail->e.WIdx[k].dwSize = MAKE_WIDE_DWSIZE(len, Key);
+    }
+    else
+    {
+        rt->Tail->e.Idx[k].dwOffset = offset;  // Point to data
+        rt->Tail->e.Idx[k].dwSize = MAKE_DWORD_CHUNK(len, base, Key);
+    }
+    rt->index_entries++;
+
+    return(0);
+}
+
+
+// Give the index chain of a stream back to the pool and empty it.
+// This is done when a RIFF segment is closed.
+
+static void ReleaseIndexChain(AVI2 *avi, INDEX_ROOT *rt)
+{
+    if (rt->Head)
+    {
+        rt->Tail->Next = avi->IdxPool;
+        avi->IdxPool = rt->Head;
+    }
+    rt->Head = rt->Tail = NULL;
+    rt->ChainBlocks = 0;
+    rt->index_entries = 0;
+}
+
+
+// Start walking the index chain of a stream from the first entry.
+
+static void StartIndexWalk(INDEX_ROOT *rt, IDX_CURSOR *cur)
+{
+    cur->Blk = rt->Head;
+    cur->Pos = 0;
+    cur->Left = rt->index_entries;
+}
+
+
+// Get the next entry of the index chain of a RIFF segment that starts
+// at the absolute position Base.
+// Returns the offset of the chunk data from the start of the RIFF and
+// puts the chunk size with the NOT keyframe bit 31 in Size.  Returns
+// 0xFFFFFFFF if there are no more entries.
+
+static DWORD NextSegmentEntry(QWORD Base, INDEX_ROOT *rt, IDX_CURSOR *cur, DWORD *Size)
+{
+    DWORD k;
+
+    if (cur->Left == 0)
+        return(0xFFFFFFFF);
+
+    if (cur->Pos == INDEX_BLOCK_SIZE)   // on to the next block
+    {
+        cur->Blk = cur->Blk->Next;
+        cur->Pos = 0;
+    }
+    k = cur->Pos++;
+    cur->Left--;
+
+    if (rt->Wide)
+    {
+        *Size = cur->Blk->e.WIdx[k].dwSize;
+        return((DWORD)(cur->Blk->e.WIdx[k].qwOffset - Base));
+    }
+
+    *Size = cur->Blk->e.Idx[k].dwSize & 0x80FFFFFF;  // mask out base index
+    return(cur->Blk->e.Idx[k].dwOffset);
+}
+
+
+// Return the number of superindex entries reserved in the header
+// for each stream.  This is the most RIFF segments we can write.
+
+static DWORD SuperIndexSlots(AVI2 *avi)
+{
+    return((avi->OpenFlags & WIDE_INDEX) ? MAX_WIDE_RIFF : MAX_RIFF);
+}
+
+
+// Reserve space for a stream's superindex at the current position.
+
+static void ReserveSuperIndex(AVI2 *avi)
+{
+    BYTE filler[2048];
+    DWORD len, left = SuperIndexSlots(avi) * sizeof(SUPERINDEXENTRY);
+
+    memset(filler, 0, sizeof(filler));
+    while (left)
+    {
+        len = (left > sizeof(filler)) ? sizeof(filler) : left;
+        File64Write(avi->fp, filler, len);
+        left -= len;
+    }
+}
+
+
 // Check if writing payload_size bytes plus two indexes would exceed
 // the 2GB limit for legacy mode (hard limit).  For ODML mode, it
 // only checks if the payload itself would exceed 1GB (soft limit).
@@ -152,10 +434,16 @@ static int CheckFileLimit(AVI2 *avi, long payload_size)
     DWORD current_pos;
     DWORD legacy_index_size;
     DWORD bytes_needed;
+    QWORD seg_needed;
+    DWORD limit;
 
     // Get current file position
     current_pos = File64GetPos(avi->fp);
 
+    // Leave room for a JUNK chunk in front of an aligned frame
+    if (avi->ChunkAlign)
+        payload_size += avi->ChunkAlign + 8;
+
     if (avi->ODMLmode == STRICT_LEGACY)
     {
         // Calculate size of legacy index that will be written
@@ -176,262 +464,394 @@ static int CheckFileLimit(AVI2 *avi, long payload_size)
     }
     else   // strict odml or hybrid
     {
-        // In ODML mode, the limit is a soft 1GB.
-        if (current_pos + payload_size > 0x40000000)   // 1GB
+        // A new segment is no help if this one is still empty
+        if (avi->VidRt.index_entries + avi->AudRt.index_entries == 0)
+            return(TRUE);
+
+        // In ODML mode, the limit is a soft 1GB unless changed
+        // with AVI_SetSegmentSize().
+        limit = avi->SegmentSize ? avi->SegmentSize : DEFAULT_SEGMENT_SIZE;
+        if ((QWORD) current_pos + payload_size > limit)
             return(FALSE);   // over
+
+        // Whatever the size, the segment and the indexes written at
+        // its end must stay under 2GB.  The first segment of a hybrid
+        // file also gets the legacy index.
+        seg_needed = (QWORD) current_pos + 8 + payload_size +
+                     2 * (8 + sizeof(INDX_CHUNK)) + sizeof(STDINDEXENTRY) *
+                     (QWORD)(avi->VidRt.index_entries + avi->AudRt.index_entries + 1);
+        if (avi->ODMLmode != STRICT_ODML && avi->NumBases <= 1)
+            seg_needed += 8 + sizeof(AVIINDEXENTRY) *
+                (QWORD)(avi->VidRt.index_entries + avi->AudRt.index_entries + 1);
+        if (seg_needed >= AVI_MAX_RIFF_SIZE)
+            return(FALSE);
     }
     return(TRUE);  // Safe to write
 }
 
 
+// Write len bytes at offset *Pos of a segment being finished and
+// move *Pos past them.  Writes are by position so that the file
+// position used for writing frames is not touched.  Nothing is
+// written outside the segment.
+// Return 0 if OK, else error code.
+
+static int PutSegmentData(SEG_JOB *job, void *buf, DWORD len, DWORD *Pos)
+{
+    if (*Pos > job->End || len > job->End - *Pos)
+        return(AVIERR_UNKNOWN);   // not in this segment
+
+    if (File64PWrite(job->fp, buf, len, job->Base + *Pos) != len)
+        return(AVIERR_CANT_WRITE_FILE);
+
+    *Pos += len;
+    return(0);
+}
+
+
 // Write ODML index helper
-// Write ODML index at the current file location.
+// Write the ODML index of one stream of a segment at offset *Pos.
 // Add an entry to the corresponding SUPER INDEX.
 // Return 0 if OK, else error code.
 
-static int WriteODMLIndexHelper(AVI2 *avi, DWORD Stream)
+static int WriteODMLIndexHelper(SEG_JOB *job, DWORD Stream, DWORD *Pos)
 {
+    BYTE hdr[8 + sizeof(INDX_CHUNK)];
     INDX_CHUNK idxChunk;
     INDEX_ROOT *rt;
-    STDINDEXENTRY stdEntry;
+    IDX_CURSOR cur;
+    STDINDEXENTRY *stage;
     SUPERINDEXENTRY supEntry;
     QWORD IndexPtr;
-    DWORD i, size, cnt, save_fp, NewOffset, AudByteCtr = 0;
-    char StreamText[8];
-    FOURCC fcc;
+    DWORD i, k, n, size, fcc, NewOffset, ChunkSize = 0, AudByteCtr = 0;
+    int ret;
 
-    if (Stream > 99)    // no more than 99 streams allowed
-    {
-        return(avi->AVIerr = AVIERR_STREAM_INVALID);
-    }
-    rt = (Stream == 0) ? &avi->VidRt : &avi->AudRt;
-    sprintf(StreamText, "%02u%.2s", Stream, Stream == 0 ? "dc" : "wb");
-    fcc = *((FOURCC *) StreamText);
+    rt = (Stream == 0) ? &job->VidRt : &job->AudRt;
+    if (rt->index_entries == 0)
+        return(0);
 
     // Get an absolute pointer to the start of the index
-    IndexPtr = File64GetBase(avi->fp) + File64GetPos(avi->fp);
+    IndexPtr = job->Base + *Pos;
+
+    // Calculate size: INDX_CHUNK + entries
+    if (rt->index_entries > (DWORD_MAX - sizeof(INDX_CHUNK)) / sizeof(STDINDEXENTRY))
+       return(AVIERR_OVERFLOW);
+    size = sizeof(INDX_CHUNK) +
+            (rt->index_entries * sizeof(STDINDEXENTRY));
+
+    // Fill INDX_CHUNK header
+    idxChunk.wLongsPerEntry = sizeof(STDINDEXENTRY) / 4;
+    idxChunk.bIndexSubType = AVI_INDEX_STANDARD;
+    idxChunk.bIndexType = AVI_INDEX_OF_CHUNKS;
+    idxChunk.nEntriesInUse = rt->index_entries;
+    idxChunk.dwChunkId = FIX_LIT((Stream == 0) ? '00dc' : '01wb');
+    // the base address for indexes always points to the 'm' in 'movi'
+    idxChunk.qwBaseOffset = job->Base + job->movi_start - 4;
+    idxChunk.dwReserved = 0;
+
+    // ix## fourcc and size go in front of it
+    fcc = FIX_LIT((Stream == 0) ? 'ix00' : 'ix01');
+    memcpy(hdr, &fcc, 4);
+    memcpy(hdr + 4, &size, 4);
+    memcpy(hdr + 8, &idxChunk, sizeof(INDX_CHUNK));
+    ret = PutSegmentData(job, hdr, sizeof(hdr), Pos);
+    if (ret) return(ret);
+
+    stage = (STDINDEXENTRY *) malloc(INDEX_STAGE_ENTRIES * sizeof(STDINDEXENTRY));
+    if (!stage)
+        return(AVIERR_MALLOC);
 
-    // Write odml index ix<stream num>
-    if (rt->index_entries > 0)
+    // Write index entries.  They are converted a block at a time
+    // and each block is written at once instead of one at a time.
+    StartIndexWalk(rt, &cur);
+    for (i = 0; i < rt->index_entries && !ret; i += n)
     {
-        // Write ix## fourcc
-        WriteFCC(avi->fp, 'ix##', Stream);
-
-        // Calculate size: INDX_CHUNK + entries
-        if (rt->index_entries > (DWORD_MAX - sizeof(INDX_CHUNK)) / sizeof(STDINDEXENTRY))
-           return(avi->AVIerr = AVIERR_OVERFLOW);
-        size = sizeof(INDX_CHUNK) +
-                (rt->index_entries * sizeof(STDINDEXENTRY));
-        WriteDWORD(avi->fp, size);
-
-        // Fill INDX_CHUNK header
-        idxChunk.wLongsPerEntry = sizeof(STDINDEXENTRY) / 4;
-        idxChunk.bIndexSubType = AVI_INDEX_STANDARD;
-        idxChunk.bIndexType = AVI_INDEX_OF_CHUNKS;
-        idxChunk.nEntriesInUse = rt->index_entries;
-        idxChunk.dwChunkId = FIX_LIT(fcc);
-        // the base address for indexes always points to the 'm' in 'movi'
-        idxChunk.qwBaseOffset = File64GetBase(avi->fp) + avi->movi_start - 4;
-        idxChunk.dwReserved = 0;
-
-        cnt = File64Write(avi->fp, &idxChunk, sizeof(INDX_CHUNK));
-
-        // Write index entries
-        for (i = 0; i < rt->index_entries; i++)
-        {
-            memcpy(&stdEntry, &rt->Idx[i], sizeof(MEMINDEXENTRY));
-            NewOffset = stdEntry.dwOffset - avi->movi_start + 4;
-            stdEntry.dwOffset = NewOffset;
-            stdEntry.dwSize &= 0x80FFFFFF;  // mask out base index
-            AudByteCtr += stdEntry.dwSize;  // only used for audio
-            cnt += File64Write(avi->fp, &stdEntry, sizeof(STDINDEXENTRY));
-        }
-
-        if (cnt != sizeof(INDX_CHUNK) + rt->index_entries * sizeof(STDINDEXENTRY))
-        {
-            // Failed to write all the data
-            return(avi->AVIerr = AVIERR_CANT_WRITE_FILE);
-        }
-
-        // Now go back and write the superindex entry
-        save_fp = File64GetPos(avi->fp);  // save where we are at
-        supEntry.qwOffset = IndexPtr;
-        supEntry.dwSize = size + 8;
-        supEntry.dwDuration = rt->index_entries;  // for video only
-        if (Stream != 0)   // audio track is calculated differently
-        {
-            // dwDuration = Total Bytes of Audio in Sub-Index / nBlockAlign
-            if (avi->Aud.nBlockAlign == 0) avi->Aud.nBlockAlign = 1;
-            supEntry.dwDuration = AudByteCtr / avi->Aud.nBlockAlign;
-        }
+        n = rt->index_entries - i;
+        if (n > INDEX_STAGE_ENTRIES) n = INDEX_STAGE_ENTRIES;
 
-        // Seek to superindex entry location
-        // We used Qseek because it doesn't disturb the base pointer
-        File64Qseek(avi->fp, (QWORD) rt->SuperIdxOffset);
-        cnt = File64Write(avi->fp, &supEntry, sizeof(SUPERINDEXENTRY));
-        rt->SuperIdxOffset += sizeof(SUPERINDEXENTRY);
-
-        // Return to our previous position
-        File64SetPos(avi->fp, save_fp, SEEK_SET);  // save where we are at
-
-        if (cnt != sizeof(SUPERINDEXENTRY))
+        for (k = 0; k < n; k++)
         {
-            // Failed to write all the data
-            return(avi->AVIerr = AVIERR_CANT_WRITE_FILE);
+            NewOffset = NextSegmentEntry(job->Base, rt, &cur, &ChunkSize);
+            if (NewOffset == 0xFFFFFFFF)   // chain is shorter than its count
+            {
+                ret = AVIERR_UNKNOWN;
+                break;
+            }
+            stage[k].dwOffset = NewOffset - job->movi_start + 4;
+            stage[k].dwSize = ChunkSize;
+            AudByteCtr += ChunkSize;  // only used for audio
         }
+        if (!ret)
+            ret = PutSegmentData(job, stage, n * sizeof(STDINDEXENTRY), Pos);
     }
-
-    return(0);
-}
-
-
-// Write ODML standard indexes (ix00, ix01) for current RIFF segment
-// Return 0 if OK, or error code.
-
-static int WriteSegmentIndexes(AVI2 *avi)
-{
-
-    int ret;
-
-    // Write video index ix00
-    if (avi->has_video)
+    free(stage);
+    if (ret) return(ret);
+
+    // Now write the superindex entry in the header
+    supEntry.qwOffset = IndexPtr;
+    supEntry.dwSize = size + 8;
+    supEntry.dwDuration = rt->index_entries;  // for video only
+    if (Stream != 0)   // audio track is calculated differently
     {
-        ret = WriteODMLIndexHelper(avi, 0);
-        if (ret) return(ret);
+        // dwDuration = Total Bytes of Audio in Sub-Index / nBlockAlign
+        supEntry.dwDuration = AudByteCtr / (job->BlockAlign ? job->BlockAlign : 1);
     }
 
-    // Write audio index ix01
-    if (avi->has_audio)
+    if (File64PWrite(job->fp, &supEntry, sizeof(SUPERINDEXENTRY),
+                     (QWORD) rt->SuperIdxOffset) != sizeof(SUPERINDEXENTRY))
     {
-        ret = WriteODMLIndexHelper(avi, 1);
-        if (ret)return(ret);
+        // Failed to write all the data
+        return(AVIERR_CANT_WRITE_FILE);
     }
 
     return(0);
 }
 
 
-// Write legacy index (idx1) for first RIFF segment
+// Write legacy index (idx1) for first RIFF segment at offset *Pos.
 // Returns 0 if OK, else error code.
 
-static int WriteLegacyIndex(AVI2 *avi)
+static int WriteLegacyIndex(SEG_JOB *job, DWORD *Pos)
 {
-    AVIINDEXENTRY entry;
-    DWORD i, vidIdx, audIdx, size;
+    AVIINDEXENTRY *stage, *entry;
+    IDX_CURSOR vidCur, audCur;
+    DWORD i, n, size, hdr[2];
     DWORD totalEntries;
-    DWORD vidOffset, audOffset;
+    DWORD vidOffset, audOffset, vidSize, audSize;
+    int ret;
 
-    totalEntries = avi->VidRt.index_entries + avi->AudRt.index_entries;
+    totalEntries = job->VidRt.index_entries + job->AudRt.index_entries;
     if (totalEntries == 0)
         return 0;
 
-    // Write 'idx1' fourcc
-    WriteFCC(avi->fp, 'idx1', 0);
-
-    // Write size
-    size = totalEntries * sizeof(AVIINDEXENTRY);
-    WriteDWORD(avi->fp, size);
+    // Entries are built in a block and each block is written at once
+    stage = (AVIINDEXENTRY *) malloc(INDEX_STAGE_ENTRIES * sizeof(AVIINDEXENTRY));
+    if (!stage)
+        return(AVIERR_MALLOC);
 
+    // Write 'idx1' fourcc and size
+    hdr[0] = FIX_LIT('idx1');
+    hdr[1] = totalEntries * sizeof(AVIINDEXENTRY);
+    ret = PutSegmentData(job, hdr, sizeof(hdr), Pos);
 
     // Legacy indexes are combined.
     // Merge video and audio indexes in the order they were written
-    vidIdx = 0;
-    audIdx = 0;
+    StartIndexWalk(&job->VidRt, &vidCur);
+    StartIndexWalk(&job->AudRt, &audCur);
+    vidOffset = NextSegmentEntry(job->Base, &job->VidRt, &vidCur, &vidSize);
+    audOffset = NextSegmentEntry(job->Base, &job->AudRt, &audCur, &audSize);
+    n = 0;
 
-    for (i = 0; i < totalEntries; i++)
+    for (i = 0; i < totalEntries && !ret; i++)
     {
         // The offset is already relative to movi_start and
         // pointing to the video data.  We need to subtrace 8
         // To make it point to the FourCC.
 
-        vidOffset = (vidIdx >= avi->VidRt.index_entries) ? 0xFFFFFFFF :
-                      avi->VidRt.Idx[vidIdx].dwOffset;
-        audOffset = (audIdx >= avi->AudRt.index_entries) ? 0xFFFFFFFF :
-                      avi->AudRt.Idx[audIdx].dwOffset;
-
         // Write whichever came first in the file
+        entry = &stage[n++];
         if (vidOffset < audOffset)
         {
             // Write Video Chunk
-            size = avi->VidRt.Idx[vidIdx].dwSize;
-            entry.ckid = FIX_LIT('00dc');
-            entry.dwFlags = (size & 0x80000000) ? 0: AVIIF_KEYFRAME;
-            entry.dwChunkOffset = vidOffset - avi->movi_start - 4;
-            entry.dwChunkLength = GET_CHUNK_SIZE(size);
-            vidIdx++;
+            size = vidSize;
+            entry->ckid = FIX_LIT('00dc');
+            entry->dwFlags = (size & 0x80000000) ? 0: AVIIF_KEYFRAME;
+            entry->dwChunkOffset = vidOffset - job->movi_start - 4;
+            entry->dwChunkLength = GET_WIDE_SIZE(size);
+            vidOffset = NextSegmentEntry(job->Base, &job->VidRt, &vidCur, &vidSize);
         }
         else
         {
             // Write Audio Chunk
-            size = avi->AudRt.Idx[audIdx].dwSize;
-            entry.ckid = FIX_LIT('01wb');
-            entry.dwFlags = AVIIF_KEYFRAME;  // Audio chunks are always keyframes
-            entry.dwChunkOffset = audOffset - avi->movi_start - 4;    // point to '00dc'
-            entry.dwChunkLength = GET_CHUNK_SIZE(size);
-            audIdx++;
+            size = audSize;
+            entry->ckid = FIX_LIT('01wb');
+            entry->dwFlags = AVIIF_KEYFRAME;  // Audio chunks are always keyframes
+            entry->dwChunkOffset = audOffset - job->movi_start - 4;    // point to '00dc'
+            entry->dwChunkLength = GET_WIDE_SIZE(size);
+            audOffset = NextSegmentEntry(job->Base, &job->AudRt, &audCur, &audSize);
         }
 
-        if (File64Write(avi->fp, &entry, sizeof(AVIINDEXENTRY)) != sizeof(AVIINDEXENTRY))
-            return(avi->AVIerr = AVIERR_CANT_WRITE_FILE);
+        // Write the block when it is full or this is the last entry
+        if (n == INDEX_STAGE_ENTRIES || i + 1 == totalEntries)
+        {
+            ret = PutSegmentData(job, stage, n * sizeof(AVIINDEXENTRY), Pos);
+            n = 0;
+        }
     }
 
+    free(stage);
 
-    return 0;
+    return(ret);
+}
+
+
+// Write the indexes of a closed RIFF segment in the room left for
+// them and fix the movi and RIFF lengths in its headers.  This is
+// the thread function when the segment is finished in the background.
+// The result is left in job->Err.
+
+static void FinishSegment(void *arg)
+{
+    SEG_JOB *job = (SEG_JOB *) arg;
+    DWORD pos = job->IdxPos, size;
+    int ret = 0;
+
+    // Write ODML indexes (ix00, ix01) if in ODML or hybrid mode
+    // ODML indexes are not written in STRICT_LEGACY mode
+    if (job->ODMLmode != STRICT_LEGACY)
+    {
+        if (job->HasVideo)
+            ret = WriteODMLIndexHelper(job, 0, &pos);
+        if (!ret && job->HasAudio)
+            ret = WriteODMLIndexHelper(job, 1, &pos);
+    }
+
+    // Write legacy index if this is the first segment
+    if (!ret && job->Legacy)
+        ret = WriteLegacyIndex(job, &pos);
+
+    // Fix MOVI length.  It includes the odml indexes.
+    if (!ret)
+    {
+        pos = job->movi_start - 8;
+        size = job->MoviEnd - job->movi_start + 4;  // +4 to include 'movi' itself
+        ret = PutSegmentData(job, &size, 4, &pos);
+    }
+
+    // Fix RIFF length
+    if (!ret)
+    {
+        pos = 4;
+        size = job->End - 8;
+        ret = PutSegmentData(job, &size, 4, &pos);
+    }
+
+    job->Err = ret;
+}
+
+
+// Wait until the segment handed to FinishSegment() is done and give
+// its index blocks back to the pool.
+// Return 0 if OK, else the error from finishing it.
+
+static int WaitSegment(AVI2 *avi)
+{
+    SEG_JOB *job = &avi->SegJob;
+
+    if (avi->SegThread)
+    {
+        ThreadJoin(avi->SegThread);
+        avi->SegThread = NULL;
+    }
+
+    if (!job->Pending)
+        return(0);
+
+    job->Pending = FALSE;
+    ReleaseIndexChain(avi, &job->VidRt);
+    ReleaseIndexChain(avi, &job->AudRt);
+
+    return(job->Err);
 }
 
 
 // Close current RIFF segment
 // Called after the last MOVI chunk.
 // We assume that the Base file pointer is set to point to the 'R' in 'RIFF'.
+// The size of the indexes is known, so room is left for them and the
+// file position is moved past it to where the next segment goes.
+// FinishSegment() writes them and fixes the segment sizes.  If
+// Background is TRUE, that is done by a thread while the next segment
+// is being written.  Only one segment is finished at a time.
 // Return 0 if OK, else error code.
 
-static int CloseCurrentRIFFSegment(AVI2 *avi)
+static int CloseCurrentRIFFSegment(AVI2 *avi, int Background)
 {
-    DWORD  moviSize;
+    SEG_JOB *job = &avi->SegJob;
+    DWORD total;
     int ret;
-    DWORD finalPos;
-    DWORD EndMoviPos;
 
-    // Write ODML indexes if in ODML or hybrid mode
-    // ODML indexes are not written in STRICT_LEGACY mode
-    if (avi->ODMLmode != STRICT_LEGACY)
+    ret = WaitSegment(avi);   // the one before this
+    if (ret != 0)
+        return ret;
+
+    // Nothing has been written since the file was opened, so there is
+    // no movi LIST or index to finish.  Only the RIFF length is fixed.
+    if (avi->movi_start == 0)
     {
-        ret = WriteSegmentIndexes(avi);
-        if (ret != 0)
-            return ret;
+        total = File64GetPos(avi->fp) - 8;
+        if (File64PWrite(avi->fp, &total, 4, File64GetBase(avi->fp) + 4) != 4)
+            return(AVIERR_CANT_WRITE_FILE);
+        return(0);
     }
 
-
-    // Go back and fix MOVI length
-    // Get the position of the end of the movi and all odml indexes.
-    EndMoviPos = File64GetPos(avi->fp);
-    moviSize = EndMoviPos - avi->movi_start + 4;  // +4 to include 'movi' itself
-    // seek to the movi list size.
-    File64SetPos(avi->fp, avi->movi_start - 8, SEEK_SET);
-    WriteDWORD(avi->fp, moviSize);
-    File64SetPos(avi->fp, EndMoviPos, SEEK_SET);  // back to present
-
-    // Write legacy index if this is the first segment
-    // Legacy index is not written for strict odml
-    if (avi->ODMLmode != STRICT_ODML && avi->NumBases == 1)
+    // Move the index chains to the job.  New ones start empty.
+    job->VidRt = avi->VidRt;
+    job->AudRt = avi->AudRt;
+    avi->VidRt.Head = avi->VidRt.Tail = NULL;
+    avi->AudRt.Head = avi->AudRt.Tail = NULL;
+    avi->VidRt.ChainBlocks = avi->AudRt.ChainBlocks = 0;
+    avi->VidRt.index_entries = avi->AudRt.index_entries = 0;
+
+    job->Base = File64GetBase(avi->fp);
+    job->movi_start = avi->movi_start;
+    job->BlockAlign = avi->Aud.nBlockAlign;
+    job->ODMLmode = avi->ODMLmode;
+    job->HasVideo = avi->has_video;
+    job->HasAudio = avi->has_audio;
+    job->Err = 0;
+    job->Pending = TRUE;
+
+    // Work out where everything goes
+    job->IdxPos = job->MoviEnd = File64GetPos(avi->fp);
+    if (avi->ODMLmode != STRICT_LEGACY)
     {
-        ret = WriteLegacyIndex(avi);
-        if (ret != 0)
-            return ret;
+        if (job->HasVideo && job->VidRt.index_entries)
+        {
+            job->MoviEnd += 8 + sizeof(INDX_CHUNK) + job->VidRt.index_entries * sizeof(STDINDEXENTRY);
+            avi->VidRt.SuperIdxOffset += sizeof(SUPERINDEXENTRY);
+        }
+        if (job->HasAudio && job->AudRt.index_entries)
+        {
+            job->MoviEnd += 8 + sizeof(INDX_CHUNK) + job->AudRt.index_entries * sizeof(STDINDEXENTRY);
+            avi->AudRt.SuperIdxOffset += sizeof(SUPERINDEXENTRY);
+        }
     }
 
-    // Go back and fix RIFF length
-    finalPos = File64GetPos(avi->fp);    // Get final RIFF length
-//    avi->current_riff_size = finalPos ;
-    File64SetPos(avi->fp, 4, SEEK_SET);  // seek to RIFF length
-    WriteDWORD(avi->fp, finalPos - 8);   // Length of current RIFF
-    File64SetPos(avi->fp, finalPos, SEEK_SET);  // back to present
+    // Legacy index is written in the first segment, but not for strict odml
+    job->Legacy = (avi->ODMLmode != STRICT_ODML && avi->NumBases == 1);
+    total = job->VidRt.index_entries + job->AudRt.index_entries;
+    job->End = job->MoviEnd;
+    if (job->Legacy && total)
+        job->End += 8 + total * sizeof(AVIINDEXENTRY);
+
+    // Everything before the indexes must be in the file before the
+    // sizes are fixed through another handle.  Seeking past the room
+    // for the indexes flushes the stdio buffer as well.
+    if (File64Flush(avi->fp) != AVIERR_NO_ERROR ||
+        File64SetPos(avi->fp, job->End, SEEK_SET) != 0)
+    {
+        job->Err = AVIERR_CANT_WRITE_FILE;
+        return(WaitSegment(avi));
+    }
 
-    // Reset index counters for next segment
-    avi->VidRt.index_entries = 0;
-    avi->AudRt.index_entries = 0;
+    job->fp = avi->fp;
+    if (Background)
+    {
+        if (!avi->SegFp)
+            avi->SegFp = File64Dup(avi->fp, TRUE);
+        if (avi->SegFp)
+        {
+            job->fp = avi->SegFp;
+            avi->SegThread = ThreadCreate(FinishSegment, job);
+            if (avi->SegThread)
+                return(0);
+        }
+    }
 
-    return 0;
+    // No thread, so do it now
+    FinishSegment(job);
+    return(WaitSegment(avi));
 }
 
 
@@ -442,15 +862,18 @@ static int CloseCurrentRIFFSegment(AVI2 *avi)
 static int StartNewRIFFSegment(AVI2 *avi)
 {
     QWORD RiffPos;    // absolute RIFF start
+    int ret;
 
     // Set the new base pointer to the curent location
-    if (avi->NumBases >= MAX_RIFF)
-        return(avi->AVIerr = AVIERR_TOO_MANY_SEGMENTS);
+    if (avi->NumBases >= SuperIndexSlots(avi))
+        return(AVIERR_TOO_MANY_SEGMENTS);
 
     RiffPos = File64GetBase(avi->fp);  // get old base
     RiffPos += File64GetPos(avi->fp); // Add offset to get absolute addr
+    ret = AddBaseTable(avi, RiffPos);
+    if (ret)
+        return(ret);
     File64SetBase(avi->fp, RiffPos);   // set new base file pointer
-    avi->BaseTable[avi->NumBases++] = RiffPos;
 
 
     // Write RIFF header
@@ -752,7 +1175,7 @@ static void WriteStreamHeaders(AVI2 *avi, DWORD Stream)
     // This is written by the odml index writing function so we don't
     // touch this.  NumBases must be accurate and should be the number
     // of entries including the first one (starts at 1).  We have
-    // previously reserved enough disk space for MAX_RIFF entries.  Mark
+    // previously reserved enough disk space for SuperIndexSlots() entries.  Mark
     // unused index entries as 'JUNK'.  This area is initialized to
     // all zeros.
 
@@ -761,7 +1184,7 @@ static void WriteStreamHeaders(AVI2 *avi, DWORD Stream)
         DWORD idxSize, maxSize;
         INDX_CHUNK idxChunk;
 
-        maxSize = MAX_RIFF * sizeof(SUPERINDEXENTRY);
+        maxSize = SuperIndexSlots(avi) * sizeof(SUPERINDEXENTRY);
         idxSize = avi->NumBases * sizeof(SUPERINDEXENTRY);
 
         WriteFCC(fp, 'indx', 0);
@@ -866,12 +1289,13 @@ static int WriteHeaders(AVI2 *avi)
     // Write INFO list
     WriteINFOList(fp);
 
-    // Calculate how much JUNK we need to reach movi_start
+    // Calculate how much JUNK we need to reach the first movi_start.
+    // By the time the file is closed, movi_start is for the last RIFF.
     headerEnd = File64GetPos(fp);
-    if (headerEnd > avi->movi_start - 20)
-        return(avi->AVIerr = AVIERR_FILE_CORRUPTED);
+    if (headerEnd > avi->first_movi_start - 20)
+        return(AVIERR_FILE_CORRUPTED);
 
-    junkSize = avi->movi_start - headerEnd - 20;
+    junkSize = avi->first_movi_start - headerEnd - 20;
     WriteFCC(fp, 'JUNK', 0);
     WriteDWORD(fp, junkSize);
 
@@ -886,26 +1310,51 @@ static int WriteHeaders(AVI2 *avi)
 
 int FinalizeWrite(AVI2 *avi)
 {
-    int err;
-
-    // Close current RIFF segment (write indexes, fix sizes)
-    err = CloseCurrentRIFFSegment(avi);
+    QWORD FileEnd;
+    int err, AsyncErr;
+
+    // Everything queued must be written first.  The file is still
+    // finished after a write error so what was written can be played.
+    AsyncErr = StopAsyncWrite(avi);
+    free(avi->StageBuf);          // an uncommitted frame is dropped
+    avi->StageBuf = NULL;
+    avi->PendingBuf = NULL;
+
+    // Close current RIFF segment (write indexes, fix sizes).  The
+    // one before it is finished first if it is still being written.
+    err = CloseCurrentRIFFSegment(avi, FALSE);
+    if (avi->SegFp)
+    {
+        File64Close(avi->SegFp);
+        avi->SegFp = NULL;
+    }
     if (err) return(err);
+    FileEnd = File64GetBase(avi->fp) + File64GetPos(avi->fp);   // nothing is written past here
 
     // Write all headers at beginning of file
     File64SetBase(avi->fp, 0);   // headers go at beginning
     err = WriteHeaders(avi);
     if (err) return(err);
 
-    return(err);
+    // Give back the reserved disk space that was not used
+    if (avi->PreallocEnd > 0)
+    {
+        err = File64Truncate(avi->fp, FileEnd);
+        if (err) return(avi->AVIerr = err);
+    }
+
+    return(AsyncErr);
 }
 
 
 // start the very first 'movi' LIST
 // This gets called whenever the first chunk is added.
+// Returns 0 if OK, else error code.
 
-static void BeginMovi(AVI2 *avi)
+static int BeginMovi(AVI2 *avi)
 {
+    int ret;
+
     // Write movi LIST header
     WriteFCC(avi->fp, 'LIST', 0);
     WriteDWORD(avi->fp, 0);  // Size - will fix later
@@ -913,12 +1362,17 @@ static void BeginMovi(AVI2 *avi)
 
     // Store movi base address
     avi->movi_start = File64GetPos(avi->fp);   // should be 0 up to this point
+    avi->first_movi_start = avi->movi_start;
 
     WriteHeaders(avi);
     File64SetPos(avi->fp, avi->movi_start, SEEK_SET);
-    avi->NumBases = 1;  // starting first base
 
-    return;
+    // starting first base
+    ret = AddBaseTable(avi, 0);
+    if (ret)
+        return(ret);
+
+    return(0);
 }
 
 
@@ -929,21 +1383,52 @@ static void BeginMovi(AVI2 *avi)
 
 int AddIndexEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD len, DWORD Key)
 {
-    DWORD offset;
-    int ret = AllocateIndex(rt);
-    if (ret)
-        return ret;
-
     // Calculate offset to add to index offset
     // Note that our offset points to the data not the '00dc'
 //    offset = File64GetPos(avi->fp) - avi->movi_start + 12; // 4 + 8
     // In our memory index, the offset is offset only to the start of
     // the RIFF segment.
-    offset = File64GetPos(avi->fp);
+    return(AddChainEntry(avi, rt, File64GetPos(avi->fp), len, Key));
+}
+
+
+// Add an entry to a flat Idx[] or WIdx[] index.  The BaseTable[] index
+// of the RIFF and the offset of the data from the start of that RIFF
+// are given instead of taken from the file.  This is for when the data
+// was not found with file reads, such as by GenerateIndex().  Files
+// being written use the index chains instead.  The index is switched
+// to WIDE_INDEX entries if this chunk won't fit in a MEMINDEXENTRY.
+
+int AddIndexEntryAt(AVI2 *avi, INDEX_ROOT *rt, DWORD base, DWORD offset, DWORD len, DWORD Key)
+{
+    int ret;
+
+    if (len > 0x7FFFFFFF)   // too big for any index
+        return(AVIERR_OVERFLOW);
+
+    if (!rt->WIdx && (base >= MAX_RIFF || len > MAX_MEM_CHUNK_SIZE ||
+                      (avi->OpenFlags & WIDE_INDEX)))
+    {
+        ret = WidenIndex(avi, rt);
+        if (ret)
+            return ret;
+    }
 
-    rt->Idx[rt->index_entries].dwOffset = offset;  // Point to data
-    rt->Idx[rt->index_entries].dwSize =
-        MAKE_DWORD_CHUNK(len, avi->NumBases - 1, Key);
+    ret = AllocateIndex(rt);
+    if (ret)
+        return ret;
+
+    if (rt->WIdx)
+    {
+        rt->WIdx[rt->index_entries].qwOffset = avi->BaseTable[base] + offset;
+        rt->WIdx[rt->index_entries].dwSize = MAKE_WIDE_DWSIZE(len, Key);
+    }
+    else
+    {
+        rt->Idx[rt->index_entries].dwOffset = offset;  // Point to data
+        rt->Idx[rt->index_entries].dwSize =
+            MAKE_DWORD_CHUNK(len, base, Key);
+    }
     rt->index_entries++;
 
     return(0);
@@ -951,7 +1436,205 @@ int AddIndexEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD len, DWORD Key)
 
 
 
-// This function is called by the user to set the basic video parameters
+// Set the size of the write buffer for a file opened FOR_WRITING.
+// Chunk headers, frames, padding and index entries collect in the
+// buffer and are written to the file in large aligned blocks, and
+// the file position is tracked without asking the OS.  A buffer of
+// WRITE_BUFFER_SIZE is set up when the file is opened.  Size is
+// rounded up to a multiple of 4KB and 0 turns buffering off, except
+// with DIRECT_IO, which needs the buffer.  Data already buffered is
+// written first.  Returns 0 if OK, else error code.
+
+int AVI_SetWriteBuffer(AVI2 *avi, DWORD Size)
+{
+    if (!avi)
+        return(AVIERR_AVI_STRUCT_BAD);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_WRITING)
+        return(avi->AVIerr = AVIERR_WRONG_FILE_MODE);
+
+    // The writer thread owns the file, or AVI_BeginVframe() gave out
+    // a pointer into the buffer.
+    if (avi->Async || avi->PendingBuf)
+        return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
+
+    return(avi->AVIerr = File64SetWriteBuffer(avi->fp, Size));
+}
+
+
+// Set the size at which a new RIFF segment is started in an ODML or
+// hybrid file.  Smaller segments mean smaller indexes to write at each
+// rollover, but more segments.  Without WIDE_INDEX, a file can only
+// have MAX_RIFF segments.  Size must be from MIN_SEGMENT_SIZE up to
+// AVI_MAX_RIFF_SIZE, or 0 for the default of DEFAULT_SEGMENT_SIZE.
+// A segment is always cut early if its indexes would not fit under
+// 2GB.  This takes effect with the next chunk written.
+// Returns 0 if OK, else error code.
+
+int AVI_SetSegmentSize(AVI2 *avi, DWORD Size)
+{
+    if (!avi)
+        return(AVIERR_AVI_STRUCT_BAD);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_WRITING || avi->ODMLmode == STRICT_LEGACY)
+        return(avi->AVIerr = AVIERR_WRONG_FILE_MODE);
+
+    if (avi->Async || avi->PendingBuf)   // a chunk is on its way
+        return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
+
+    if (Size != 0 && (Size < MIN_SEGMENT_SIZE || Size > AVI_MAX_RIFF_SIZE))
+        return(avi->AVIerr = AVIERR_BAD_PARAMETER);
+
+    avi->SegmentSize = Size;
+    return(0);
+}
+
+
+// Make the data of every video frame start on a file position that is
+// a multiple of Align, so readers can use O_DIRECT or page aligned
+// memory maps on the frames.  The space in front of a frame is filled
+// with a 'JUNK' chunk, which players skip.  Align must be a power of
+// 2 from 4 up to MAX_CHUNK_ALIGN, or 0 to only keep chunks on even
+// positions as usual.  Audio chunks are not aligned.
+// Returns 0 if OK, else error code.
+
+int AVI_SetChunkAlign(AVI2 *avi, DWORD Align)
+{
+    if (!avi)
+        return(AVIERR_AVI_STRUCT_BAD);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_WRITING)
+        return(avi->AVIerr = AVIERR_WRONG_FILE_MODE);
+
+    if (avi->Async || avi->PendingBuf)   // a chunk is on its way
+        return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
+
+    if (Align != 0 && (Align < 4 || Align > MAX_CHUNK_ALIGN || (Align & (Align - 1))))
+        return(avi->AVIerr = AVIERR_BAD_PARAMETER);
+
+    avi->ChunkAlign = Align;
+    return(0);
+}
+
+
+// Reserve disk space ahead of the write position so that a long
+// recording is laid out in a few large extents instead of growing a
+// frame at a time.  Size is the expected size of the whole file.
+// Space is reserved PREALLOC_STEP bytes at a time as the file grows,
+// but never past Size.  What is not used is given back when the file
+// is closed.  A Size of 0 stops reserving more.  Returns 0 if OK,
+// else error code.  AVIERR_NOT_SUPPORTED means the system or file
+// system can't reserve space, and the file is written normally.
+
+int AVI_SetExpectedSize(AVI2 *avi, QWORD Size)
+{
+    int ret;
+
+    if (!avi)
+        return(AVIERR_AVI_STRUCT_BAD);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_WRITING)
+        return(avi->AVIerr = AVIERR_WRONG_FILE_MODE);
+
+    if (avi->Async || avi->PendingBuf)   // a chunk is on its way
+        return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
+
+    avi->ExpectedSize = Size;
+    if (Size == 0)
+        return(0);
+
+    // Reserve the first step now so a problem shows up here
+    ret = Preallocate(avi, 0);
+    if (ret)
+    {
+        avi->ExpectedSize = 0;
+        return(avi->AVIerr = ret);
+    }
+
+    return(0);
+}
+
+
+// Reserve the next PREALLOC_STEP of disk space if the chunk of len
+// bytes about to be written would pass what is reserved.  Nothing is
+// reserved past ExpectedSize.  Returns 0 if OK, else error code.
+
+static int Preallocate(AVI2 *avi, DWORD len)
+{
+    QWORD need, end;
+    int ret;
+
+    if (avi->PreallocEnd >= avi->ExpectedSize)
+        return(0);   // off, or all of it is reserved
+
+    // End of the chunk with its header, pad and alignment
+    need = File64GetBase(avi->fp) + File64GetPos(avi->fp) + 8 + len + 1 +
+           avi->ChunkAlign + 8;
+    if (need <= avi->PreallocEnd)
+        return(0);
+
+    end = need + PREALLOC_STEP;
+    if (end > avi->ExpectedSize)
+        end = avi->ExpectedSize;
+
+    ret = File64Allocate(avi->fp, avi->PreallocEnd, end - avi->PreallocEnd);
+    if (ret)
+    {
+        avi->ExpectedSize = 0;   // stop trying
+        return(ret);
+    }
+    avi->PreallocEnd = end;
+
+    return(0);
+}
+
+
+// Write a 'JUNK' chunk if needed so that the data of the next chunk
+// starts on a multiple of ChunkAlign in the file.  Returns 0 if OK,
+// else error code.
+
+static int WriteAlignJunk(AVI2 *avi)
+{
+    BYTE zeros[512];
+    QWORD pos;
+    DWORD pad, n;
+
+    if (avi->ChunkAlign == 0)
+        return(0);
+
+    // Where the data would start after the 8 byte chunk header
+    pos = File64GetBase(avi->fp) + File64GetPos(avi->fp) + 8;
+    pad = (DWORD)((avi->ChunkAlign - pos % avi->ChunkAlign) % avi->ChunkAlign);
+    if (pad == 0)
+        return(0);
+    if (pad < 8)   // JUNK needs room for its own header
+        pad += avi->ChunkAlign;
+
+    // Chunks are on even positions, so pad is even and JUNK needs no pad byte
+    WriteFCC(avi->fp, 'JUNK', 0);
+    WriteDWORD(avi->fp, pad - 8);
+
+    memset(zeros, 0, sizeof(zeros));
+    for (pad -= 8; pad > 0; pad -= n)
+    {
+        n = (pad < sizeof(zeros)) ? pad : sizeof(zeros);
+        if (File64Write(avi->fp, zeros, n) != n)
+            return(AVIERR_CANT_WRITE_FILE);
+    }
+
+    return(0);
+}
+
+
+// This function is called by the user to set the basic video parameters
 // when creating an AVI file.  It must be called after opening the file
 // in FOR_WRITING mode. The 4cc codec is fixed so multicharacter literals work.
 // The IsODML boolean flag forces the file type.  If false, and the file
@@ -966,9 +1649,6 @@ int AddIndexEntry(AVI2 *avi, INDEX_ROOT *rt, DWORD len, DWORD Key)
 int AVI_SetVideo(AVI2 *avi, char *name, DWORD width, DWORD height,
                  double fps, FOURCC codec)
 {
-    BYTE filler[2048];
-
-
     if (!avi)
         return(AVIERR_AVI_STRUCT_BAD);
 
@@ -983,7 +1663,7 @@ int AVI_SetVideo(AVI2 *avi, char *name, DWORD width, DWORD height,
             return(avi->AVIerr = AVIERR_BAD_PARAMETER);
 
     // This function should not be called after chunks already added
-    if (avi->VidRt.index_entries + avi->AudRt.index_entries != 0)
+    if (avi->VidRt.index_entries + avi->AudRt.index_entries != 0 || avi->Async)
         return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
 
 
@@ -1000,8 +1680,7 @@ int AVI_SetVideo(AVI2 *avi, char *name, DWORD width, DWORD height,
     if (avi->ODMLmode != STRICT_LEGACY)
     {
         // Reserve additional space for video superindex
-        memset(filler, 0, sizeof(filler));
-        File64Write(avi->fp, filler, sizeof(filler));
+        ReserveSuperIndex(avi);
     }
 
     return(0);
@@ -1010,18 +1689,227 @@ int AVI_SetVideo(AVI2 *avi, char *name, DWORD width, DWORD height,
 
 
 
+// The write-behind thread.  It writes the queued chunks in order
+// until the queue is empty and it has been told to stop.  After an
+// error, the rest of the queue is thrown away.
+
+#if !defined(AVI_NO_THREADS)
+static void AsyncWriter(void *arg)
+{
+    AVI2 *avi = (AVI2 *) arg;
+    ASYNC_WRITER *aw = avi->Async;
+    WRITE_JOB *job;
+    AVI_IOVEC iov;
+    DWORD Count;
+    int Stop, err;
+
+    for (;;)
+    {
+        MutexLock(aw->Lock);
+        Count = aw->Count;
+        Stop = aw->Stop;
+        err = aw->Err;
+        MutexUnlock(aw->Lock);
+
+        if (Count == 0)
+        {
+            if (Stop) break;
+            EventWait(aw->Wake);
+            continue;
+        }
+
+        // The job at Head is not touched by the caller until Count drops
+        job = &aw->Jobs[aw->Head];
+        if (err == AVIERR_NO_ERROR)
+        {
+            iov.Buf = job->Buf;
+            iov.Len = job->Len;
+            if (job->Audio)
+                err = WriteAframeNow(avi, job->Buf, job->Len);
+            else
+                err = WriteVframeNow(avi, &iov, 1, job->Len, job->Key);
+        }
+        free(job->Buf);
+        job->Buf = NULL;
+
+        MutexLock(aw->Lock);
+        if (aw->Err == AVIERR_NO_ERROR)
+            aw->Err = err;
+        aw->Head = (aw->Head + 1) % aw->QueueLen;
+        aw->Count--;
+        MutexUnlock(aw->Lock);
+    }
+}
+#endif
+
+
+// Copy a chunk that is in iovcnt pieces adding up to len bytes into
+// the write-behind queue.  This never waits for the disk.  Returns 0
+// if queued, AVIERR_QUEUE_FULL if there is no room so the chunk is
+// not written, or an earlier write error.
+
+static int QueueChunk(AVI2 *avi, AVI_IOVEC *iov, int iovcnt, DWORD len,
+                      int Audio, int Key)
+{
+    ASYNC_WRITER *aw = avi->Async;
+    WRITE_JOB *job;
+    BYTE *copy;
+    DWORD pos;
+    int err, i;
+
+    MutexLock(aw->Lock);
+    err = aw->Err;
+    if (err == AVIERR_NO_ERROR && aw->Count >= aw->QueueLen)
+        err = AVIERR_QUEUE_FULL;
+    MutexUnlock(aw->Lock);
+    if (err)
+        return(err);
+
+    // Only this thread adds jobs, so the free slot stays free
+    copy = (BYTE *) malloc(len);
+    if (!copy)
+        return(AVIERR_MALLOC);
+    for (i = 0, pos = 0; i < iovcnt; pos += iov[i++].Len)
+        memcpy(copy + pos, iov[i].Buf, iov[i].Len);
+
+    MutexLock(aw->Lock);
+    job = &aw->Jobs[(aw->Head + aw->Count) % aw->QueueLen];
+    job->Buf = copy;
+    job->Len = len;
+    job->Audio = Audio;
+    job->Key = Key;
+    aw->Count++;
+    MutexUnlock(aw->Lock);
+
+    EventSignal(aw->Wake);
+    return(AVIERR_NO_ERROR);
+}
+
+
+// Write everything still queued, stop the write-behind thread and
+// free the queue.  Returns the first error the thread had, else 0.
+
+static int StopAsyncWrite(AVI2 *avi)
+{
+    ASYNC_WRITER *aw = avi->Async;
+    int err;
+
+    if (!aw)
+        return(AVIERR_NO_ERROR);
+
+    MutexLock(aw->Lock);
+    aw->Stop = TRUE;
+    MutexUnlock(aw->Lock);
+    EventSignal(aw->Wake);
+    ThreadJoin(aw->Thread);
+
+    err = aw->Err;
+    EventDestroy(aw->Wake);
+    MutexDestroy(aw->Lock);
+    free(aw->Jobs);
+    free(aw);
+    avi->Async = NULL;
+
+    return(err);
+}
+
+
+// Turn write-behind on or off for a file opened FOR_WRITING.  With
+// it on, AVI_WriteVframe() and AVI_WriteAframe() copy the chunk into
+// a queue of QueueLen chunks and return at once.  A thread writes the
+// chunks, adds the index entries and starts new RIFF segments.  If
+// the queue is full, the chunk is not written and AVIERR_QUEUE_FULL
+// is returned, so the caller never waits on the disk and can decide
+// to drop or retry the chunk.  A write error in the thread is
+// returned by the next write call and by AVI_Close().
+// AVI_SetVideo() and AVI_SetAudio() must be called first.  A
+// QueueLen of 0 writes what is queued and turns write-behind off.
+// AVI_Close() does the same.  Returns 0 if OK, else error code.
+
+int AVI_SetAsyncWrite(AVI2 *avi, DWORD QueueLen)
+{
+#if !defined(AVI_NO_THREADS)
+    ASYNC_WRITER *aw;
+#endif
+
+    if (!avi)
+        return(AVIERR_AVI_STRUCT_BAD);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_WRITING)
+        return(avi->AVIerr = AVIERR_WRONG_FILE_MODE);
+
+    if (avi->PendingBuf)   // finish the AVI_BeginVframe() first
+        return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
+
+    // A running queue is always drained first, even to resize it
+    avi->AVIerr = StopAsyncWrite(avi);
+    if (avi->AVIerr || QueueLen == 0)
+        return(avi->AVIerr);
+
+#if defined(AVI_NO_THREADS)
+    return(avi->AVIerr = AVIERR_NOT_SUPPORTED);
+#else
+    if (!avi->has_video)
+        return(avi->AVIerr = AVIERR_MISSING_VIDEO);
+
+    aw = (ASYNC_WRITER *) calloc(1, sizeof(ASYNC_WRITER));
+    if (!aw)
+        return(avi->AVIerr = AVIERR_MALLOC);
+
+    aw->QueueLen = QueueLen;
+    aw->Jobs = (WRITE_JOB *) calloc(QueueLen, sizeof(WRITE_JOB));
+    aw->Lock = MutexCreate();
+    aw->Wake = EventCreate();
+    if (aw->Jobs && aw->Lock && aw->Wake)
+    {
+        avi->Async = aw;
+        aw->Thread = ThreadCreate(AsyncWriter, avi);
+        if (aw->Thread)
+            return(AVIERR_NO_ERROR);
+        avi->Async = NULL;
+    }
+
+    EventDestroy(aw->Wake);
+    MutexDestroy(aw->Lock);
+    free(aw->Jobs);
+    free(aw);
+    return(avi->AVIerr = AVIERR_MALLOC);
+#endif
+}
+
+
+// Return the number of chunks in the write-behind queue that have
+// not been written yet, or 0 if write-behind is off.
+
+DWORD AVI_GetWriteQueueDepth(AVI2 *avi)
+{
+    DWORD Count;
+
+    if (!avi || !avi->Async)
+        return(0);
+
+    MutexLock(avi->Async->Lock);
+    Count = avi->Async->Count;
+    MutexUnlock(avi->Async->Lock);
+
+    return(Count);
+}
+
+
 // Write a video frame to the file.
 // VidBuf contains a buffer of video data exactly how it is to be
 // written to the file.  Len is the length of the data in that buffer.
 // If keyframe is true, the frame is marked as such in the index.
 // This function does not do any compression.  It will also cause
-// an associated index buffer to be written.
+// an associated index buffer to be written.  With AVI_SetAsyncWrite(),
+// the frame is copied into the write-behind queue instead.
 // Returns 0 if len buffer bytes were written, else error code.
 
 int AVI_WriteVframe(AVI2 *avi, BYTE *VidBuf, DWORD len, int keyframe)
 {
-//    DWORD offset;
-    int ret;
+    AVI_IOVEC iov;
 
 
     if (!avi)
@@ -1035,16 +1923,90 @@ int AVI_WriteVframe(AVI2 *avi, BYTE *VidBuf, DWORD len, int keyframe)
     if (!avi->has_video)
         return(avi->AVIerr = AVIERR_MISSING_VIDEO);
 
+    if (avi->PendingBuf)   // inside AVI_BeginVframe()/AVI_CommitVframe()
+        return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
+
     if (!VidBuf || len == 0)
         return(avi->AVIerr = AVIERR_BAD_PARAMETER);
 
+    iov.Buf = VidBuf;
+    iov.Len = len;
+
+    if (avi->Async)
+        return(avi->AVIerr = QueueChunk(avi, &iov, 1, len, FALSE, keyframe));
+
+    return(avi->AVIerr = WriteVframeNow(avi, &iov, 1, len, keyframe));
+}
+
+
+// Write a video frame that is in iovcnt separate pieces, such as a
+// shared MJPEG header and the scan data of each frame.  The pieces
+// are written one after the other as a single chunk, the same as if
+// they had been copied together and given to AVI_WriteVframe(), but
+// without the copy.  Up to AVI_MAX_IOV pieces can be given.  Pieces
+// of 0 bytes are allowed as long as the frame is not empty.
+// Returns 0 if OK, else error code.
+
+int AVI_WriteVframev(AVI2 *avi, AVI_IOVEC *iov, int iovcnt, int keyframe)
+{
+    DWORD len = 0;
+    int i;
+
+    if (!avi)
+        return(AVIERR_AVI_STRUCT_BAD);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_WRITING)
+        return(avi->AVIerr = AVIERR_WRONG_FILE_MODE);
+
+    if (!avi->has_video)
+        return(avi->AVIerr = AVIERR_MISSING_VIDEO);
+
+    if (avi->PendingBuf)   // inside AVI_BeginVframe()/AVI_CommitVframe()
+        return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
+
+    if (!iov || iovcnt <= 0 || iovcnt > AVI_MAX_IOV)
+        return(avi->AVIerr = AVIERR_BAD_PARAMETER);
+
+    for (i = 0; i < iovcnt; i++)
+    {
+        if ((!iov[i].Buf && iov[i].Len) || iov[i].Len > 0x7FFFFFFF - len)
+            return(avi->AVIerr = AVIERR_BAD_PARAMETER);
+        len += iov[i].Len;
+    }
+    if (len == 0)
+        return(avi->AVIerr = AVIERR_BAD_PARAMETER);
+
+    if (avi->Async)
+        return(avi->AVIerr = QueueChunk(avi, iov, iovcnt, len, FALSE, keyframe));
+
+    return(avi->AVIerr = WriteVframeNow(avi, iov, iovcnt, len, keyframe));
+}
+
+
+// Write a video chunk and its index entry to the file, starting a
+// new RIFF segment first if needed.  The frame is in iovcnt pieces
+// that add up to len bytes.  The caller checks the parameters.
+// This also runs on the write-behind thread, so neither it nor
+// anything it calls may change AVIerr.  The caller sets it.
+// Returns 0 if OK, else error code.
+
+static int WriteVframeNow(AVI2 *avi, AVI_IOVEC *iov, int iovcnt, DWORD len, int keyframe)
+{
+    AVI_IOVEC vec[AVI_MAX_IOV + 2];
+    DWORD hdr[2];
+    BYTE pad = 0;
+    QWORD pos;
+    int ret, i, n;
+
     // Check legacy 2GB limit
     if (!CheckFileLimit(avi, len))
     {
         if (avi->ODMLmode != STRICT_LEGACY)
         {
             // File would be > 1GB for ODML
-            ret = CloseCurrentRIFFSegment(avi);
+            ret = CloseCurrentRIFFSegment(avi, TRUE);
             if (ret != 0)
                 return ret;
             ret = StartNewRIFFSegment(avi);
@@ -1057,25 +2019,50 @@ int AVI_WriteVframe(AVI2 *avi, BYTE *VidBuf, DWORD len, int keyframe)
     }
 
     if (avi->movi_start == 0)   // start the movi LIST
-        BeginMovi(avi);
-
-    // Write video chunk header first
-    WriteFCC(avi->fp, '##dc', 0);
-    WriteDWORD(avi->fp, len);
+    {
+        ret = BeginMovi(avi);
+        if (ret != 0)
+            return ret;
+    }
 
-    // Add index entry to point to movi data
-    ret = AddIndexEntry(avi, &avi->VidRt, len, keyframe);
-    if (ret)
+    ret = WriteAlignJunk(avi);
+    if (ret != 0)
         return ret;
 
-    // write movi data    
-    File64Write(avi->fp, VidBuf, len);
-    avi->num_video_frames++;
+    Preallocate(avi, len);   // the file is still good without it
 
+    // The index entry points to movi data, just past the chunk header
+    pos = File64GetPos(avi->fp) + 8;
+
+    // The chunk header, the pieces of the frame and the pad byte
+    // go to the file in one gather write.
+    hdr[0] = FIX_LIT('00dc');   // '##dc' for stream 0
+    hdr[1] = len;
+    vec[0].Buf = (BYTE *) hdr;
+    vec[0].Len = sizeof(hdr);
+    for (i = 0, n = 1; i < iovcnt; i++)
+        vec[n++] = iov[i];
 
     // Pad after writing buffer - not included in LEN
     if (NEED_PAD_EVEN(len))
-        File64Putchar(avi->fp, 0);
+    {
+        vec[n].Buf = &pad;
+        vec[n++].Len = 1;
+    }
+
+    // Make room for the index entry before the frame goes out, and
+    // a frame that didn't make it to the file gets no index entry.
+    ret = ReserveChainEntry(avi, &avi->VidRt, len);
+    if (ret)
+        return ret;
+    if (File64Writev(avi->fp, vec, n) != 8 + len + NEED_PAD_EVEN(len))
+        return(AVIERR_CANT_WRITE_FILE);
+
+    ret = AddChainEntry(avi, &avi->VidRt, pos, len, keyframe);
+    if (ret)
+        return ret;
+
+    avi->num_video_frames++;
 
     // Track max frame size
     if ((DWORD) len > avi->max_video_frame_size)
@@ -1092,9 +2079,6 @@ int AVI_WriteVframe(AVI2 *avi, BYTE *VidBuf, DWORD len, int keyframe)
 int AVI_SetAudio(AVI2 *avi, char *name, int NumChannels, long SamplesPerSecond,
                  long BitsPerSample, long codec)
 {
-    BYTE filler[2048];
-
-
     if (!avi)
         return(AVIERR_AVI_STRUCT_BAD);
 
@@ -1116,7 +2100,7 @@ int AVI_SetAudio(AVI2 *avi, char *name, int NumChannels, long SamplesPerSecond,
         return(avi->AVIerr = AVIERR_MISSING_VIDEO);
 
     // This function should not be called after chunks already added
-    if (avi->VidRt.index_entries + avi->AudRt.index_entries != 0)
+    if (avi->VidRt.index_entries + avi->AudRt.index_entries != 0 || avi->Async)
         return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
 
     avi->Aud.nChannels = (WORD)NumChannels;
@@ -1135,24 +2119,214 @@ int AVI_SetAudio(AVI2 *avi, char *name, int NumChannels, long SamplesPerSecond,
 
     // Reserve additional space for audio superindex
     if (avi->ODMLmode != STRICT_LEGACY)
+        ReserveSuperIndex(avi);
+
+    return(0);
+}
+
+
+// Start a video frame that the encoder builds in place.  Returns a
+// buffer of maxlen bytes for the frame, or NULL on error with the
+// error code in avi->AVIerr.  The frame is written by
+// AVI_CommitVframe(), which must come before any other write call.
+// When the write buffer has room, the returned buffer is inside it
+// just past space for the chunk header, so the frame goes from the
+// encoder to the disk without being copied.  The RIFF segment is
+// chosen here for maxlen bytes.  Otherwise, such as with write-behind
+// or a frame bigger than the write buffer, a separate buffer is
+// given and the frame is written from it at commit time.
+
+BYTE *AVI_BeginVframe(AVI2 *avi, DWORD maxlen)
+{
+    BYTE *buf;
+    DWORD need;
+    int ret;
+
+    if (!avi)
+        return(NULL);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (avi->filemode != FOR_WRITING)
     {
-        memset(filler, 0, sizeof(filler));
-        File64Write(avi->fp, filler, sizeof(filler));
+        avi->AVIerr = AVIERR_WRONG_FILE_MODE;
+        return(NULL);
     }
 
-    return(0);
+    if (!avi->has_video)
+    {
+        avi->AVIerr = AVIERR_MISSING_VIDEO;
+        return(NULL);
+    }
+
+    if (avi->PendingBuf)   // last one was never committed
+    {
+        avi->AVIerr = AVIERR_FUNCTION_ORDER;
+        return(NULL);
+    }
+
+    if (maxlen == 0 || maxlen > 0x7FFFFFFF - 9)
+    {
+        avi->AVIerr = AVIERR_BAD_PARAMETER;
+        return(NULL);
+    }
+
+    need = 8 + maxlen + NEED_PAD_EVEN(maxlen);   // header, data and pad
+    buf = NULL;
+
+    if (!avi->Async && File64Reserve(avi->fp, need))
+    {
+        // Same start as WriteVframeNow() so the chunk lands here
+        if (!CheckFileLimit(avi, maxlen))
+        {
+            if (avi->ODMLmode != STRICT_LEGACY)
+            {
+                ret = CloseCurrentRIFFSegment(avi, TRUE);
+                if (ret == 0)
+                    ret = StartNewRIFFSegment(avi);
+                if (ret != 0)
+                {
+                    avi->AVIerr = ret;
+                    return(NULL);
+                }
+                buf = File64Reserve(avi->fp, need);
+            }
+            // else legacy 2GB limit, so the commit drops the frame
+        }
+        else
+            buf = File64Reserve(avi->fp, need);
+
+        if (buf)
+        {
+            ret = 0;
+            if (avi->movi_start == 0)   // start the movi LIST
+                ret = BeginMovi(avi);
+            if (ret == 0)
+                ret = WriteAlignJunk(avi);
+            if (ret != 0)
+            {
+                avi->AVIerr = ret;
+                return(NULL);
+            }
+            Preallocate(avi, maxlen);
+            buf = File64Reserve(avi->fp, need);
+        }
+    }
+
+    if (buf)
+        buf += 8;   // room for the chunk header
+    else
+    {
+        // Fall back to a separate buffer that is kept for the next frame
+        if (maxlen > avi->StageSize)
+        {
+            free(avi->StageBuf);
+            avi->StageSize = 0;
+            avi->StageBuf = (BYTE *) malloc(maxlen);
+            if (!avi->StageBuf)
+            {
+                avi->AVIerr = AVIERR_MALLOC;
+                return(NULL);
+            }
+            avi->StageSize = maxlen;
+        }
+        buf = avi->StageBuf;
+    }
+
+    avi->PendingBuf = buf;
+    avi->PendingMax = maxlen;
+
+    return(buf);
+}
+
+
+// Finish the frame started with AVI_BeginVframe().  len is the number
+// of bytes the encoder put in the buffer and must not be more than
+// the maxlen given there.  The chunk header and index entry are filled
+// in for len.  A len of 0 throws the frame away.  With write-behind,
+// a full queue returns AVIERR_QUEUE_FULL and leaves the frame pending,
+// so this can be called again or the frame thrown away.
+// Returns 0 if OK, else error code.
+
+int AVI_CommitVframe(AVI2 *avi, DWORD len, int keyframe)
+{
+    AVI_IOVEC iov;
+    DWORD hdr[2];
+    BYTE *buf;
+    QWORD pos;
+    int ret;
+
+    if (!avi)
+        return(AVIERR_AVI_STRUCT_BAD);
+
+    avi->AVIerr = AVIERR_NO_ERROR;
+
+    if (!avi->PendingBuf)
+        return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
+
+    if (len > avi->PendingMax)
+        return(avi->AVIerr = AVIERR_BAD_PARAMETER);
+
+    buf = avi->PendingBuf;
+    avi->PendingBuf = NULL;   // done with it either way
+    if (len == 0)
+        return(AVIERR_NO_ERROR);
+
+    if (buf == avi->StageBuf)
+    {
+        iov.Buf = buf;
+        iov.Len = len;
+        if (!avi->Async)
+            return(avi->AVIerr = WriteVframeNow(avi, &iov, 1, len, keyframe));
+
+        ret = QueueChunk(avi, &iov, 1, len, FALSE, keyframe);
+        if (ret == AVIERR_QUEUE_FULL)   // still pending so it can be tried again
+            avi->PendingBuf = buf;
+        return(avi->AVIerr = ret);
+    }
+
+    // The frame is already in the write buffer just past its header
+    pos = File64GetPos(avi->fp) + 8;
+
+    hdr[0] = FIX_LIT('00dc');   // '##dc' for stream 0
+    hdr[1] = len;
+    memcpy(buf - 8, hdr, sizeof(hdr));
+    if (NEED_PAD_EVEN(len))
+        buf[len] = 0;
+
+    // Make room for the index entry before the frame is committed
+    // to the file, so it can't end up there without one.
+    ret = ReserveChainEntry(avi, &avi->VidRt, len);
+    if (ret)
+        return(avi->AVIerr = ret);
+
+    ret = File64Commit(avi->fp, 8 + len + NEED_PAD_EVEN(len));
+    if (ret)
+        return(avi->AVIerr = ret);
+
+    ret = AddChainEntry(avi, &avi->VidRt, pos, len, keyframe);
+    if (ret)
+        return(avi->AVIerr = ret);
+
+    avi->num_video_frames++;
+
+    // Track max frame size
+    if (len > avi->max_video_frame_size)
+        avi->max_video_frame_size = len;
+
+    return(avi->AVIerr = ret);
 }
 
 
 // Write an audio chunk to the file.
 // This function will create an audio stream chunk, write NumBytes
 // of AudioBuf to the file and also create the applicable indexes.
+// With AVI_SetAsyncWrite(), the chunk is queued like a video frame.
 // Return 0 if written OK, else error code.
 
 int AVI_WriteAframe(AVI2 *avi, BYTE *AudBuf, DWORD len)
 {
 //    DWORD offset;
-    int ret;
 
 
     if (!avi)
@@ -1166,16 +2340,41 @@ int AVI_WriteAframe(AVI2 *avi, BYTE *AudBuf, DWORD len)
     if (!avi->has_video || !avi->has_audio)
         return(avi->AVIerr = AVIERR_MISSING_VIDEO);
 
+    if (avi->PendingBuf)   // inside AVI_BeginVframe()/AVI_CommitVframe()
+        return(avi->AVIerr = AVIERR_FUNCTION_ORDER);
+
     if (!AudBuf || !len)
         return(avi->AVIerr = AVIERR_BAD_PARAMETER);
 
+    if (avi->Async)
+    {
+        AVI_IOVEC iov;
+
+        iov.Buf = AudBuf;
+        iov.Len = len;
+        return(avi->AVIerr = QueueChunk(avi, &iov, 1, len, TRUE, TRUE));
+    }
+
+    return(avi->AVIerr = WriteAframeNow(avi, AudBuf, len));
+}
+
+
+// Write an audio chunk and its index entry to the file, starting a
+// new RIFF segment first if needed.  The caller checks the parameters.
+// Like WriteVframeNow(), AVIerr is not changed.
+// Returns 0 if OK, else error code.
+
+static int WriteAframeNow(AVI2 *avi, BYTE *AudBuf, DWORD len)
+{
+    int ret;
+
     // Check legacy 2GB limit
     if (!CheckFileLimit(avi, len))
     {
         if (avi->ODMLmode != STRICT_LEGACY)
         {
             // File would be > 1GB for ODML
-            ret = CloseCurrentRIFFSegment(avi);
+            ret = CloseCurrentRIFFSegment(avi, TRUE);
             if (ret != 0)
                 return ret;
             ret = StartNewRIFFSegment(avi);
@@ -1188,8 +2387,13 @@ int AVI_WriteAframe(AVI2 *avi, BYTE *AudBuf, DWORD len)
     }
 
     if (avi->movi_start == 0)   // start the movi LIST
-        BeginMovi(avi);
+    {
+        ret = BeginMovi(avi);
+        if (ret != 0)
+            return ret;
+    }
 
+    Preallocate(avi, len);   // the file is still good without it
 
     // Write audio chunk header first
     WriteFCC(avi->fp, '##wb', 0);
@@ -21,8 +21,13 @@ used by others.
 
 #define _FILE_OFFSET_BITS 64
 #define _LARGEFILE64_SOURCE 1
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE 1    // for O_DIRECT
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 // Platform-specific includes
 #if defined(__BORLANDC__)
@@ -30,16 +35,19 @@ used by others.
     #define USE_WINDOWS_FILE_IO
     #include <windows.h>
     #include <io.h>
+    #include <fcntl.h>
     typedef unsigned __int64 QWORD;     // different
 
     #define FIX_LIT(n) (n)
 
 
 #elif defined(_WIN32)
+    #include <windows.h>     // needed for memory mapped files
     #include <sys/types.h>
     #include <sys/stat.h>
     #include <stdint.h>
     #include <io.h>
+    #include <fcntl.h>
 
     #ifdef _MSC_VER
         // Disable "deprecated" warnings for fopen, etc.
@@ -55,12 +63,17 @@ used by others.
         typedef uint32_t FOURCC;
         typedef int32_t  LONG;
         typedef uint8_t  BYTE;
+    #else
+        typedef uint64_t QWORD;   // windows.h does not have this one
     #endif
 #else
     // Linux/Unix - use POSIX functions
     #include <unistd.h>
     #include <sys/types.h>
     #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+    #include <fcntl.h>
     #include <stdint.h>
     typedef uint64_t QWORD;
     typedef uint32_t DWORD;
@@ -68,6 +81,22 @@ used by others.
     typedef int32_t  LONG;
     typedef uint8_t  BYTE;
 
+    // File times in nanoseconds where the stat structure has them
+    #if defined(__APPLE__)
+        #define MTIME_NS(st) ((QWORD)(st).st_mtimespec.tv_sec * 1000000000 + \
+                              (QWORD)(st).st_mtimespec.tv_nsec)
+        #define CTIME_NS(st) ((QWORD)(st).st_ctimespec.tv_sec * 1000000000 + \
+                              (QWORD)(st).st_ctimespec.tv_nsec)
+    #elif defined(__linux__) || (defined(_POSIX_VERSION) && _POSIX_VERSION >= 200809L)
+        #define MTIME_NS(st) ((QWORD)(st).st_mtim.tv_sec * 1000000000 + \
+                              (QWORD)(st).st_mtim.tv_nsec)
+        #define CTIME_NS(st) ((QWORD)(st).st_ctim.tv_sec * 1000000000 + \
+                              (QWORD)(st).st_ctim.tv_nsec)
+    #else
+        #define MTIME_NS(st) ((QWORD)(st).st_mtime)
+        #define CTIME_NS(st) ((QWORD)(st).st_ctime)
+    #endif
+
 #endif
 
 
@@ -98,6 +127,11 @@ used by others.
     #define FILE64_FWRITE(b,s,c,f) fwrite(b, s, c, f)
 #endif
 
+// O_DIRECT writes need 64 bit offsets and a POSIX system that has it
+#if defined(O_DIRECT) && !defined(NO_HUGE_FILES) && !defined(_WIN32)
+    #define FILE64_DIRECT
+#endif
+
 
 
 
@@ -105,27 +139,119 @@ used by others.
 enum errvals
 {
     AVIERR_NO_ERROR=0,
+    AVIERR_CANT_WRITE_FILE=4,
+    AVIERR_MALLOC=13,
+    AVIERR_NOT_SUPPORTED=15,
     AVIERR_BAD_PARAMETER=17,
 };
+
+
+#define WBUF_ALIGN  4096   // Write buffer sizes are a multiple of this
+
+#ifndef TRUE
+    #define TRUE  1
+    #define FALSE 0
+#endif
+#define WRITEV_MAX  64     // Most buffers given to one writev() call
+
+
+// The structures shared with avi2.h must be byte aligned like it does
+#ifdef __GNUC__
+    #pragma pack(push, 1)
+#elif defined(__BORLANDC__)
+    #pragma option -a1
+#endif
 
 
+// This must be kept the same as the MFILE in avi2.h
 typedef struct
 {
     FILE *fp;
     QWORD SeekBase;   // Base File Pointer
+    BYTE *MapPtr;     // Memory mapped file image or NULL if not mapped
+    QWORD MapSize;    // Number of bytes mapped
+    QWORD MapPos;     // Current file position when mapped
+    void *hMap;       // Windows file mapping handle
+    char *Name;       // File name as opened
+    BYTE *WBuf;       // Write buffer or NULL if writes are not buffered
+    DWORD WBufSize;   // Size of WBuf
+    DWORD WBufLen;    // Number of bytes waiting in WBuf
+    QWORD WBufPos;    // Absolute file position of WBuf[0]
+    void *Direct;     // O_DIRECT writer state or NULL
 } MFILE;
 
 
+// This must be kept the same as the AVI_IOVEC in avi2.h
+typedef struct
+{
+    BYTE *Buf;        // start of a piece of data
+    DWORD Len;        // number of bytes in the piece
+} AVI_IOVEC;
+
+#ifdef __GNUC__
+    #pragma pack(pop)
+#elif defined(__BORLANDC__)
+    #pragma option -a.
+#endif
+
+
+#if defined(FILE64_DIRECT)
+// State of a file written with O_DIRECT.  There are two staging
+// buffers.  WBuf is in one of them while the whole blocks of the
+// other one are being written by a thread.  O_DIRECT wants the
+// memory, file position and length of each write aligned, so WBuf
+// starts at the same offset in its block as WBufPos does in the file.
+typedef struct
+{
+    int   fd;         // descriptor opened with O_DIRECT
+    BYTE *Buf[2];     // WBUF_ALIGN aligned staging buffers
+    int   Cur;        // the buffer WBuf is in
+    void *Thread;     // writer thread or NULL to write in line
+    void *Go;         // signaled when IoBuf is ready to write
+    void *Done;       // signaled when IoBuf has been written
+    int   Busy;       // TRUE while the thread has IoBuf
+    int   Quit;       // tells the thread to end
+    BYTE *IoBuf;      // whole blocks for the thread to write
+    DWORD IoLen;      // number of bytes at IoBuf
+    QWORD IoPos;      // file position for IoBuf
+    int   IoErr;      // first write error not yet reported
+} DIRECT_WRITER;
+
+// From avi2_thread.c
+void *EventCreate(void);
+void  EventSignal(void *event);
+void  EventWait(void *event);
+void  EventDestroy(void *event);
+void *ThreadCreate(void (*Func)(void *), void *Arg);
+void  ThreadJoin(void *thread);
+#endif
+
+
 
 // Exported functions
 void File64SetBase(MFILE *fp, QWORD NewBase);
 QWORD File64GetBase(MFILE *fp);
 MFILE *File64Open(char *fname, char *mode);
+MFILE *File64Dup(MFILE *mfp, int Write);
+int  File64Map(MFILE *mfp);
+int  File64Stat(MFILE *mfp, QWORD *Size, QWORD *MTime, QWORD *CTime, QWORD *FileId);
+BYTE *File64MapPtr(MFILE *mfp, QWORD AbsAddr, DWORD len);
 int  File64Close(MFILE *mfp);
+int  File64SetWriteBuffer(MFILE *mfp, DWORD Size);
+int  File64SetDirect(MFILE *mfp);
+int  File64Flush(MFILE *mfp);
 size_t File64Read(MFILE *mfp, void *buffer, int len);
 size_t File64Write(MFILE *mfp, void *buffer, int len);
+size_t File64Writev(MFILE *mfp, AVI_IOVEC *vec, int Count);
+BYTE  *File64Reserve(MFILE *mfp, DWORD len);
+int    File64Commit(MFILE *mfp, DWORD len);
+size_t File64PRead(MFILE *mfp, void *buffer, DWORD len, QWORD AbsAddr);
+size_t File64PWrite(MFILE *mfp, void *buffer, DWORD len, QWORD AbsAddr);
+int    File64Allocate(MFILE *mfp, QWORD Offset, QWORD Len);
+int    File64Truncate(MFILE *mfp, QWORD Size);
 int File64Qseek(MFILE *mfp, QWORD AbsAddr);
 int File64QseekFrom(MFILE *mfp, QWORD AbsAddr, int whence);
+QWORD File64Qtell(MFILE *fp);
 int File64SetPos(MFILE *mfp, LONG offset, int whence);
 DWORD File64GetPos(MFILE *mfp);
 BYTE File64Getchar(MFILE *mfp);
@@ -133,6 +259,9 @@ BYTE File64Putchar(MFILE *mfp, BYTE ch);
 FOURCC ReadFCC(MFILE *in, int *StreamNum);
 int WriteFCC(MFILE *out, FOURCC fccval, int StreamNum);
 
+static QWORD File64RawTell(MFILE *fp);
+static int File64RawSeek(MFILE *mfp, QWORD AbsAddr, int whence);
+
 
 
 
@@ -175,15 +304,11 @@ QWORD File64GetBase(MFILE *fp)
 }
 
 
-// Open a file using fopen() parameters and return a FILE pointer.
+// Make an MFILE for an open FILE.  The FILE is closed on failure.
 
-MFILE *File64Open(char *fname, char *mode)
+static MFILE *NewMFile(FILE *fp, char *fname)
 {
     MFILE *mfp;
-    FILE *fp;
-
-    fp = FILE64_FOPEN(fname, mode);
-    if (!fp) return(NULL);
 
     mfp = malloc(sizeof(MFILE));
     if (!mfp)
@@ -191,32 +316,546 @@ MFILE *File64Open(char *fname, char *mode)
         fclose(fp);
         return(NULL);
     }
+    memset(mfp, 0, sizeof(MFILE));
     mfp->fp = fp;
     mfp->SeekBase = 0;
 
+    // Keep the name so that the file can be opened again
+    mfp->Name = malloc(strlen(fname) + 1);
+    if (!mfp->Name)
+    {
+        fclose(fp);
+        free(mfp);
+        return(NULL);
+    }
+    strcpy(mfp->Name, fname);
+
     return(mfp);
 }
 
 
+// Open a file using fopen() parameters and return a FILE pointer.
+
+MFILE *File64Open(char *fname, char *mode)
+{
+    FILE *fp;
+
+    fp = FILE64_FOPEN(fname, mode);
+    if (!fp) return(NULL);
+
+    return(NewMFile(fp, fname));
+}
+
+
+// Open another MFILE on the same open file as mfp.  The file is not
+// opened again by name, so it is still the same file if it has been
+// renamed or deleted.  Only positional reads and writes may be used
+// on the new MFILE because the two can share a file position.  Write
+// is TRUE if mfp was opened for writing and the new one will write.
+// If mfp is memory mapped, the new one is mapped too if possible.
+// Returns NULL on failure.
+
+MFILE *File64Dup(MFILE *mfp, int Write)
+{
+    MFILE *NewFp;
+    FILE *fp;
+    int fd;
+
+    if (!mfp) return(NULL);
+
+#if defined(_WIN32) || defined(__WIN32__)
+    if (Write)
+    {
+        // Positional writes move the file pointer of a Windows handle,
+        // and a duplicated handle shares it with the writer.  So the
+        // file is opened by name and must turn out to be the same one.
+        BY_HANDLE_FILE_INFORMATION info1, info2;
+
+        fp = FILE64_FOPEN(mfp->Name, "r+b");
+        if (!fp) return(NULL);
+
+        if (!GetFileInformationByHandle((HANDLE)_get_osfhandle(fileno(mfp->fp)), &info1) ||
+            !GetFileInformationByHandle((HANDLE)_get_osfhandle(fileno(fp)), &info2) ||
+            info1.dwVolumeSerialNumber != info2.dwVolumeSerialNumber ||
+            info1.nFileIndexHigh != info2.nFileIndexHigh ||
+            info1.nFileIndexLow != info2.nFileIndexLow)
+        {
+            fclose(fp);
+            return(NULL);
+        }
+    }
+    else
+    {
+        HANDLE hNew;
+
+        if (!DuplicateHandle(GetCurrentProcess(), (HANDLE)_get_osfhandle(fileno(mfp->fp)),
+                             GetCurrentProcess(), &hNew, 0, FALSE, DUPLICATE_SAME_ACCESS))
+            return(NULL);
+
+    #if defined(__BORLANDC__)
+        fd = _open_osfhandle((long) hNew, O_RDONLY);
+    #else
+        fd = _open_osfhandle((intptr_t) hNew, _O_RDONLY);
+    #endif
+        if (fd < 0)
+        {
+            CloseHandle(hNew);
+            return(NULL);
+        }
+
+        fp = fdopen(fd, "rb");
+        if (!fp)
+        {
+            close(fd);
+            return(NULL);
+        }
+    }
+#else
+    fd = dup(fileno(mfp->fp));
+    if (fd < 0) return(NULL);
+
+    fp = fdopen(fd, Write ? "wb" : "rb");   // "wb" does not truncate here
+    if (!fp)
+    {
+        close(fd);
+        return(NULL);
+    }
+#endif
+
+    NewFp = NewMFile(fp, mfp->Name);
+    if (NewFp && mfp->MapPtr)
+        File64Map(NewFp);   // if this fails, it works without the map
+
+    return(NewFp);
+}
+
+
+// Map an entire file opened for reading into memory.  Once mapped,
+// all reads and seeks are done on the memory image so that reading
+// a frame is just a memcpy() with no system calls.  The current
+// file position is carried over.  Returns 0 if OK, else non-zero
+// and the file stays in normal stdio mode.  This will fail on 32 bit
+// compiles if the file is too big to fit in the address space.
+
+int File64Map(MFILE *mfp)
+{
+    QWORD size;
+
+    if (!mfp || mfp->MapPtr)
+        return(-1);
+
+#if defined(NO_HUGE_FILES)
+    return(-1);   // not supported
+
+#elif defined(_WIN32) || defined(__WIN32__)
+    {
+        HANDLE hFile = (HANDLE)_get_osfhandle(fileno(mfp->fp));
+        HANDLE hMap;
+        DWORD SizeHigh = 0, SizeLow;
+        void *ptr;
+
+        SizeLow = GetFileSize(hFile, &SizeHigh);
+        size = ((QWORD) SizeHigh << 32) | SizeLow;
+        if (size == 0 || size > (QWORD)(size_t) -1)
+            return(-1);   // empty or too large for this address space
+
+        hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!hMap) return(-1);
+
+        ptr = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+        if (!ptr)
+        {
+            CloseHandle(hMap);
+            return(-1);
+        }
+        mfp->hMap = (void *) hMap;
+        mfp->MapPtr = (BYTE *) ptr;
+    }
+#else
+    {
+        struct stat st;
+        void *ptr;
+
+        if (fstat(fileno(mfp->fp), &st) != 0)
+            return(-1);
+
+        size = (QWORD) st.st_size;
+        if (size == 0 || size > (QWORD)(size_t) -1)
+            return(-1);   // empty or too large for this address space
+
+        ptr = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fileno(mfp->fp), 0);
+        if (ptr == MAP_FAILED)
+            return(-1);
+        mfp->MapPtr = (BYTE *) ptr;
+    }
+#endif
+
+    mfp->MapSize = size;
+    mfp->MapPos = File64Qtell(mfp);   // still using stdio here
+
+    return(0);
+}
+
+
+// Get the size of the open file and what tells if it has been changed
+// or replaced: the last modification time, the last status change time
+// and the file serial number (inode).  The times are only good for
+// comparing.  On POSIX they are in nanoseconds if the system keeps
+// them, else in seconds.  On Windows they are in 100ns FILETIME units,
+// CTime is the creation time and FileId is the NTFS file index.  Any
+// of the return pointers may be NULL.
+// Returns 0 if OK, else non-zero.
+
+int File64Stat(MFILE *mfp, QWORD *Size, QWORD *MTime, QWORD *CTime, QWORD *FileId)
+{
+    if (!mfp)
+        return(-1);
+
+#if defined(_WIN32) || defined(__WIN32__)
+    {
+        HANDLE hFile = (HANDLE)_get_osfhandle(fileno(mfp->fp));
+        BY_HANDLE_FILE_INFORMATION info;
+
+        if (!GetFileInformationByHandle(hFile, &info))
+            return(-1);
+
+        if (Size)
+            *Size = ((QWORD) info.nFileSizeHigh << 32) | info.nFileSizeLow;
+        if (MTime)
+            *MTime = ((QWORD) info.ftLastWriteTime.dwHighDateTime << 32) |
+                     info.ftLastWriteTime.dwLowDateTime;
+        if (CTime)
+            *CTime = ((QWORD) info.ftCreationTime.dwHighDateTime << 32) |
+                     info.ftCreationTime.dwLowDateTime;
+        if (FileId)
+            *FileId = ((QWORD) info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    }
+#else
+    {
+        struct stat st;
+
+        if (fstat(fileno(mfp->fp), &st) != 0)
+            return(-1);
+
+        if (Size) *Size = (QWORD) st.st_size;
+        if (MTime) *MTime = MTIME_NS(st);
+        if (CTime) *CTime = CTIME_NS(st);
+        if (FileId) *FileId = (QWORD) st.st_ino;
+    }
+#endif
+
+    return(0);
+}
+
+
+// Return a pointer into the memory mapping for len bytes starting
+// at the absolute file address AbsAddr.  The base address and file
+// position are not used or modified.  Returns NULL if the file is
+// not mapped or if the range is not entirely inside the file.
+
+BYTE *File64MapPtr(MFILE *mfp, QWORD AbsAddr, DWORD len)
+{
+    if (!mfp->MapPtr || AbsAddr > mfp->MapSize ||
+        (QWORD) len > mfp->MapSize - AbsAddr)
+        return(NULL);
+
+    return(mfp->MapPtr + AbsAddr);
+}
+
+
+// Remove the memory mapping if there is one.
+
+static void File64Unmap(MFILE *mfp)
+{
+    if (!mfp->MapPtr)
+        return;
+
+#if defined(_WIN32) || defined(__WIN32__)
+    UnmapViewOfFile(mfp->MapPtr);
+    CloseHandle((HANDLE) mfp->hMap);
+#elif !defined(NO_HUGE_FILES)
+    munmap(mfp->MapPtr, (size_t) mfp->MapSize);
+#endif
+    mfp->MapPtr = NULL;
+    mfp->hMap = NULL;
+}
+
+
+// Move the write buffer to the file position pos.  The buffer must
+// be empty.
+
+static void File64SetWBufPos(MFILE *mfp, QWORD pos)
+{
+    mfp->WBufPos = pos;
+
+#if defined(FILE64_DIRECT)
+    // Keep the block alignment in memory the same as in the file
+    if (mfp->Direct)
+    {
+        DIRECT_WRITER *dw = (DIRECT_WRITER *) mfp->Direct;
+
+        mfp->WBuf = dw->Buf[dw->Cur] + (DWORD)(pos % WBUF_ALIGN);
+    }
+#endif
+}
+
+
+#if defined(FILE64_DIRECT)
+
+// Write all len bytes at the file position pos of descriptor fd.
+// Returns 0 if OK, else error code.
+
+static int PWriteAll(int fd, BYTE *buf, DWORD len, QWORD pos)
+{
+    ssize_t ret;
+
+    while (len > 0)   // pwrite() is allowed to write less
+    {
+        ret = pwrite(fd, buf, len, (off_t) pos);
+        if (ret <= 0)
+            return(AVIERR_CANT_WRITE_FILE);
+        buf += ret;
+        pos += (QWORD) ret;
+        len -= (DWORD) ret;
+    }
+
+    return(AVIERR_NO_ERROR);
+}
+
+
+// Open a second descriptor with O_DIRECT on the file open in mfp.
+// O_DIRECT cannot be turned on for a dup() of the stdio descriptor
+// without changing that one too, so the file is opened again.  Going
+// through /proc gets the same file even if it has been renamed or
+// deleted.  Where there is no /proc, the name is used, and it has to
+// still be the same file.  Returns the descriptor, or -1 on failure.
+
+static int OpenDirect(MFILE *mfp)
+{
+    struct stat st1, st2;
+    char path[40];
+    int fd;
+
+    sprintf(path, "/proc/self/fd/%d", fileno(mfp->fp));
+    fd = open(path, O_WRONLY | O_DIRECT);
+    if (fd < 0)
+        fd = open(mfp->Name, O_WRONLY | O_DIRECT);
+    if (fd < 0)
+        return(-1);
+
+    if (fstat(fd, &st1) != 0 || fstat(fileno(mfp->fp), &st2) != 0 ||
+        st1.st_dev != st2.st_dev || st1.st_ino != st2.st_ino)
+    {
+        close(fd);
+        return(-1);
+    }
+
+    return(fd);
+}
+
+
+#if !defined(AVI_NO_THREADS)
+// The O_DIRECT writer thread.  It writes each block of buffer that
+// DirectStart() gives it while the caller fills the other buffer.
+
+static void DirectWriter(void *arg)
+{
+    DIRECT_WRITER *dw = (DIRECT_WRITER *) arg;
+
+    for (;;)
+    {
+        EventWait(dw->Go);
+        if (dw->Quit)
+            break;
+        if (PWriteAll(dw->fd, dw->IoBuf, dw->IoLen, dw->IoPos) != AVIERR_NO_ERROR)
+            dw->IoErr = AVIERR_CANT_WRITE_FILE;
+        EventSignal(dw->Done);
+    }
+}
+#endif
+
+
+// Wait for the writer thread to finish its block, if it has one.
+
+static void DirectWait(DIRECT_WRITER *dw)
+{
+    if (dw->Busy)
+    {
+        EventWait(dw->Done);
+        dw->Busy = FALSE;
+    }
+}
+
+
+// Start writing len bytes of whole blocks at the file position pos
+// with O_DIRECT.  The thread writes them while the caller goes on.
+// Without a thread, they are written before this returns.
+
+static void DirectStart(DIRECT_WRITER *dw, BYTE *buf, DWORD len, QWORD pos)
+{
+    DirectWait(dw);
+
+    if (!dw->Thread)
+    {
+        if (PWriteAll(dw->fd, buf, len, pos) != AVIERR_NO_ERROR)
+            dw->IoErr = AVIERR_CANT_WRITE_FILE;
+        return;
+    }
+
+    dw->IoBuf = buf;
+    dw->IoLen = len;
+    dw->IoPos = pos;
+    dw->Busy = TRUE;
+    EventSignal(dw->Go);
+}
+
+
+// Write out the buffer of a file written with O_DIRECT.  Only whole
+// blocks can go out with O_DIRECT.  A partial block at the front,
+// left by a seek, is written through the page cache.  If All is
+// FALSE, the buffer has filled up, so the whole blocks go to the
+// writer thread and a partial block at the end moves to the other
+// buffer to be finished there.  If All is TRUE, everything is
+// written before this returns, and the partial block at the end goes
+// through the page cache.  That only happens for the header and size
+// patches, reads and the end of the file.
+// Returns 0 if OK, else error code.
+
+static int DirectFlush(MFILE *mfp, int All)
+{
+    DIRECT_WRITER *dw = (DIRECT_WRITER *) mfp->Direct;
+    QWORD pos = mfp->WBufPos;
+    QWORD end = pos + mfp->WBufLen;
+    QWORD first = (pos + WBUF_ALIGN - 1) & ~(QWORD)(WBUF_ALIGN - 1);
+    QWORD last = end & ~(QWORD)(WBUF_ALIGN - 1);
+    BYTE *next;
+    int err;
+
+    if (first >= end)   // no whole block, only part of one
+    {
+        if (!All && first > end)
+            return(AVIERR_NO_ERROR);   // keep collecting
+        first = last = end;
+    }
+
+    DirectWait(dw);   // the other buffer is free after this
+
+    if (first > pos &&
+        PWriteAll(fileno(mfp->fp), mfp->WBuf, (DWORD)(first - pos), pos) != AVIERR_NO_ERROR)
+        dw->IoErr = AVIERR_CANT_WRITE_FILE;
+
+    if (last > first)
+        DirectStart(dw, mfp->WBuf + (DWORD)(first - pos), (DWORD)(last - first), first);
+
+    if (All)
+    {
+        DirectWait(dw);
+        if (end > last &&
+            PWriteAll(fileno(mfp->fp), mfp->WBuf + (DWORD)(last - pos),
+                      (DWORD)(end - last), last) != AVIERR_NO_ERROR)
+            dw->IoErr = AVIERR_CANT_WRITE_FILE;
+
+        mfp->WBufLen = 0;
+        File64SetWBufPos(mfp, end);
+
+        // pwrite() does not move the OS file position
+        File64RawSeek(mfp, end, SEEK_SET);
+    }
+    else
+    {
+        next = dw->Buf[dw->Cur ^ 1];
+        memcpy(next, mfp->WBuf + (DWORD)(last - pos), (size_t)(end - last));
+        dw->Cur ^= 1;
+        mfp->WBuf = next;
+        mfp->WBufPos = last;
+        mfp->WBufLen = (DWORD)(end - last);
+    }
+
+    err = dw->IoErr;
+    dw->IoErr = AVIERR_NO_ERROR;
+    return(err);
+}
+
+
+// Allocate the two aligned staging buffers for Size bytes of buffer.
+// WBuf can start up to one block into a buffer, so each has an extra
+// block.  Returns 0 if OK, else error code.
+
+static int DirectAlloc(BYTE **Buf, DWORD Size)
+{
+    void *p0, *p1;
+
+    if (posix_memalign(&p0, WBUF_ALIGN, Size + WBUF_ALIGN) != 0)
+        return(AVIERR_MALLOC);
+    if (posix_memalign(&p1, WBUF_ALIGN, Size + WBUF_ALIGN) != 0)
+    {
+        free(p0);
+        return(AVIERR_MALLOC);
+    }
+
+    Buf[0] = (BYTE *) p0;
+    Buf[1] = (BYTE *) p1;
+    return(AVIERR_NO_ERROR);
+}
+
+
+// Stop the writer thread and free everything for O_DIRECT.  The
+// buffer must have been flushed.
+
+static void DirectStop(MFILE *mfp)
+{
+    DIRECT_WRITER *dw = (DIRECT_WRITER *) mfp->Direct;
+
+    DirectWait(dw);
+    if (dw->Thread)
+    {
+        dw->Quit = TRUE;
+        EventSignal(dw->Go);
+        ThreadJoin(dw->Thread);
+    }
+    EventDestroy(dw->Go);
+    EventDestroy(dw->Done);
+    close(dw->fd);
+    free(dw->Buf[0]);
+    free(dw->Buf[1]);
+    free(dw);
+
+    mfp->Direct = NULL;
+    mfp->WBuf = NULL;
+}
+
+#endif   // FILE64_DIRECT
+
+
 // Close a file pointer.
 
 int  File64Close(MFILE *mfp)
 {
+    int err;
+
     if (!mfp)
         return(AVIERR_BAD_PARAMETER);
+    err = File64Flush(mfp);
+    File64Unmap(mfp);
+#if defined(FILE64_DIRECT)
+    if (mfp->Direct)
+        DirectStop(mfp);
+#endif
     FILE64_FCLOSE(mfp->fp);
+    free(mfp->WBuf);
+    free(mfp->Name);
     free(mfp);
 
-    return(AVIERR_NO_ERROR);
+    return(err);
 }
 
 
 
 
-// Read a block of bytes from a file.
+// Read a block of bytes from the OS file position.
 // Returns the number of bytes actually read.
 
-size_t File64Read(MFILE *mfp, void *buffer, int len)
+static size_t File64RawRead(MFILE *mfp, void *buffer, int len)
 {
 #if defined(USE_WINDOWS_FILE_IO)
     // use Windows API
@@ -232,31 +871,627 @@ size_t File64Read(MFILE *mfp, void *buffer, int len)
 }
 
 
-// Write a block of bytes to a file.
+// Read a block of bytes from a file.
+// Returns the number of bytes actually read.
+
+size_t File64Read(MFILE *mfp, void *buffer, int len)
+{
+    if (mfp->MapPtr)   // memory mapped
+    {
+        QWORD avail;
+
+        if (len <= 0 || mfp->MapPos >= mfp->MapSize)
+            return(0);   // EOF
+        avail = mfp->MapSize - mfp->MapPos;
+        if ((QWORD) len > avail) len = (int) avail;
+
+        memcpy(buffer, mfp->MapPtr + mfp->MapPos, (size_t) len);
+        mfp->MapPos += len;
+        return((size_t) len);
+    }
+
+    if (mfp->WBuf)   // read back through a write buffer
+    {
+        size_t cnt;
+
+        if (File64Flush(mfp) != AVIERR_NO_ERROR)
+            return(0);
+        cnt = File64RawRead(mfp, buffer, len);
+        File64SetWBufPos(mfp, mfp->WBufPos + cnt);
+        return(cnt);
+    }
+
+    return(File64RawRead(mfp, buffer, len));
+}
+
+
+// Write a block of bytes straight to the file with no buffering.
 // Returns the number of bytes actually written.
 
-size_t File64Write(MFILE *mfp, void *buffer, int len)
+static size_t File64RawWrite(MFILE *mfp, void *buffer, size_t len)
 {
 #if defined(USE_WINDOWS_FILE_IO)
     // use Windows API
     HANDLE hFile = (HANDLE)_get_osfhandle(fileno(mfp->fp));
     DWORD cnt = 0;
 
-    WriteFile(hFile, buffer, len, &cnt, NULL);
+    WriteFile(hFile, buffer, (DWORD) len, &cnt, NULL);
 
     return(cnt);
 #else
 
-    return(FILE64_FWRITE(buffer, 1, (size_t) len, mfp->fp));
+    return(FILE64_FWRITE(buffer, 1, len, mfp->fp));
 #endif
 }
 
 
-// This function bypasses the Base addressing and seeks
-// to an absolute 64 bit location in the file.
-// The Base Address is not used or modified.
+// Write out anything waiting in the write buffer.  The file position
+// ends up just past the data, where the logical position already was.
+// Returns 0 if OK, else error code.  On an error, the buffered data
+// is dropped so the buffer stays usable.
 
-int File64QseekFrom(MFILE *mfp, QWORD AbsAddr, int whence)
+int File64Flush(MFILE *mfp)
+{
+    size_t cnt;
+    DWORD len;
+
+    if (!mfp || !mfp->WBuf)
+        return(AVIERR_NO_ERROR);
+
+#if defined(FILE64_DIRECT)
+    if (mfp->Direct)
+        return(DirectFlush(mfp, TRUE));
+#endif
+
+    if (mfp->WBufLen == 0)
+        return(AVIERR_NO_ERROR);
+
+    len = mfp->WBufLen;
+    cnt = File64RawWrite(mfp, mfp->WBuf, len);
+    mfp->WBufPos += len;
+    mfp->WBufLen = 0;
+
+    return(cnt == len ? AVIERR_NO_ERROR : AVIERR_CANT_WRITE_FILE);
+}
+
+
+// Write out a write buffer that has filled up.  This is the same as
+// File64Flush() except with O_DIRECT, where the write goes on in the
+// background and a partial block may be left in the buffer.
+// Returns 0 if OK, else error code.
+
+static int File64FlushFull(MFILE *mfp)
+{
+#if defined(FILE64_DIRECT)
+    if (mfp->Direct)
+        return(DirectFlush(mfp, FALSE));
+#endif
+
+    return(File64Flush(mfp));
+}
+
+
+// Give a file opened for writing a write buffer of Size bytes, rounded
+// up to a multiple of WBUF_ALIGN.  Small writes collect in the buffer
+// and go to the file in one large write when it fills.  The buffer
+// ends fill on file positions that are a multiple of its size, so the
+// writes to the file are aligned after the first one.  The current
+// position is kept here too, so File64GetPos() does not need the OS.
+// A Size of 0 flushes and removes the buffer.  A memory mapped file
+// can't have one, and an O_DIRECT file must have one.
+// Returns 0 if OK, else error code.
+
+int File64SetWriteBuffer(MFILE *mfp, DWORD Size)
+{
+    BYTE *NewBuf = NULL;
+    int err;
+
+    if (!mfp || mfp->MapPtr || Size > 0x80000000UL)
+        return(AVIERR_BAD_PARAMETER);
+
+    Size = (Size + WBUF_ALIGN - 1) & ~(DWORD)(WBUF_ALIGN - 1);
+
+#if defined(FILE64_DIRECT)
+    if (mfp->Direct)   // swap both staging buffers
+    {
+        DIRECT_WRITER *dw = (DIRECT_WRITER *) mfp->Direct;
+        BYTE *NewPair[2];
+
+        if (Size == 0)
+            return(AVIERR_BAD_PARAMETER);
+        if (DirectAlloc(NewPair, Size) != AVIERR_NO_ERROR)
+            return(AVIERR_MALLOC);   // old buffers are kept
+
+        err = File64Flush(mfp);   // also waits for the thread
+        free(dw->Buf[0]);
+        free(dw->Buf[1]);
+        dw->Buf[0] = NewPair[0];
+        dw->Buf[1] = NewPair[1];
+        mfp->WBufSize = Size;
+        File64SetWBufPos(mfp, mfp->WBufPos);
+        return(err);
+    }
+#endif
+
+    if (Size)
+    {
+        NewBuf = (BYTE *) malloc(Size);
+        if (!NewBuf)
+            return(AVIERR_MALLOC);   // old buffer is kept
+    }
+
+    err = File64Flush(mfp);
+    free(mfp->WBuf);
+    mfp->WBuf = NULL;      // so File64Qtell() asks the OS
+    mfp->WBufSize = 0;
+    mfp->WBufLen = 0;
+    if (Size)
+    {
+        mfp->WBufPos = File64Qtell(mfp);
+        mfp->WBuf = NewBuf;
+        mfp->WBufSize = Size;
+    }
+
+    return(err);
+}
+
+
+// Write the rest of a buffered file with O_DIRECT so that it does not
+// fill the page cache.  The write buffer becomes two aligned staging
+// buffers.  One fills while a thread writes the whole blocks of the
+// other.  Partial blocks left by seeks and at the end of the file are
+// written normally.  Returns 0 if OK.  Otherwise nothing changes and
+// the file is written normally.  Not every system or file system can
+// do this, so a block is written past the end of the file as a test.
+
+int File64SetDirect(MFILE *mfp)
+{
+#if defined(FILE64_DIRECT)
+    DIRECT_WRITER *dw;
+    struct stat st;
+    QWORD TestPos;
+    int err;
+
+    if (!mfp || !mfp->WBuf || mfp->Direct)
+        return(AVIERR_BAD_PARAMETER);
+
+    dw = (DIRECT_WRITER *) malloc(sizeof(DIRECT_WRITER));
+    if (!dw)
+        return(AVIERR_MALLOC);
+    memset(dw, 0, sizeof(DIRECT_WRITER));
+
+    if (DirectAlloc(dw->Buf, mfp->WBufSize) != AVIERR_NO_ERROR)
+    {
+        free(dw);
+        return(AVIERR_MALLOC);
+    }
+
+    // Everything so far goes out the normal way
+    err = File64Flush(mfp);
+    fflush(mfp->fp);
+
+    dw->fd = OpenDirect(mfp);
+    if (err == AVIERR_NO_ERROR && dw->fd >= 0 && fstat(dw->fd, &st) == 0)
+    {
+        TestPos = ((QWORD) st.st_size + WBUF_ALIGN - 1) & ~(QWORD)(WBUF_ALIGN - 1);
+        memset(dw->Buf[0], 0, WBUF_ALIGN);
+        if (PWriteAll(dw->fd, dw->Buf[0], WBUF_ALIGN, TestPos) != AVIERR_NO_ERROR ||
+            ftruncate(dw->fd, st.st_size) != 0)
+            err = AVIERR_NOT_SUPPORTED;
+    }
+    else if (err == AVIERR_NO_ERROR)
+        err = AVIERR_NOT_SUPPORTED;
+
+    if (err != AVIERR_NO_ERROR)
+    {
+        if (dw->fd >= 0) close(dw->fd);
+        free(dw->Buf[0]);
+        free(dw->Buf[1]);
+        free(dw);
+        return(err);
+    }
+
+#if !defined(AVI_NO_THREADS)
+    // Without the thread, the blocks are written in line
+    dw->Go = EventCreate();
+    dw->Done = EventCreate();
+    if (dw->Go && dw->Done)
+        dw->Thread = ThreadCreate(DirectWriter, dw);
+#endif
+
+    free(mfp->WBuf);
+    mfp->Direct = dw;
+    File64SetWBufPos(mfp, mfp->WBufPos);
+    return(AVIERR_NO_ERROR);
+#else
+    return(mfp ? AVIERR_NOT_SUPPORTED : AVIERR_BAD_PARAMETER);
+#endif
+}
+
+
+// Write a block of bytes to a file.
+// Returns the number of bytes actually written.  With a write buffer,
+// this is the number of bytes taken, and a failed flush returns 0.
+
+size_t File64Write(MFILE *mfp, void *buffer, int len)
+{
+    BYTE *src = (BYTE *) buffer;
+    size_t done = 0;
+    DWORD room, n;
+
+    if (mfp->MapPtr)   // mappings are read only
+        return(0);
+
+    if (!mfp->WBuf)
+        return(File64RawWrite(mfp, buffer, (size_t) len));
+
+    while (len > 0)
+    {
+        // Bytes left before the buffer ends on an aligned file position
+        room = mfp->WBufSize - (DWORD)((mfp->WBufPos % mfp->WBufSize) + mfp->WBufLen);
+
+        if (mfp->WBufLen == 0 && (DWORD) len >= room && !mfp->Direct)
+        {
+            // Nothing to join with, so big blocks skip the copy
+            n = room + (((DWORD) len - room) / mfp->WBufSize) * mfp->WBufSize;
+            if (File64RawWrite(mfp, src, n) != n)
+                return(0);
+            mfp->WBufPos += n;
+        }
+        else
+        {
+            n = ((DWORD) len < room) ? (DWORD) len : room;
+            memcpy(mfp->WBuf + mfp->WBufLen, src, n);
+            mfp->WBufLen += n;
+            if (n == room && File64FlushFull(mfp) != AVIERR_NO_ERROR)
+                return(0);
+        }
+        src += n;
+        done += n;
+        len -= (int) n;
+    }
+
+    return(done);
+}
+
+
+// Write Count buffers straight to the file with no buffering, using
+// as few system calls as possible.  Returns the number of bytes
+// actually written.
+
+static size_t File64RawWritev(MFILE *mfp, AVI_IOVEC *vec, int Count)
+{
+    size_t done = 0;
+
+#if defined(_WIN32) || defined(__WIN32__)
+    int i;
+
+    // No gather write for normal files, so one write for each buffer
+    for (i = 0; i < Count; i++)
+    {
+        size_t cnt = File64RawWrite(mfp, vec[i].Buf, vec[i].Len);
+
+        done += cnt;
+        if (cnt != vec[i].Len) break;
+    }
+#else
+    struct iovec iv[WRITEV_MAX];
+    DWORD off = 0;    // bytes of vec[i] already written
+    QWORD pos;
+    ssize_t ret;
+    int i = 0, n;
+
+    // The stdio buffer must be empty and the OS position current
+    fflush(mfp->fp);
+    pos = mfp->WBuf ? mfp->WBufPos : File64RawTell(mfp);
+
+    while (i < Count)
+    {
+        for (n = 0; n < WRITEV_MAX && i + n < Count; n++)
+        {
+            iv[n].iov_base = vec[i + n].Buf + (n ? 0 : off);
+            iv[n].iov_len = vec[i + n].Len - (n ? 0 : off);
+        }
+
+        ret = writev(fileno(mfp->fp), iv, n);
+        if (ret <= 0) break;   // error
+        done += (size_t) ret;
+
+        // writev() is allowed to write less, so find where it stopped
+        while (i < Count && (size_t) ret >= vec[i].Len - off)
+        {
+            ret -= vec[i].Len - off;
+            off = 0;
+            i++;
+        }
+        off += (DWORD) ret;
+    }
+
+    // stdio keeps its own idea of the file position, so bring it up to date
+    FILE64_FSEEK(mfp->fp, pos + done, SEEK_SET);
+#endif
+
+    return(done);
+}
+
+
+// Gather write.  Write Count buffers one after the other, the same as
+// calling File64Write() for each one, but without copying them
+// together first.  With a write buffer, pieces that fit are copied in
+// as usual.  If they don't fit, what is buffered and all the pieces go
+// out in a single writev() where there is one.
+// Returns the number of bytes actually written.
+
+size_t File64Writev(MFILE *mfp, AVI_IOVEC *vec, int Count)
+{
+    AVI_IOVEC all[WRITEV_MAX];
+    size_t total = 0, done;
+    DWORD room;
+    int i;
+
+    if (mfp->MapPtr || Count <= 0)   // mappings are read only
+        return(0);
+
+    for (i = 0; i < Count; i++)
+        total += vec[i].Len;
+
+    if (!mfp->WBuf)
+        return(File64RawWritev(mfp, vec, Count));
+
+    if (mfp->Direct)   // O_DIRECT only writes from the staging buffers
+    {
+        for (i = 0, done = 0; i < Count; i++)
+        {
+            if (File64Write(mfp, vec[i].Buf, (int) vec[i].Len) != vec[i].Len)
+                break;
+            done += vec[i].Len;
+        }
+        return(done);
+    }
+
+    room = mfp->WBufSize - (DWORD)((mfp->WBufPos % mfp->WBufSize) + mfp->WBufLen);
+    if (total < room)   // it all fits, so just collect it
+    {
+        for (i = 0; i < Count; i++)
+        {
+            memcpy(mfp->WBuf + mfp->WBufLen, vec[i].Buf, vec[i].Len);
+            mfp->WBufLen += vec[i].Len;
+        }
+        return(total);
+    }
+
+    if (Count >= WRITEV_MAX)   // too many to add the buffer in front
+    {
+        if (File64Flush(mfp) != AVIERR_NO_ERROR)
+            return(0);
+        done = File64RawWritev(mfp, vec, Count);
+        mfp->WBufPos += done;
+        return(done);
+    }
+
+    all[0].Buf = mfp->WBuf;
+    all[0].Len = mfp->WBufLen;
+    for (i = 0; i < Count; i++)
+        all[i + 1] = vec[i];
+
+    done = File64RawWritev(mfp, all, Count + 1);
+    mfp->WBufPos += done;
+    done -= (done < all[0].Len) ? done : all[0].Len;
+    mfp->WBufLen = 0;
+
+    return(done);
+}
+
+
+// Return a pointer to len bytes of the write buffer at the current
+// file position so the caller can build data there instead of
+// copying it in with File64Write().  Nothing is written and the
+// position does not move until File64Commit().  The pointer is good
+// until the next call that writes, seeks or reads this MFILE.
+// Returns NULL if there is no write buffer or len is more than it holds.
+
+BYTE *File64Reserve(MFILE *mfp, DWORD len)
+{
+    if (!mfp->WBuf || len > mfp->WBufSize)
+        return(NULL);
+
+    // With O_DIRECT, a partial block can stay in the buffer
+    if (len > mfp->WBufSize - mfp->WBufLen &&
+        (File64FlushFull(mfp) != AVIERR_NO_ERROR ||
+         len > mfp->WBufSize - mfp->WBufLen))
+        return(NULL);
+
+    return(mfp->WBuf + mfp->WBufLen);
+}
+
+
+// Add len bytes that were put at the pointer from File64Reserve() to
+// the file, as if they had been given to File64Write().
+// Returns 0 if OK, else error code.
+
+int File64Commit(MFILE *mfp, DWORD len)
+{
+    if (!mfp->WBuf || len > mfp->WBufSize - mfp->WBufLen)
+        return(AVIERR_BAD_PARAMETER);
+
+    mfp->WBufLen += len;
+
+    // A reservation can run past the aligned end the buffer aims for,
+    // and everything else expects the buffer to stop short of it.
+    if (mfp->WBufLen >= mfp->WBufSize - (DWORD)(mfp->WBufPos % mfp->WBufSize))
+        return(File64FlushFull(mfp));
+
+    return(AVIERR_NO_ERROR);
+}
+
+
+// Positional read.  Read len bytes starting at the absolute 64 bit
+// location AbsAddr.  The Base Address and the current file position
+// used by File64Read() are not used or modified, so different threads
+// can call this at the same time on the same MFILE.  On Windows, the
+// OS file pointer moves, but nothing here depends on it.
+// Returns the number of bytes actually read.
+
+size_t File64PRead(MFILE *mfp, void *buffer, DWORD len, QWORD AbsAddr)
+{
+    if (mfp->MapPtr)   // memory mapped
+    {
+        if (AbsAddr >= mfp->MapSize)
+            return(0);   // EOF
+        if ((QWORD) len > mfp->MapSize - AbsAddr)
+            len = (DWORD)(mfp->MapSize - AbsAddr);
+
+        memcpy(buffer, mfp->MapPtr + AbsAddr, len);
+        return(len);
+    }
+
+    if (mfp->WBufLen && File64Flush(mfp) != AVIERR_NO_ERROR)
+        return(0);
+
+#if defined(_WIN32) || defined(__WIN32__)
+    {
+        HANDLE hFile = (HANDLE)_get_osfhandle(fileno(mfp->fp));
+        OVERLAPPED ov;
+        DWORD cnt = 0;
+
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)(AbsAddr & 0xFFFFFFFF);
+        ov.OffsetHigh = (DWORD)(AbsAddr >> 32);
+
+        if (!ReadFile(hFile, buffer, len, &cnt, &ov))
+            return(0);
+        return(cnt);
+    }
+#else
+    {
+        size_t done = 0;
+        ssize_t ret;
+
+        while (done < len)   // pread() is allowed to return less
+        {
+            ret = pread(fileno(mfp->fp), (BYTE *) buffer + done, len - done,
+                        (off_t)(AbsAddr + done));
+            if (ret <= 0) break;   // EOF or error
+            done += (size_t) ret;
+        }
+        return(done);
+    }
+#endif
+}
+
+
+// Positional write.  Write len bytes starting at the absolute 64 bit
+// location AbsAddr without using or changing the Base Address or the
+// current file position.  Anything still buffered by File64Write() is
+// flushed first so it cannot land on top of this data later.
+// Returns the number of bytes actually written.
+
+size_t File64PWrite(MFILE *mfp, void *buffer, DWORD len, QWORD AbsAddr)
+{
+    if (mfp->MapPtr)   // mappings are read only
+        return(0);
+
+    if (File64Flush(mfp) != AVIERR_NO_ERROR)
+        return(0);
+    fflush(mfp->fp);
+
+#if defined(_WIN32) || defined(__WIN32__)
+    {
+        HANDLE hFile = (HANDLE)_get_osfhandle(fileno(mfp->fp));
+        OVERLAPPED ov;
+        DWORD cnt = 0;
+
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)(AbsAddr & 0xFFFFFFFF);
+        ov.OffsetHigh = (DWORD)(AbsAddr >> 32);
+
+        if (!WriteFile(hFile, buffer, len, &cnt, &ov))
+            return(0);
+        return(cnt);
+    }
+#else
+    {
+        size_t done = 0;
+        ssize_t ret;
+
+        while (done < len)
+        {
+            ret = pwrite(fileno(mfp->fp), (BYTE *) buffer + done, len - done,
+                         (off_t)(AbsAddr + done));
+            if (ret <= 0) break;   // error
+            done += (size_t) ret;
+        }
+        return(done);
+    }
+#endif
+}
+
+
+// Reserve disk space for Len bytes at the absolute position Offset
+// without writing anything, so a file that grows a little at a time
+// is still laid out in large extents.  On Linux the file size does
+// not change.  Elsewhere the file may grow, and File64Truncate() must
+// cut it back.  The write buffer and file position are not touched.
+// Returns 0 if OK, else error code.
+
+int File64Allocate(MFILE *mfp, QWORD Offset, QWORD Len)
+{
+#if defined(__linux__) && !defined(NO_HUGE_FILES)
+    if (fallocate(fileno(mfp->fp), FALLOC_FL_KEEP_SIZE, (off_t) Offset, (off_t) Len) == 0)
+        return(AVIERR_NO_ERROR);
+    return(errno == ENOSPC ? AVIERR_CANT_WRITE_FILE : AVIERR_NOT_SUPPORTED);
+
+#elif !defined(_WIN32) && !defined(NO_HUGE_FILES) && \
+      defined(_POSIX_ADVISORY_INFO) && (_POSIX_ADVISORY_INFO > 0)
+    if (posix_fallocate(fileno(mfp->fp), (off_t) Offset, (off_t) Len) == 0)
+        return(AVIERR_NO_ERROR);
+    return(AVIERR_NOT_SUPPORTED);
+
+#else
+    return(AVIERR_NOT_SUPPORTED);
+#endif
+}
+
+
+// Cut the file off at Size bytes.  This gives back the space reserved
+// by File64Allocate() past the end of the data.  Anything buffered is
+// written first and the file position does not change.
+// Returns 0 if OK, else error code.
+
+int File64Truncate(MFILE *mfp, QWORD Size)
+{
+    int err;
+
+    if (mfp->MapPtr)   // mappings are read only
+        return(AVIERR_BAD_PARAMETER);
+
+    err = File64Flush(mfp);
+    if (err != AVIERR_NO_ERROR)
+        return(err);
+    fflush(mfp->fp);
+
+#if defined(_WIN32) || defined(__WIN32__)
+    {
+        HANDLE hFile = (HANDLE)_get_osfhandle(fileno(mfp->fp));
+        QWORD pos = File64Qtell(mfp);
+        BOOL ok;
+
+        File64RawSeek(mfp, Size, SEEK_SET);
+        ok = SetEndOfFile(hFile);
+        File64RawSeek(mfp, pos, SEEK_SET);
+        return(ok ? AVIERR_NO_ERROR : AVIERR_CANT_WRITE_FILE);
+    }
+#else
+    if (ftruncate(fileno(mfp->fp), (off_t) Size) != 0)
+        return(AVIERR_CANT_WRITE_FILE);
+    return(AVIERR_NO_ERROR);
+#endif
+}
+
+
+// Seek the OS file position without looking at the write buffer.
+
+static int File64RawSeek(MFILE *mfp, QWORD AbsAddr, int whence)
 {
 #if defined(USE_WINDOWS_FILE_IO)
     // use Windows API
@@ -278,16 +1513,10 @@ int File64QseekFrom(MFILE *mfp, QWORD AbsAddr, int whence)
 #endif
 }
 
-int File64Qseek(MFILE *mfp, QWORD AbsAddr)
-{
-    return(File64QseekFrom(mfp, AbsAddr, SEEK_SET));
-}
-
 
-// Return a full 64 bit file pointer to the current location
-// Base address is not used or modified
+// Return the OS file position without looking at the write buffer.
 
-QWORD File64Qtell(MFILE *fp)
+static QWORD File64RawTell(MFILE *fp)
 {
 #if defined(USE_WINDOWS_FILE_IO)
     // Use Windows API
@@ -301,7 +1530,67 @@ QWORD File64Qtell(MFILE *fp)
 #else
     return((QWORD) FILE64_FTELL(fp->fp));   // Get absolute offset
 #endif
+}
+
+
+// This function bypasses the Base addressing and seeks
+// to an absolute 64 bit location in the file.
+// The Base Address is not used or modified.
+
+int File64QseekFrom(MFILE *mfp, QWORD AbsAddr, int whence)
+{
+    if (mfp->MapPtr)   // memory mapped, just move the position
+    {
+        // Negative relative offsets arrive here sign extended so
+        // unsigned addition wraps to the correct result.
+        if (whence == SEEK_CUR)
+            AbsAddr += mfp->MapPos;
+        else if (whence == SEEK_END)
+            AbsAddr += mfp->MapSize;
+
+        mfp->MapPos = AbsAddr;
+        return(0);
+    }
+
+    if (mfp->WBuf)   // buffered writes, so the OS position is not current
+    {
+        if (whence == SEEK_CUR)
+        {
+            AbsAddr += mfp->WBufPos + mfp->WBufLen;
+            whence = SEEK_SET;
+        }
+        if (whence == SEEK_SET && AbsAddr == mfp->WBufPos + mfp->WBufLen)
+            return(0);   // already there, keep buffering
+        if (File64Flush(mfp) != AVIERR_NO_ERROR)
+            return(-1);
+    }
+
+    if (File64RawSeek(mfp, AbsAddr, whence) != 0)
+        return(-1);
+
+    if (mfp->WBuf)
+        File64SetWBufPos(mfp, (whence == SEEK_SET) ? AbsAddr : File64RawTell(mfp));
+    return(0);
+}
+
+int File64Qseek(MFILE *mfp, QWORD AbsAddr)
+{
+    return(File64QseekFrom(mfp, AbsAddr, SEEK_SET));
+}
+
+
+// Return a full 64 bit file pointer to the current location
+// Base address is not used or modified
+
+QWORD File64Qtell(MFILE *fp)
+{
+    if (fp->MapPtr)   // memory mapped
+        return(fp->MapPos);
+
+    if (fp->WBuf)     // buffered writes keep their own position
+        return(fp->WBufPos + fp->WBufLen);
 
+    return(File64RawTell(fp));
 }
 
 